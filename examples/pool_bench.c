@@ -0,0 +1,78 @@
+/**
+ * \file pool_bench.c
+ * \brief Contention benchmark comparing the pool backends.
+ *
+ * A number of threads hammer a shared pool, each repeatedly acquiring a small
+ * batch of objects, touching them, and releasing them again. The same workload
+ * is timed against the mutex, thread cached and lock-free backends.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+#include "tictoc.h"
+
+#define NUM_THREADS 8
+#define NUM_ROUNDS 200000
+#define BATCH_SIZE 8
+#define CAPACITY (NUM_THREADS * BATCH_SIZE)
+
+struct pool pl;
+
+void *worker_func(void *arg)
+{
+  size_t *objects[BATCH_SIZE];
+
+  for (size_t i = 0; i < NUM_ROUNDS; ++i) {
+    for (size_t j = 0; j < BATCH_SIZE; ++j) {
+      if ((objects[j] = pool_acquire(&pl)) == NULL) {
+        printf("Could not acquire object from pool.\n");
+        exit(1);
+      }
+      *objects[j] = i;
+    }
+    for (size_t j = 0; j < BATCH_SIZE; ++j) {
+      pool_release(&pl, objects[j]);
+    }
+  }
+
+  return NULL;
+}
+
+void run_bench(const char *name, unsigned flags)
+{
+  pthread_t threads[NUM_THREADS];
+
+  if (pool_init_flags(&pl, CAPACITY, sizeof(size_t), flags) != 0) {
+    printf("%-14s unsupported on this platform\n", name);
+    return;
+  }
+
+  tic();
+  for (size_t i = 0; i < NUM_THREADS; ++i) {
+    pthread_create(&threads[i], NULL, worker_func, NULL);
+  }
+  for (size_t i = 0; i < NUM_THREADS; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  double ms = toc();
+
+  double ops = 2.0 * NUM_THREADS * NUM_ROUNDS * BATCH_SIZE;
+  printf("%-14s %10.3f ms %10.2f Mops/s\n", name, ms, ops / ms / 1000.0);
+
+  pool_destroy(&pl);
+}
+
+int main(int argc, char *argv[])
+{
+  printf("%d threads, %d acquire/release pairs each\n", NUM_THREADS,
+         NUM_ROUNDS * BATCH_SIZE);
+
+  run_bench("mutex", POOL_ALIGN_CACHELINE);
+  run_bench("thread cached", POOL_ALIGN_CACHELINE | POOL_THREAD_CACHE);
+  run_bench("lock-free", POOL_ALIGN_CACHELINE | POOL_LOCKFREE);
+
+  return 0;
+}
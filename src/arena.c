@@ -0,0 +1,227 @@
+#include "arena.h"
+#include "error.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+void arena_init_common_(struct arena *a, size_t chunk_size);
+struct arena_chunk *arena_chunk_new_(size_t size);
+void arena_free_chunks_(struct arena *a);
+void arena_local_release_(void *ap);
+
+enum ct_err arena_init(struct arena *a, size_t chunk_size)
+{
+  int err;
+
+  arena_init_common_(a, chunk_size);
+
+  err = pthread_mutex_init(&a->lock, NULL);
+  if (err) { return CT_EMUTEX_INIT; }
+
+  err = pthread_key_create(&a->local_key, arena_local_release_);
+  if (err) { return CT_FAILURE; }
+
+  return CT_SUCCESS;
+}
+
+void arena_destroy(struct arena *a)
+{
+  struct arena *sub, *next;
+
+  pthread_key_delete(a->local_key);
+
+  for (sub = a->subs; sub != NULL; sub = next) {
+    next = sub->next_sub;
+    arena_free_chunks_(sub);
+    free(sub);
+  }
+
+  arena_free_chunks_(a);
+
+  pthread_mutex_destroy(&a->lock);
+}
+
+void *arena_alloc(struct arena *a, size_t size, size_t align)
+{
+  struct arena_chunk *c = a->cur, *next;
+  uintptr_t p;
+
+  if (c != NULL) {
+    p = (uintptr_t)(c->data + a->offset);
+    p = (p + align - 1) & ~(uintptr_t)(align - 1);
+    if (p + size <= (uintptr_t)(c->data + c->size)) {
+      a->offset = p + size - (uintptr_t)c->data;
+      return (void *)p;
+    }
+  }
+
+  // Allocation does not fit in the current chunk. Move on to the next chunk,
+  // inserting a fresh one if the next chunk is missing or too small.
+  size_t need = size + ((align > ARENA_CHUNK_ALIGN) ? align : 0);
+
+  next = (c == NULL) ? a->head : c->next;
+
+  if (next == NULL || next->size < need) {
+    struct arena_chunk *n =
+        arena_chunk_new_((need > a->chunk_size) ? need : a->chunk_size);
+    if (n == NULL) { return NULL; }
+
+    n->next = next;
+    if (c == NULL) { a->head = n; }
+    else {
+      c->next = n;
+    }
+    next = n;
+  }
+
+  a->cur = next;
+
+  p = ((uintptr_t)next->data + align - 1) & ~(uintptr_t)(align - 1);
+  a->offset = p + size - (uintptr_t)next->data;
+
+  return (void *)p;
+}
+
+struct arena_mark arena_mark(struct arena *a)
+{
+  return (struct arena_mark){.chunk = a->cur, .offset = a->offset};
+}
+
+void arena_rollback(struct arena *a, struct arena_mark m)
+{
+  // A mark taken before the first allocation has no chunk.
+  a->cur = (m.chunk != NULL) ? m.chunk : a->head;
+  a->offset = m.offset;
+}
+
+void arena_reset(struct arena *a)
+{
+  pthread_mutex_lock(&a->lock);
+
+  for (struct arena *sub = a->subs; sub != NULL; sub = sub->next_sub) {
+    sub->cur = sub->head;
+    sub->offset = 0;
+  }
+
+  pthread_mutex_unlock(&a->lock);
+
+  a->cur = a->head;
+  a->offset = 0;
+}
+
+struct arena *arena_local(struct arena *a)
+{
+  struct arena *sub = pthread_getspecific(a->local_key);
+
+  if (sub != NULL) { return sub; }
+
+  pthread_mutex_lock(&a->lock);
+
+  // Adopt the sub-arena of an exited thread, if there is one.
+  for (sub = a->subs; sub != NULL && sub->in_use; sub = sub->next_sub) {}
+
+  if (sub == NULL && (sub = malloc(sizeof(*sub))) != NULL) {
+    arena_init_common_(sub, a->chunk_size);
+    sub->parent = a;
+    sub->next_sub = a->subs;
+    a->subs = sub;
+  }
+
+  if (sub != NULL) { sub->in_use = 1; }
+
+  pthread_mutex_unlock(&a->lock);
+
+  if (sub != NULL && pthread_setspecific(a->local_key, sub) != 0) {
+    arena_local_release_(sub);
+    return NULL;
+  }
+
+  return sub;
+}
+
+/**
+ * \brief Initialize the allocation state of an arena or sub-arena.
+ * \memberof arena
+ * \private
+ *
+ * \param a Pointer to the arena.
+ * \param chunk_size Size of a chunk, in bytes, or 0 for the default.
+ */
+void arena_init_common_(struct arena *a, size_t chunk_size)
+{
+  a->head = a->cur = NULL;
+  a->offset = 0;
+  a->chunk_size = (chunk_size != 0) ? chunk_size : ARENA_DEFAULT_CHUNK_SIZE;
+
+  a->parent = NULL;
+  a->subs = a->next_sub = NULL;
+  a->in_use = 0;
+}
+
+/**
+ * \brief Allocate a chunk with size usable bytes, aligned to
+ * ARENA_CHUNK_ALIGN.
+ * \memberof arena
+ * \private
+ *
+ * \param size Usable size of the chunk, in bytes.
+ * \return Pointer to the chunk, or NULL if error.
+ */
+struct arena_chunk *arena_chunk_new_(size_t size)
+{
+  struct arena_chunk *c;
+  void *p;
+
+  size_t header =
+      (sizeof(*c) + ARENA_CHUNK_ALIGN - 1) & ~(size_t)(ARENA_CHUNK_ALIGN - 1);
+
+  if (posix_memalign(&p, ARENA_CHUNK_ALIGN, header + size) != 0) {
+    return NULL;
+  }
+
+  c = p;
+  c->next = NULL;
+  c->size = size;
+  c->data = (char *)p + header;
+
+  return c;
+}
+
+/**
+ * \brief Free every chunk of an arena.
+ * \memberof arena
+ * \private
+ *
+ * \param a Pointer to the arena.
+ */
+void arena_free_chunks_(struct arena *a)
+{
+  struct arena_chunk *c, *next;
+
+  for (c = a->head; c != NULL; c = next) {
+    next = c->next;
+    free(c);
+  }
+
+  a->head = a->cur = NULL;
+  a->offset = 0;
+}
+
+/**
+ * \brief Thread exit handler for a sub-arena. Marks the sub-arena as free for
+ * adoption by another thread.
+ * \memberof arena
+ * \private
+ *
+ * \param ap Pointer to the sub-arena, casted to void *
+ */
+void arena_local_release_(void *ap)
+{
+  struct arena *sub = ap;
+
+  pthread_mutex_lock(&sub->parent->lock);
+  sub->in_use = 0;
+  pthread_mutex_unlock(&sub->parent->lock);
+}
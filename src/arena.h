@@ -0,0 +1,153 @@
+/**
+ * \file arena.h
+ * \brief Bump-pointer arena allocator for short-lived scratch data.
+ *
+ * An arena hands out memory by bumping an offset into a chunk of storage.
+ * Nothing is freed individually. Instead, the arena is rolled back to a mark,
+ * or reset wholesale at the end of a phase, and its chunks are reused by the
+ * next phase without going back to malloc().
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "error.h"
+
+/** Default size of an arena chunk, in bytes. */
+#define ARENA_DEFAULT_CHUNK_SIZE (1u << 20)
+
+/** Alignment of the start of every arena chunk, in bytes. */
+#define ARENA_CHUNK_ALIGN 64
+
+/**
+ * \brief Allocate an array of n objects of the given type from an arena.
+ *
+ * \param a Pointer to the arena.
+ * \param type Type of the objects.
+ * \param n Number of objects.
+ * \return Pointer of type (type *) to the array, or NULL if error.
+ */
+#define ARENA_NEW(a, type, n)                                                  \
+  ((type *)arena_alloc((a), sizeof(type) * (n), __alignof__(type)))
+
+/**
+ * \brief Contiguous block of arena storage.
+ *
+ * \class arena_chunk
+ */
+struct arena_chunk {
+  struct arena_chunk *next; /**< Next chunk of the arena. */
+  size_t size;              /**< Usable size of the chunk, in bytes. */
+  char *data;               /**< Start of the usable storage. */
+};
+
+/**
+ * \brief Saved allocation state of an arena, see arena_mark().
+ */
+struct arena_mark {
+  struct arena_chunk *chunk;
+  size_t offset;
+};
+
+/**
+ * \brief Bump-pointer arena allocator.
+ *
+ * \class arena
+ *
+ * A single arena must not be used concurrently. Threads that allocate at the
+ * same time each use their own sub-arena, obtained with arena_local().
+ */
+struct arena {
+  struct arena_chunk *head; /**< First chunk. */
+  struct arena_chunk *cur;  /**< Chunk currently allocated from. */
+  size_t offset;            /**< Bytes of cur in use. */
+  size_t chunk_size;        /**< Size of newly allocated chunks, in bytes. */
+
+  /* Per-thread sub-arenas, see arena_local(). Internal use. */
+  struct arena *parent;    /**< Arena that this is a sub-arena of, or NULL. */
+  struct arena *subs;      /**< Sub-arenas of this arena. */
+  struct arena *next_sub;  /**< Next sibling sub-arena. */
+  int in_use;              /**< Whether a live thread owns this sub-arena. */
+  pthread_key_t local_key; /**< Key for calling thread's sub-arena. */
+  pthread_mutex_t lock;    /**< Protects the list of sub-arenas. */
+};
+
+/**
+ * \brief Initialize an arena. No memory is allocated until first use.
+ * \memberof arena
+ *
+ * \param a Pointer to the arena to initialize.
+ * \param chunk_size Size of a chunk, in bytes, or 0 for the default.
+ * \return 0 on success, non-zero on failure.
+ */
+enum ct_err arena_init(struct arena *a, size_t chunk_size);
+
+/**
+ * \brief Destroy arena referred to by a and all of its sub-arenas, freeing
+ * their storage and leaving it uninitialized.
+ * \memberof arena
+ *
+ * \param a Pointer to the arena to destroy.
+ */
+void arena_destroy(struct arena *a);
+
+/**
+ * \brief Allocate memory from an arena.
+ * \memberof arena
+ *
+ * \param a Pointer to the arena.
+ * \param size Size of the allocation, in bytes.
+ * \param align Alignment of the allocation, a power of two.
+ * \return Pointer to the allocated memory, or NULL if error.
+ */
+void *arena_alloc(struct arena *a, size_t size, size_t align);
+
+/**
+ * \brief Record the current allocation state of an arena.
+ * \memberof arena
+ *
+ * \param a Pointer to the arena.
+ * \return Mark to pass to arena_rollback().
+ */
+struct arena_mark arena_mark(struct arena *a);
+
+/**
+ * \brief Free everything allocated from an arena since a mark was taken.
+ * \memberof arena
+ *
+ * This takes constant time. Storage is kept for reuse.
+ *
+ * \param a Pointer to the arena.
+ * \param m Mark previously returned by arena_mark() for the same arena.
+ */
+void arena_rollback(struct arena *a, struct arena_mark m);
+
+/**
+ * \brief Free everything allocated from an arena and its sub-arenas.
+ * \memberof arena
+ *
+ * Storage is kept for reuse. Takes constant time per sub-arena, and must not
+ * be called concurrently with any other operation on the arena.
+ *
+ * \param a Pointer to the arena.
+ */
+void arena_reset(struct arena *a);
+
+/**
+ * \brief Get the calling thread's sub-arena of an arena, creating it if
+ * necessary.
+ * \memberof arena
+ *
+ * Sub-arenas share the chunk size of their parent and are reset and destroyed
+ * along with it. When a thread exits, its sub-arena is handed to the next
+ * thread that asks for one.
+ *
+ * \param a Pointer to the parent arena.
+ * \return Pointer to the sub-arena, or NULL if error.
+ */
+struct arena *arena_local(struct arena *a);
+
+#endif // ARENA_H
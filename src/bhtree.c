@@ -1,9 +1,21 @@
 #include "bhtree.h"
+#include "arena.h"
+#include "direct.h"
+#include "error.h"
+#include "pool.h"
+#include "radix.h"
+#include "threadpool.h"
 
+#include <assert.h>
 #include <math.h>
+#include <stdint.h>
 
 #define MINDIST 0.001
 
+// Entries of a group's interaction lists evaluated at a time
+#define BH_LIST_SIZE 1024
+#define BH_QUAD_LIST_SIZE 256
+
 int bh_tree_clear(struct bh_tree *tree)
 {
   pool_releaseall(&tree->node_pool);
@@ -17,6 +29,16 @@ int bh_tree_clear(struct bh_tree *tree)
     tree->root->children[i] = NULL;
   }
 
+  tree->nodes = NULL;
+  tree->num_nodes = 0;
+  tree->bodies = (struct bh_bodies){.count = 0};
+  tree->quad = NULL;
+  tree->vel = NULL;
+  tree->num_escaped = 0;
+
+  // Only a Morton build leaves the tree ready for a refit
+  tree->morton.sort.count = 0;
+
   return 0;
 }
 
@@ -39,16 +61,89 @@ int bh_tree_init(struct bh_tree *tree, size_t num_nodes)
 {
   int err;
 
-  if ((err = pool_init(&tree->node_pool, 10*num_nodes, sizeof(struct bh_node))) !=
-      0) {
+  if ((err = pool_init_flags(&tree->node_pool, num_nodes,
+                             sizeof(struct bh_node),
+                             POOL_THREAD_CACHE | POOL_HUGEPAGE)) != 0) {
     return err;
   }
 
+  if ((err = arena_init(&tree->scratch, 0)) != 0) { return err; }
+
+  tree->build_err = 0;
+  tree->opening = (struct bh_opening){.criterion = BH_OPEN_THETA,
+                                      .theta = BH_THETA,
+                                      .tolerance = BH_TOLERANCE,
+                                      .quadrupole = 0,
+                                      .single_precision = 0};
+
   bh_tree_clear(tree);
 
   return 0;
 }
 
+// Figure out which octant of the box [bb_min, bb_max] point p lies in, and
+// shrink the box to that octant.
+int bh_select_octant(struct bh_vec3 p, struct bh_vec3 *bb_min,
+                     struct bh_vec3 *bb_max)
+{
+  struct bh_vec3 midpoint = {.x = (bb_max->x + bb_min->x) / 2.0,
+                             .y = (bb_max->y + bb_min->y) / 2.0,
+                             .z = (bb_max->z + bb_min->z) / 2.0};
+
+  int octant = -1;
+  if (p.z < midpoint.z) { // Bottom layer of cube
+    bb_max->z = midpoint.z;
+    if (p.y < midpoint.y) {
+      bb_max->y = midpoint.y;
+      if (p.x < midpoint.x) {
+        bb_max->x = midpoint.x;
+        octant = 2;
+      }
+      else {
+        bb_min->x = midpoint.x;
+        octant = 3;
+      }
+    }
+    else {
+      bb_min->y = midpoint.y;
+      if (p.x < midpoint.x) {
+        bb_max->x = midpoint.x;
+        octant = 1;
+      }
+      else {
+        bb_min->x = midpoint.x;
+        octant = 0;
+      }
+    }
+  }
+  else { // Top layer of cube
+    bb_min->z = midpoint.z;
+    if (p.y < midpoint.y) {
+      bb_max->y = midpoint.y;
+      if (p.x < midpoint.x) {
+        bb_max->x = midpoint.x;
+        octant = 6;
+      }
+      else {
+        bb_min->x = midpoint.x;
+        octant = 7;
+      }
+    }
+    else {
+      bb_min->y = midpoint.y;
+      if (p.x < midpoint.x) {
+        bb_max->x = midpoint.x;
+        octant = 5;
+      }
+      else {
+        bb_min->x = midpoint.x;
+        octant = 4;
+      }
+    }
+  }
+  return octant;
+}
+
 int bh_tree_insert_impl(struct bh_tree *tree, struct bh_node *cur,
                         struct bh_vec3 bb_min, struct bh_vec3 bb_max,
                         struct bh_vec3 p, double mass)
@@ -68,62 +163,7 @@ int bh_tree_insert_impl(struct bh_tree *tree, struct bh_node *cur,
       }
     }
 
-    struct bh_vec3 midpoint = {.x = (bb_max.x + bb_min.x) / 2.0,
-                               .y = (bb_max.y + bb_min.y) / 2.0,
-                               .z = (bb_max.z + bb_min.z) / 2.0};
-
-    // Figure out which octant point lies in, and update bounding box
-    int octant = -1;
-    if (p.z < midpoint.z) { // Bottom layer of cube
-      bb_max.z = midpoint.z;
-      if (p.y < midpoint.y) {
-        bb_max.y = midpoint.y;
-        if (p.x < midpoint.x) {
-          bb_max.x = midpoint.x;
-          octant = 2;
-        }
-        else {
-          bb_min.x = midpoint.x;
-          octant = 3;
-        }
-      }
-      else {
-        bb_min.y = midpoint.y;
-        if (p.x < midpoint.x) {
-          bb_max.x = midpoint.x;
-          octant = 1;
-        }
-        else {
-          bb_min.x = midpoint.x;
-          octant = 0;
-        }
-      }
-    }
-    else { // Top layer of cube
-      bb_min.z = midpoint.z;
-      if (p.y < midpoint.y) {
-        bb_max.y = midpoint.y;
-        if (p.x < midpoint.x) {
-          bb_max.x = midpoint.x;
-          octant = 6;
-        }
-        else {
-          bb_min.x = midpoint.x;
-          octant = 7;
-        }
-      }
-      else {
-        bb_min.y = midpoint.y;
-        if (p.x < midpoint.x) {
-          bb_max.x = midpoint.x;
-          octant = 5;
-        }
-        else {
-          bb_min.x = midpoint.x;
-          octant = 4;
-        }
-      }
-    }
+    int octant = bh_select_octant(p, &bb_min, &bb_max);
 
     // Populate relevant child if null
     if (cur->children[octant] == NULL) {
@@ -140,21 +180,6 @@ int bh_tree_insert_impl(struct bh_tree *tree, struct bh_node *cur,
                                    p, mass)) != 0) {
       return err;
     }
-
-    // Update our centre of mass
-    cur->mass = 0;
-    cur->cm = (struct bh_vec3){0.0, 0.0, 0.0};
-    for (octant = 0; octant < 8; ++octant) {
-      if (cur->children[octant] != NULL) {
-        cur->cm.x += cur->children[octant]->cm.x;
-        cur->cm.y += cur->children[octant]->cm.y;
-        cur->cm.z += cur->children[octant]->cm.z;
-        cur->mass += cur->children[octant]->mass;
-      }
-    }
-    cur->cm.x /= cur->mass;
-    cur->cm.y /= cur->mass;
-    cur->cm.z /= cur->mass;
   }
   else {
     cur->type = LEAF;
@@ -169,39 +194,1758 @@ int bh_tree_insert_impl(struct bh_tree *tree, struct bh_node *cur,
 
 int bh_tree_insert(struct bh_tree *tree, struct bh_vec3 p, double mass)
 {
+  // Any flattened tree is stale until the next flatten
+  tree->nodes = NULL;
+  tree->num_nodes = 0;
+  tree->bodies.count = 0;
+  tree->morton.sort.count = 0;
+
   return bh_tree_insert_impl(tree, tree->root, tree->bb_min, tree->bb_max, p,
                              mass);
 }
 
-void bh_tree_solve_acc_impl(struct bh_node *node, struct bh_vec3 const *p,
-                            struct bh_vec3 *result, double cube_dim)
+// Argument to a parallel build task
+struct bh_build_arg {
+  struct bh_tree *tree;
+  struct bh_points points;
+  size_t task, num_tasks;
+};
+
+// Octant (see bhtree.h) -> whether it is the upper half along each axis
+static const int octant_xhi[8] = {1, 0, 0, 1, 1, 0, 0, 1};
+static const int octant_yhi[8] = {1, 1, 0, 0, 1, 1, 0, 0};
+static const int octant_zhi[8] = {0, 0, 0, 0, 1, 1, 1, 1};
+
+struct bh_vec3 bh_points_get(struct bh_points const *pts, size_t i)
+{
+  return (struct bh_vec3){pts->x[i * pts->stride], pts->y[i * pts->stride],
+                          pts->z[i * pts->stride]};
+}
+
+// Cell at depth BH_BUILD_DEPTH that point p lies in. The cell is found by
+// descending exactly as bh_tree_insert_impl() does, so that the two agree to
+// the last bit.
+unsigned bh_cell_of(struct bh_tree *tree, struct bh_vec3 p)
 {
-  double distsq = (node->cm.x - p->x) * (node->cm.x - p->x) +
-                  (node->cm.y - p->y) * (node->cm.y - p->y) +
-                  (node->cm.z - p->z) * (node->cm.z - p->z);
-  if (node->type == LEAF || (cube_dim / distsq < THETA_SQUARED)) {
-    double dist3 = sqrt(distsq);
-    if (dist3 < MINDIST) dist3 = MINDIST;
-    dist3 = dist3 * dist3 * dist3;
-    result->x += (node->cm.x - p->x) * node->mass / dist3;
-    result->y += (node->cm.y - p->y) * node->mass / dist3;
-    result->z += (node->cm.z - p->z) * node->mass / dist3;
+  struct bh_vec3 bb_min = tree->bb_min, bb_max = tree->bb_max;
+  unsigned cell = 0;
+
+  for (int depth = 0; depth < BH_BUILD_DEPTH; ++depth) {
+    cell = cell * 8 + bh_select_octant(p, &bb_min, &bb_max);
   }
-  else {
-    for (size_t octant = 0; octant < 8; ++octant) {
-      if (node->children[octant] != NULL) {
-        bh_tree_solve_acc_impl(node->children[octant], p, result,
-                               cube_dim / 2.0);
+  return cell;
+}
+
+// Bounding box of a cell at depth BH_BUILD_DEPTH
+void bh_cell_bb(struct bh_tree *tree, unsigned cell, struct bh_vec3 *bb_min,
+                struct bh_vec3 *bb_max)
+{
+  *bb_min = tree->bb_min;
+  *bb_max = tree->bb_max;
+
+  for (int depth = BH_BUILD_DEPTH - 1; depth >= 0; --depth) {
+    int octant = (cell >> (3 * depth)) & 7;
+    struct bh_vec3 midpoint = {.x = (bb_max->x + bb_min->x) / 2.0,
+                               .y = (bb_max->y + bb_min->y) / 2.0,
+                               .z = (bb_max->z + bb_min->z) / 2.0};
+    if (octant_xhi[octant]) { bb_min->x = midpoint.x; }
+    else {
+      bb_max->x = midpoint.x;
+    }
+    if (octant_yhi[octant]) { bb_min->y = midpoint.y; }
+    else {
+      bb_max->y = midpoint.y;
+    }
+    if (octant_zhi[octant]) { bb_min->z = midpoint.z; }
+    else {
+      bb_max->z = midpoint.z;
+    }
+  }
+}
+
+// Range of points handled by one of num_tasks binning / scatter tasks
+void bh_build_range(struct bh_build_arg const *arg, size_t *begin, size_t *end)
+{
+  *begin = arg->task * arg->points.count / arg->num_tasks;
+  *end = (arg->task + 1) * arg->points.count / arg->num_tasks;
+}
+
+// Clear the tree and allocate scratch storage for the build
+void bh_build_prepare_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_build *b = &tree->build;
+  size_t n = arg->points.count;
+
+  tree->build_err = bh_tree_clear(tree);
+
+  arena_reset(&tree->scratch);
+  b->cell = ARENA_NEW(&tree->scratch, unsigned, n);
+  b->order = ARENA_NEW(&tree->scratch, size_t, n);
+  b->hist = ARENA_NEW(&tree->scratch, size_t, arg->num_tasks * BH_BUILD_CELLS);
+
+  if (b->cell == NULL || b->order == NULL || b->hist == NULL) {
+    tree->build_err = -1;
+  }
+}
+
+// Compute the cell of each point in our range, and count points per cell
+void bh_build_bin_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_build *b = &tree->build;
+  size_t begin, end;
+
+  if (tree->build_err) { return; }
+
+  size_t *hist = b->hist + arg->task * BH_BUILD_CELLS;
+  for (size_t c = 0; c < BH_BUILD_CELLS; ++c) {
+    hist[c] = 0;
+  }
+
+  bh_build_range(arg, &begin, &end);
+  for (size_t i = begin; i != end; ++i) {
+    b->cell[i] = bh_cell_of(tree, bh_points_get(&arg->points, i));
+    hist[b->cell[i]] += 1;
+  }
+}
+
+// Turn the per-task histograms into the offsets at which each task scatters
+// the points of each cell, so that the sort is stable.
+void bh_build_offsets_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_build *b = &tree->build;
+  size_t offset = 0;
+
+  if (tree->build_err) { return; }
+
+  for (size_t c = 0; c < BH_BUILD_CELLS; ++c) {
+    b->cell_start[c] = offset;
+    for (size_t t = 0; t < arg->num_tasks; ++t) {
+      size_t count = b->hist[t * BH_BUILD_CELLS + c];
+      b->hist[t * BH_BUILD_CELLS + c] = offset;
+      offset += count;
+    }
+  }
+  b->cell_start[BH_BUILD_CELLS] = offset;
+}
+
+// Scatter the points of our range into cell order
+void bh_build_scatter_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_build *b = &tree->build;
+  size_t begin, end;
+
+  if (tree->build_err) { return; }
+
+  size_t *offsets = b->hist + arg->task * BH_BUILD_CELLS;
+
+  bh_build_range(arg, &begin, &end);
+  for (size_t i = begin; i != end; ++i) {
+    b->order[offsets[b->cell[i]]++] = i;
+  }
+}
+
+// Build the subtree of a single cell, by inserting its points in order
+void bh_build_subtree_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_build *b = &tree->build;
+  unsigned cell = arg->task;
+  struct bh_vec3 bb_min, bb_max;
+  struct bh_node *node;
+
+  b->cell_root[cell] = NULL;
+
+  if (tree->build_err || b->cell_start[cell] == b->cell_start[cell + 1]) {
+    return;
+  }
+
+  if ((node = pool_acquire(&tree->node_pool)) == NULL) {
+    __atomic_store_n(&tree->build_err, -1, __ATOMIC_RELAXED);
+    return;
+  }
+  node->type = EMPTY;
+
+  bh_cell_bb(tree, cell, &bb_min, &bb_max);
+
+  for (size_t k = b->cell_start[cell]; k != b->cell_start[cell + 1]; ++k) {
+    size_t i = b->order[k];
+    if (bh_tree_insert_impl(tree, node, bb_min, bb_max,
+                            bh_points_get(&arg->points, i),
+                            arg->points.mass[i * arg->points.stride]) != 0) {
+      __atomic_store_n(&tree->build_err, -1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  b->cell_root[cell] = node;
+}
+
+// Link up the cell subtrees below the node at the given depth and cell index
+// prefix. Returns NULL for an empty node.
+struct bh_node *bh_build_link(struct bh_tree *tree, int depth, unsigned prefix)
+{
+  struct bh_node *children[8], *last = NULL, *node;
+  int num_children = 0;
+
+  if (depth == BH_BUILD_DEPTH) { return tree->build.cell_root[prefix]; }
+
+  for (int octant = 0; octant < 8; ++octant) {
+    children[octant] = bh_build_link(tree, depth + 1, prefix * 8 + octant);
+    if (children[octant] != NULL) {
+      last = children[octant];
+      num_children += 1;
+    }
+  }
+
+  if (num_children == 0) { return NULL; }
+
+  // Inserting serially, a node holding a single position stays a leaf.
+  if (num_children == 1 && last->type == LEAF) { return last; }
+
+  if ((node = pool_acquire(&tree->node_pool)) == NULL) {
+    tree->build_err = -1;
+    return NULL;
+  }
+
+  node->type = INTERNAL;
+  for (int octant = 0; octant < 8; ++octant) {
+    node->children[octant] = children[octant];
+  }
+
+  return node;
+}
+
+// Link up the cell subtrees into the final tree
+void bh_build_link_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+
+  if (tree->build_err) { return; }
+
+  struct bh_node *root = bh_build_link(tree, 0, 0);
+  if (root != NULL) { tree->root = root; }
+}
+
+// Push a build task, with its own copy of arg
+enum ct_err bh_build_push(struct threadpool *tp, void (*func)(void *),
+                          struct bh_build_arg *arg)
+{
+  return threadpool_push_task(
+      tp, (struct task){.func = func,
+                        .arg = arg,
+                        .arg_size = sizeof(struct bh_build_arg)});
+}
+
+// Push one build task per range of points
+enum ct_err bh_build_push_phase(struct threadpool *tp, void (*func)(void *),
+                                struct bh_build_arg *arg)
+{
+  int err;
+
+  for (arg->task = 0; arg->task < arg->num_tasks; ++arg->task) {
+    if ((err = bh_build_push(tp, func, arg))) { return err; }
+  }
+
+  return CT_SUCCESS;
+}
+
+enum ct_err bh_tree_push_build(struct bh_tree *tree, struct threadpool *tp,
+                               struct bh_points points, size_t num_tasks)
+{
+  int err;
+  struct bh_build_arg arg = {
+      .tree = tree, .points = points, .task = 0, .num_tasks = num_tasks};
+
+  if (num_tasks == 0) { arg.num_tasks = 1; }
+
+  if ((err = bh_build_push(tp, bh_build_prepare_task, &arg))) { return err; }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  if ((err = bh_build_push_phase(tp, bh_build_bin_task, &arg))) { return err; }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  if ((err = bh_build_push(tp, bh_build_offsets_task, &arg))) { return err; }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  if ((err = bh_build_push_phase(tp, bh_build_scatter_task, &arg))) {
+    return err;
+  }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  for (arg.task = 0; arg.task < BH_BUILD_CELLS; ++arg.task) {
+    if ((err = bh_build_push(tp, bh_build_subtree_task, &arg))) { return err; }
+  }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  if ((err = bh_build_push(tp, bh_build_link_task, &arg))) { return err; }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  return bh_tree_push_flatten(tree, tp);
+}
+
+// Morton digit (x | y << 1 | z << 2) -> octant (see bhtree.h)
+static const int morton_octant[8] = {2, 3, 1, 0, 6, 7, 5, 4};
+
+// Spread the low BH_MORTON_BITS bits of v out to every third bit
+uint64_t bh_morton_spread(uint64_t v)
+{
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffff;
+  v = (v | v << 16) & 0x1f0000ff0000ff;
+  v = (v | v << 8) & 0x100f00f00f00f00f;
+  v = (v | v << 4) & 0x10c30c30c30c30c3;
+  v = (v | v << 2) & 0x1249249249249249;
+  return v;
+}
+
+// Quantize one coordinate to BH_MORTON_BITS bits
+uint64_t bh_morton_quantize(double x, double min, double scale)
+{
+  double q = (x - min) * scale;
+  if (q < 0.0) { return 0; }
+  if (q >= (double)(1u << BH_MORTON_BITS)) {
+    return (1u << BH_MORTON_BITS) - 1;
+  }
+  return (uint64_t)q;
+}
+
+uint64_t bh_morton_key(struct bh_tree *tree, struct bh_vec3 p)
+{
+  double scale =
+      (double)(1u << BH_MORTON_BITS) / (tree->bb_max.x - tree->bb_min.x);
+
+  return bh_morton_spread(bh_morton_quantize(p.x, tree->bb_min.x, scale)) |
+         bh_morton_spread(bh_morton_quantize(p.y, tree->bb_min.y, scale)) << 1 |
+         bh_morton_spread(bh_morton_quantize(p.z, tree->bb_min.z, scale)) << 2;
+}
+
+// Octant of the child at level + 1 that a key descends into from level
+int bh_morton_octant(uint64_t key, int level)
+{
+  return morton_octant[(key >> (3 * (BH_MORTON_BITS - 1 - level))) & 7];
+}
+
+// Number of levels below the root that two keys share
+int bh_morton_lcp(uint64_t a, uint64_t b)
+{
+  if (a == b) { return BH_MORTON_BITS; }
+  return (__builtin_clzll(a ^ b) - (64 - 3 * BH_MORTON_BITS)) / 3;
+}
+
+// Levels shared by key i and the next distinct key, or -1 if there is none
+int bh_morton_next_lcp(struct bh_morton *m, size_t i)
+{
+  size_t j = i + 1;
+  while (j < m->sort.count && m->sort.keys[j] == m->sort.keys[i]) {
+    ++j;
+  }
+  return (j < m->sort.count) ? bh_morton_lcp(m->sort.keys[i], m->sort.keys[j])
+                             : -1;
+}
+
+// Key i starts the nodes at levels lcp[i] + 1 to bh_morton_leaf_level(), in
+// depth-first order, ending with its leaf. Keys equal to their predecessor
+// start no nodes.
+int bh_morton_leaf_level(struct bh_morton *m, size_t i)
+{
+  int b = bh_morton_next_lcp(m, i);
+  return ((m->lcp[i] > b) ? m->lcp[i] : b) + 1;
+}
+
+// Clear the tree and allocate scratch storage for the build
+void bh_morton_prepare_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_morton *m = &tree->morton;
+  struct arena *scratch = &tree->scratch;
+  size_t n = arg->points.count;
+
+  tree->build_err = bh_tree_clear(tree);
+
+  arena_reset(scratch);
+  m->sort = (struct radix_sort){
+      .keys = ARENA_NEW(scratch, uint64_t, n),
+      .vals = ARENA_NEW(scratch, size_t, n),
+      .keys_tmp = ARENA_NEW(scratch, uint64_t, n),
+      .vals_tmp = ARENA_NEW(scratch, size_t, n),
+      .count = n,
+      .hist = ARENA_NEW(scratch, size_t, arg->num_tasks * RADIX_BUCKETS)};
+  m->lcp = ARENA_NEW(scratch, signed char, n);
+  m->leaf = ARENA_NEW(scratch, size_t, n);
+  m->chunks = ARENA_NEW(scratch, struct bh_morton_chunk, arg->num_tasks);
+  m->nodes = NULL;
+  m->num_nodes = 0;
+
+  if (m->sort.keys == NULL || m->sort.vals == NULL ||
+      m->sort.keys_tmp == NULL || m->sort.vals_tmp == NULL ||
+      m->sort.hist == NULL || m->lcp == NULL || m->leaf == NULL ||
+      m->chunks == NULL) {
+    tree->build_err = -1;
+  }
+
+  // Leave the sort with nothing to do
+  if (tree->build_err) { m->sort.count = 0; }
+}
+
+// Compute the Morton keys of our range of points
+void bh_morton_keys_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct radix_sort *sort = &tree->morton.sort;
+  size_t begin, end;
+
+  if (tree->build_err) { return; }
+
+  bh_build_range(arg, &begin, &end);
+  for (size_t i = begin; i != end; ++i) {
+    sort->keys[i] = bh_morton_key(tree, bh_points_get(&arg->points, i));
+    sort->vals[i] = i;
+  }
+}
+
+// Count the nodes and leaves started by our range of sorted keys, and find the
+// last node started at each level.
+void bh_morton_scan_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_morton *m = &tree->morton;
+  struct bh_morton_chunk *chunk = &m->chunks[arg->task];
+  uint64_t const *keys = m->sort.keys;
+  size_t begin, end, num_nodes = 0, num_leaves = 0;
+
+  if (tree->build_err) { return; }
+
+  for (int level = 0; level < BH_MORTON_LEVELS; ++level) {
+    chunk->open[level] = SIZE_MAX;
+  }
+
+  bh_build_range(arg, &begin, &end);
+  for (size_t i = begin; i != end; ++i) {
+    m->lcp[i] = (i == 0) ? -1 : bh_morton_lcp(keys[i - 1], keys[i]);
+    if (m->lcp[i] == BH_MORTON_BITS) { continue; }
+
+    int leaf_level = bh_morton_leaf_level(m, i);
+    for (int level = m->lcp[i] + 1; level <= leaf_level; ++level) {
+      chunk->open[level] = num_nodes++;
+    }
+    num_leaves += 1;
+  }
+
+  chunk->num_nodes = num_nodes;
+  chunk->num_leaves = num_leaves;
+}
+
+// Assign each range its first node, and the nodes left open before it, then
+// allocate the nodes. The root is the first of them.
+void bh_morton_offsets_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_morton *m = &tree->morton;
+  size_t carry[BH_MORTON_LEVELS], offset = 0, first_leaf = 0;
+
+  if (tree->build_err) { return; }
+
+  for (int level = 0; level < BH_MORTON_LEVELS; ++level) {
+    carry[level] = SIZE_MAX;
+  }
+
+  for (size_t t = 0; t < arg->num_tasks; ++t) {
+    struct bh_morton_chunk *chunk = &m->chunks[t];
+    chunk->offset = offset;
+    chunk->first_leaf = first_leaf;
+    first_leaf += chunk->num_leaves;
+    for (int level = 0; level < BH_MORTON_LEVELS; ++level) {
+      chunk->carry[level] = carry[level];
+      if (chunk->open[level] != SIZE_MAX) {
+        carry[level] = offset + chunk->open[level];
       }
     }
+    offset += chunk->num_nodes;
+  }
+
+  m->num_nodes = offset;
+  if (offset == 0) { return; }
+
+  if ((m->nodes = ARENA_NEW(&tree->scratch, struct bh_node, offset)) == NULL) {
+    tree->build_err = -1;
+    return;
   }
+
+  tree->root = &m->nodes[0];
 }
 
-void bh_tree_solve_acc(struct bh_tree *tree, struct bh_vec3 const *p,
-                       struct bh_vec3 *result)
+// Initialize the leaf of key i, merging the points of any equal keys
+void bh_morton_leaf(struct bh_morton *m, struct bh_points const *points,
+                    size_t i, struct bh_node *leaf)
 {
-  result->x = result->y = result->z = 0.0;
-  bh_tree_solve_acc_impl(tree->root, p, result,
-                         tree->bb_max.x - tree->bb_min.x);
+  uint64_t const *keys = m->sort.keys;
+  size_t const *index = m->sort.vals;
+  size_t j = index[i];
+
+  *leaf = (struct bh_node){.type = LEAF,
+                           .cm = bh_points_get(points, j),
+                           .mass = points->mass[j * points->stride]};
+
+  if (i + 1 == m->sort.count || keys[i + 1] != keys[i]) { return; }
+
+  // Coincident points are merged as by bh_tree_insert(), keeping the position
+  // exact. Distinct points sharing a key merge at their centre of mass.
+  struct bh_vec3 moment = {0.0, 0.0, 0.0};
+  int coincident = 1;
+  leaf->mass = 0.0;
+  for (size_t k = i; k < m->sort.count && keys[k] == keys[i]; ++k) {
+    struct bh_vec3 p = bh_points_get(points, index[k]);
+    double mass = points->mass[index[k] * points->stride];
+    coincident &= (p.x == leaf->cm.x && p.y == leaf->cm.y && p.z == leaf->cm.z);
+    moment.x += mass * p.x;
+    moment.y += mass * p.y;
+    moment.z += mass * p.z;
+    leaf->mass += mass;
+  }
+  if (!coincident) {
+    leaf->cm = (struct bh_vec3){moment.x / leaf->mass, moment.y / leaf->mass,
+                                moment.z / leaf->mass};
+  }
+}
+
+// Initialize the nodes started by our range of keys, and record the leaf of
+// each key
+void bh_morton_nodes_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_morton *m = &tree->morton;
+  struct bh_node *node;
+  size_t begin, end, leaf;
+
+  if (tree->build_err) { return; }
+
+  node = m->nodes + m->chunks[arg->task].offset;
+  leaf = m->chunks[arg->task].first_leaf;
+
+  bh_build_range(arg, &begin, &end);
+  for (size_t i = begin; i != end; ++i) {
+    // A key equal to its predecessor shares its leaf, in an earlier range
+    // if it is the first of ours.
+    if (m->lcp[i] == BH_MORTON_BITS) {
+      m->leaf[i] = leaf - 1;
+      continue;
+    }
+    m->leaf[i] = leaf++;
+
+    int leaf_level = bh_morton_leaf_level(m, i);
+    for (int level = m->lcp[i] + 1; level < leaf_level; ++level) {
+      *node++ = (struct bh_node){.type = INTERNAL};
+    }
+    bh_morton_leaf(m, &arg->points, i, node++);
+  }
+}
+
+// Link the nodes started by our range of keys into their parents. The first
+// node a key starts hangs off the last node started at the level above,
+// further nodes off their predecessor.
+void bh_morton_link_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_morton *m = &tree->morton;
+  struct bh_morton_chunk *chunk;
+  size_t open[BH_MORTON_LEVELS], next, begin, end;
+
+  if (tree->build_err) { return; }
+
+  chunk = &m->chunks[arg->task];
+  next = chunk->offset;
+  for (int level = 0; level < BH_MORTON_LEVELS; ++level) {
+    open[level] = chunk->carry[level];
+  }
+
+  bh_build_range(arg, &begin, &end);
+  for (size_t i = begin; i != end; ++i) {
+    if (m->lcp[i] == BH_MORTON_BITS) { continue; }
+
+    int leaf_level = bh_morton_leaf_level(m, i);
+    for (int level = m->lcp[i] + 1; level <= leaf_level; ++level) {
+      if (level > 0) {
+        int octant = bh_morton_octant(m->sort.keys[i], level - 1);
+        m->nodes[open[level - 1]].children[octant] = &m->nodes[next];
+      }
+      open[level] = next++;
+    }
+  }
+}
+
+enum ct_err bh_tree_push_build_morton(struct bh_tree *tree,
+                                      struct threadpool *tp,
+                                      struct bh_points points,
+                                      size_t num_tasks)
+{
+  int err;
+  struct bh_build_arg arg = {
+      .tree = tree, .points = points, .task = 0, .num_tasks = num_tasks};
+
+  if (num_tasks == 0) { arg.num_tasks = 1; }
+
+  if ((err = bh_build_push(tp, bh_morton_prepare_task, &arg))) { return err; }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  if ((err = bh_build_push_phase(tp, bh_morton_keys_task, &arg))) {
+    return err;
+  }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  err = radix_sort_push(&tree->morton.sort, tp, 3 * BH_MORTON_BITS,
+                        arg.num_tasks);
+  if (err) { return err; }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  if ((err = bh_build_push_phase(tp, bh_morton_scan_task, &arg))) {
+    return err;
+  }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  if ((err = bh_build_push(tp, bh_morton_offsets_task, &arg))) { return err; }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  if ((err = bh_build_push_phase(tp, bh_morton_nodes_task, &arg))) {
+    return err;
+  }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  if ((err = bh_build_push_phase(tp, bh_morton_link_task, &arg))) {
+    return err;
+  }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  return bh_tree_push_flatten(tree, tp);
 }
 
+// Collect the subtrees to flatten in parallel, in depth-first order
+void bh_flatten_collect(struct bh_flatten *f, struct bh_node *node, int depth,
+                        double size)
+{
+  if (node->type == LEAF || depth == BH_BUILD_DEPTH) {
+    f->subtree[f->num_subtrees] = node;
+    f->subtree_size[f->num_subtrees] = size;
+    f->num_subtrees += 1;
+    return;
+  }
+  for (int digit = 0; digit < 8; ++digit) {
+    struct bh_node *child = node->children[morton_octant[digit]];
+    if (child != NULL) { bh_flatten_collect(f, child, depth + 1, size / 2.0); }
+  }
+}
+
+// Count the nodes of the flattened subtree of node, and add its bodies to
+// *num_bodies. Counts as bh_flatten_write() writes.
+size_t bh_flatten_count(struct bh_node const *node, size_t *num_bodies)
+{
+  size_t count = 1, first_body = *num_bodies;
+
+  if (node->type != INTERNAL) {
+    *num_bodies += 1;
+    return 1;
+  }
+  for (int octant = 0; octant < 8; ++octant) {
+    if (node->children[octant] != NULL) {
+      count += bh_flatten_count(node->children[octant], num_bodies);
+    }
+  }
+  return (*num_bodies - first_body <= BH_LEAF_SIZE) ? 1 : count;
+}
+
+// Compute the moments of a leaf from its bodies
+void bh_flatten_leaf_moments(struct bh_cnode *c, struct bh_bodies const *b)
+{
+  uint32_t end = c->first_body + c->num_bodies;
+  struct bh_vec3 moment = {0.0, 0.0, 0.0};
+
+  c->mass = 0.0;
+  for (uint32_t j = c->first_body; j != end; ++j) {
+    moment.x += b->mass[j] * b->x[j];
+    moment.y += b->mass[j] * b->y[j];
+    moment.z += b->mass[j] * b->z[j];
+    c->mass += b->mass[j];
+  }
+  c->cm = (struct bh_vec3){moment.x / c->mass, moment.y / c->mass,
+                           moment.z / c->mass};
+
+  c->extent = 0.0;
+  for (uint32_t j = c->first_body; j != end; ++j) {
+    double extent = sqrt((b->x[j] - c->cm.x) * (b->x[j] - c->cm.x) +
+                         (b->y[j] - c->cm.y) * (b->y[j] - c->cm.y) +
+                         (b->z[j] - c->cm.z) * (b->z[j] - c->cm.z));
+    if (extent > c->extent) { c->extent = extent; }
+  }
+}
+
+// Compute the moments of node i from those of its children. Visiting nodes
+// in reverse depth-first order handles children before their parents.
+void bh_flatten_moments(struct bh_cnode *nodes, struct bh_bodies const *b,
+                        uint32_t i)
+{
+  struct bh_cnode *c = &nodes[i];
+  struct bh_vec3 moment = {0.0, 0.0, 0.0};
+
+  // The moments of a single body are exact as written
+  if (c->num_children == 0) {
+    if (c->num_bodies > 1) { bh_flatten_leaf_moments(c, b); }
+    return;
+  }
+
+  c->mass = 0.0;
+  for (uint32_t child = i + 1; child != c->next; child = nodes[child].next) {
+    moment.x += nodes[child].mass * nodes[child].cm.x;
+    moment.y += nodes[child].mass * nodes[child].cm.y;
+    moment.z += nodes[child].mass * nodes[child].cm.z;
+    c->mass += nodes[child].mass;
+  }
+  c->cm = (struct bh_vec3){moment.x / c->mass, moment.y / c->mass,
+                           moment.z / c->mass};
+
+  c->extent = 0.0;
+  for (uint32_t child = i + 1; child != c->next; child = nodes[child].next) {
+    struct bh_cnode const *d = &nodes[child];
+    double extent = sqrt((d->cm.x - c->cm.x) * (d->cm.x - c->cm.x) +
+                         (d->cm.y - c->cm.y) * (d->cm.y - c->cm.y) +
+                         (d->cm.z - c->cm.z) * (d->cm.z - c->cm.z)) +
+                    d->extent;
+    if (extent > c->extent) { c->extent = extent; }
+  }
+}
+
+// Add the quadrupole of mass at offset d from a centre to Q
+static inline void bh_quad_add(double *Q, double mass, double dx, double dy,
+                               double dz)
+{
+  double rsq = dx * dx + dy * dy + dz * dz;
+
+  Q[0] += mass * (3.0 * dx * dx - rsq);
+  Q[1] += mass * (3.0 * dy * dy - rsq);
+  Q[2] += mass * (3.0 * dz * dz - rsq);
+  Q[3] += mass * 3.0 * dx * dy;
+  Q[4] += mass * 3.0 * dx * dz;
+  Q[5] += mass * 3.0 * dy * dz;
+}
+
+// Compute the quadrupole of node i about its centre of mass, from its bodies
+// or from the quadrupoles of its children, once its moments are known
+void bh_flatten_quad(struct bh_tree *tree, uint32_t i)
+{
+  struct bh_cnode const *nodes = tree->nodes, *c = &nodes[i];
+  struct bh_bodies const *b = &tree->bodies;
+  double *Q = tree->quad + 6 * (size_t)i;
+
+  for (int k = 0; k < 6; ++k) {
+    Q[k] = 0.0;
+  }
+
+  if (c->num_children == 0) {
+    for (uint32_t j = c->first_body; j != c->first_body + c->num_bodies;
+         ++j) {
+      bh_quad_add(Q, b->mass[j], b->x[j] - c->cm.x, b->y[j] - c->cm.y,
+                  b->z[j] - c->cm.z);
+    }
+    return;
+  }
+
+  // Parallel axis theorem: a child's quadrupole plus that of its mass at its
+  // centre
+  for (uint32_t child = i + 1; child != c->next; child = nodes[child].next) {
+    struct bh_cnode const *d = &nodes[child];
+    double const *Qc = tree->quad + 6 * (size_t)child;
+    for (int k = 0; k < 6; ++k) {
+      Q[k] += Qc[k];
+    }
+    bh_quad_add(Q, d->mass, d->cm.x - c->cm.x, d->cm.y - c->cm.y,
+                d->cm.z - c->cm.z);
+  }
+}
+
+// Number of bodies below node, counting no further than limit + 1
+size_t bh_flatten_bodies(struct bh_node const *node, size_t limit)
+{
+  size_t count = 0;
+
+  if (node->type != INTERNAL) { return 1; }
+  for (int octant = 0; octant < 8 && count <= limit; ++octant) {
+    if (node->children[octant] != NULL) {
+      count += bh_flatten_bodies(node->children[octant], limit - count);
+    }
+  }
+  return count;
+}
+
+// Write the bodies below node to b from *body on
+void bh_flatten_gather(struct bh_bodies *b, uint32_t *body,
+                       struct bh_node const *node)
+{
+  if (node->type != INTERNAL) {
+    b->x[*body] = node->cm.x;
+    b->y[*body] = node->cm.y;
+    b->z[*body] = node->cm.z;
+    b->mass[*body] = node->mass;
+    *body += 1;
+    return;
+  }
+  for (int digit = 0; digit < 8; ++digit) {
+    struct bh_node const *child = node->children[morton_octant[digit]];
+    if (child != NULL) { bh_flatten_gather(b, body, child); }
+  }
+}
+
+// Write the subtree of node to nodes[i], and its bodies to b from *body on.
+// Return the index following the subtree.
+uint32_t bh_flatten_write(struct bh_cnode *nodes, uint32_t i,
+                          struct bh_bodies *b, uint32_t *body,
+                          struct bh_node const *node, double size)
+{
+  struct bh_cnode *c = &nodes[i];
+  uint32_t next = i + 1;
+
+  *c = (struct bh_cnode){.cm = node->cm,
+                         .mass = node->mass,
+                         .size = size,
+                         .extent = 0.0,
+                         .num_children = 0,
+                         .first_body = *body};
+
+  if (node->type == INTERNAL &&
+      bh_flatten_bodies(node, BH_LEAF_SIZE) > BH_LEAF_SIZE) {
+    for (int digit = 0; digit < 8; ++digit) {
+      struct bh_node const *child = node->children[morton_octant[digit]];
+      if (child != NULL) {
+        next = bh_flatten_write(nodes, next, b, body, child, size / 2.0);
+        c->num_children += 1;
+      }
+    }
+  }
+  else {
+    bh_flatten_gather(b, body, node);
+  }
+
+  c->num_bodies = *body - c->first_body;
+  c->next = next;
+  return next;
+}
+
+// Write the nodes above the parallel subtrees, and reserve space for the
+// subtrees, which are visited in the same order as by bh_flatten_collect().
+uint32_t bh_flatten_layout(struct bh_flatten *f, struct bh_cnode *nodes,
+                           uint32_t i, uint32_t *body,
+                           struct bh_node const *node, int depth, double size,
+                           size_t *subtree)
+{
+  if (node->type == LEAF || depth == BH_BUILD_DEPTH) {
+    f->subtree_offset[*subtree] = i;
+    f->subtree_first_body[*subtree] = *body;
+    *body += f->subtree_bodies[*subtree];
+    return i + f->subtree_count[(*subtree)++];
+  }
+
+  struct bh_cnode *c = &nodes[i];
+  uint32_t next = i + 1;
+
+  *c = (struct bh_cnode){.size = size, .num_children = 0, .first_body = *body};
+  f->top[f->num_top++] = i;
+
+  for (int digit = 0; digit < 8; ++digit) {
+    struct bh_node const *child = node->children[morton_octant[digit]];
+    if (child != NULL) {
+      next = bh_flatten_layout(f, nodes, next, body, child, depth + 1,
+                               size / 2.0, subtree);
+      c->num_children += 1;
+    }
+  }
+
+  c->num_bodies = *body - c->first_body;
+  c->next = next;
+  return next;
+}
+
+// Find the subtrees to flatten in parallel
+void bh_flatten_collect_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+
+  tree->flatten.num_subtrees = 0;
+  tree->flatten.num_top = 0;
+  tree->nodes = NULL;
+  tree->quad = NULL;
+  tree->num_nodes = 0;
+  tree->bodies = (struct bh_bodies){.count = 0};
+
+  if (tree->build_err || tree->root->type == EMPTY) { return; }
+
+  bh_flatten_collect(&tree->flatten, tree->root, 0,
+                     tree->bb_max.x - tree->bb_min.x);
+}
+
+// Count the nodes and bodies of one subtree
+void bh_flatten_count_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_flatten *f = &arg->tree->flatten;
+
+  if (arg->tree->build_err || arg->task >= f->num_subtrees) { return; }
+
+  f->subtree_bodies[arg->task] = 0;
+  f->subtree_count[arg->task] =
+      bh_flatten_count(f->subtree[arg->task], &f->subtree_bodies[arg->task]);
+}
+
+// Allocate the flattened tree, and write its top levels
+void bh_flatten_layout_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_flatten *f = &tree->flatten;
+  struct bh_bodies *b = &tree->bodies;
+  size_t count = 0, num_bodies = 0, subtree = 0;
+  uint32_t body = 0;
+
+  if (tree->build_err || f->num_subtrees == 0) { return; }
+
+  // Nodes above the subtrees are at most those of a full tree of depth
+  // BH_BUILD_DEPTH.
+  count = (BH_BUILD_CELLS - 1) / 7;
+  for (size_t k = 0; k < f->num_subtrees; ++k) {
+    count += f->subtree_count[k];
+    num_bodies += f->subtree_bodies[k];
+  }
+  if (count > UINT32_MAX || num_bodies > UINT32_MAX) {
+    tree->build_err = -1;
+    return;
+  }
+
+  tree->nodes = ARENA_NEW(&tree->scratch, struct bh_cnode, count);
+  if (tree->opening.quadrupole &&
+      (tree->quad = ARENA_NEW(&tree->scratch, double, 6 * count)) == NULL) {
+    tree->build_err = -1;
+    return;
+  }
+  *b = (struct bh_bodies){.x = ARENA_NEW(&tree->scratch, double, num_bodies),
+                          .y = ARENA_NEW(&tree->scratch, double, num_bodies),
+                          .z = ARENA_NEW(&tree->scratch, double, num_bodies),
+                          .mass =
+                              ARENA_NEW(&tree->scratch, double, num_bodies),
+                          .count = num_bodies};
+  if (tree->nodes == NULL || b->x == NULL || b->y == NULL || b->z == NULL ||
+      b->mass == NULL) {
+    tree->build_err = -1;
+    return;
+  }
+
+  tree->num_nodes = bh_flatten_layout(f, tree->nodes, 0, &body, tree->root,
+                                      0, tree->bb_max.x - tree->bb_min.x,
+                                      &subtree);
+}
+
+// Write one subtree, and compute its moments
+void bh_flatten_subtree_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_flatten *f = &tree->flatten;
+
+  if (tree->build_err || arg->task >= f->num_subtrees) { return; }
+
+  size_t offset = f->subtree_offset[arg->task];
+  uint32_t body = f->subtree_first_body[arg->task];
+  bh_flatten_write(tree->nodes, offset, &tree->bodies, &body,
+                   f->subtree[arg->task], f->subtree_size[arg->task]);
+  for (size_t i = offset + f->subtree_count[arg->task]; i-- > offset;) {
+    bh_flatten_moments(tree->nodes, &tree->bodies, i);
+    if (tree->quad != NULL) { bh_flatten_quad(tree, i); }
+  }
+}
+
+// Compute the moments of the nodes above the subtrees
+void bh_flatten_top_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_flatten *f = &tree->flatten;
+
+  if (tree->build_err || tree->num_nodes == 0) { return; }
+
+  for (size_t k = f->num_top; k-- > 0;) {
+    bh_flatten_moments(tree->nodes, &tree->bodies, f->top[k]);
+    if (tree->quad != NULL) { bh_flatten_quad(tree, f->top[k]); }
+  }
+}
+
+enum ct_err bh_tree_push_flatten(struct bh_tree *tree, struct threadpool *tp)
+{
+  int err;
+  struct bh_build_arg arg = {.tree = tree, .task = 0, .num_tasks = 1};
+
+  if ((err = bh_build_push(tp, bh_flatten_collect_task, &arg))) { return err; }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  for (arg.task = 0; arg.task < BH_BUILD_CELLS; ++arg.task) {
+    if ((err = bh_build_push(tp, bh_flatten_count_task, &arg))) { return err; }
+  }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  if ((err = bh_build_push(tp, bh_flatten_layout_task, &arg))) { return err; }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  for (arg.task = 0; arg.task < BH_BUILD_CELLS; ++arg.task) {
+    err = bh_build_push(tp, bh_flatten_subtree_task, &arg);
+    if (err) { return err; }
+  }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  return bh_build_push(tp, bh_flatten_top_task, &arg);
+}
+
+// Check that the tree can be refit from the given points
+void bh_refit_prepare_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+
+  if (tree->build_err || tree->num_nodes == 0 ||
+      arg->points.count != tree->morton.sort.count) {
+    tree->build_err = -1;
+  }
+}
+
+// Move body j to the centre of mass of its points, which are those of the
+// sorted keys from *s on that belong to it, and advance *s past them. Return
+// the number of points that have left the cell of the body's leaf, which is
+// at the given level.
+size_t bh_refit_body(struct bh_tree *tree, struct bh_points const *points,
+                     uint32_t j, size_t *s, int level)
+{
+  struct bh_morton const *m = &tree->morton;
+  struct bh_bodies *b = &tree->bodies;
+  struct bh_vec3 moment = {0.0, 0.0, 0.0};
+  int shift = 3 * (BH_MORTON_BITS - level);
+  size_t escaped = 0;
+
+  b->mass[j] = 0.0;
+  for (; *s < m->sort.count && m->leaf[*s] == j; *s += 1) {
+    size_t i = m->sort.vals[*s];
+    struct bh_vec3 p = bh_points_get(points, i);
+    double mass = points->mass[i * points->stride];
+
+    moment.x += mass * p.x;
+    moment.y += mass * p.y;
+    moment.z += mass * p.z;
+    b->mass[j] += mass;
+    if ((bh_morton_key(tree, p) ^ m->sort.keys[*s]) >> shift) { escaped += 1; }
+  }
+  b->x[j] = moment.x / b->mass[j];
+  b->y[j] = moment.y / b->mass[j];
+  b->z[j] = moment.z / b->mass[j];
+
+  return escaped;
+}
+
+// First sorted key of the bodies of a subtree. Bodies are in key order, so it
+// is found by bisection.
+size_t bh_subtree_first_key(struct bh_tree const *tree, size_t task)
+{
+  size_t const *leaf = tree->morton.leaf;
+  size_t first_body = tree->flatten.subtree_first_body[task];
+  size_t lo = 0, hi = tree->morton.sort.count;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (leaf[mid] < first_body) { lo = mid + 1; }
+    else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Move the bodies of one subtree, and recompute its moments
+void bh_refit_subtree_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_flatten *f = &tree->flatten;
+  struct bh_cnode *nodes = tree->nodes;
+  struct bh_bodies const *b = &tree->bodies;
+  size_t escaped = 0;
+
+  if (tree->build_err || arg->task >= f->num_subtrees) { return; }
+
+  size_t offset = f->subtree_offset[arg->task];
+  size_t end = offset + f->subtree_count[arg->task];
+  int root_exp = ilogb(tree->bb_max.x - tree->bb_min.x);
+  size_t lo = bh_subtree_first_key(tree, arg->task);
+
+  for (size_t i = offset; i != end; ++i) {
+    struct bh_cnode *c = &nodes[i];
+    if (c->num_children != 0) { continue; }
+
+    // Node sizes halve exactly from the root's, which gives the level
+    int level = root_exp - ilogb(c->size);
+    for (uint32_t j = c->first_body; j != c->first_body + c->num_bodies;
+         ++j) {
+      escaped += bh_refit_body(tree, &arg->points, j, &lo, level);
+    }
+    if (c->num_bodies == 1) {
+      c->cm = (struct bh_vec3){b->x[c->first_body], b->y[c->first_body],
+                               b->z[c->first_body]};
+      c->mass = b->mass[c->first_body];
+    }
+  }
+
+  for (size_t i = end; i-- > offset;) {
+    bh_flatten_moments(nodes, b, i);
+    if (tree->quad != NULL) { bh_flatten_quad(tree, i); }
+  }
+  f->subtree_escaped[arg->task] = escaped;
+}
+
+// Recompute the moments of the nodes above the subtrees, and count the
+// bodies that have escaped their leaf
+void bh_refit_top_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_flatten *f = &tree->flatten;
+
+  if (tree->build_err) { return; }
+
+  tree->num_escaped = 0;
+  for (size_t k = 0; k < f->num_subtrees; ++k) {
+    tree->num_escaped += f->subtree_escaped[k];
+  }
+  for (size_t k = f->num_top; k-- > 0;) {
+    bh_flatten_moments(tree->nodes, &tree->bodies, f->top[k]);
+    if (tree->quad != NULL) { bh_flatten_quad(tree, f->top[k]); }
+  }
+}
+
+enum ct_err bh_tree_push_refit(struct bh_tree *tree, struct threadpool *tp,
+                               struct bh_points points)
+{
+  int err;
+  struct bh_build_arg arg = {
+      .tree = tree, .points = points, .task = 0, .num_tasks = 1};
+
+  if ((err = bh_build_push(tp, bh_refit_prepare_task, &arg))) { return err; }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  for (arg.task = 0; arg.task < BH_BUILD_CELLS; ++arg.task) {
+    if ((err = bh_build_push(tp, bh_refit_subtree_task, &arg))) { return err; }
+  }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  return bh_build_push(tp, bh_refit_top_task, &arg);
+}
+
+// Check that velocities can be computed from the given points, and allocate
+// them once per build
+void bh_velocity_prepare_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_bodies *b = &tree->bodies;
+
+  if (tree->build_err || tree->num_nodes == 0 ||
+      arg->points.count != tree->morton.sort.count) {
+    tree->build_err = -1;
+    return;
+  }
+  if (tree->vel != NULL) { return; }
+
+  tree->vel = ARENA_NEW(&tree->scratch, struct bh_vec3, tree->num_nodes);
+  b->vx = ARENA_NEW(&tree->scratch, double, b->count);
+  b->vy = ARENA_NEW(&tree->scratch, double, b->count);
+  b->vz = ARENA_NEW(&tree->scratch, double, b->count);
+  if (tree->vel == NULL || b->vx == NULL || b->vy == NULL || b->vz == NULL) {
+    tree->vel = NULL;
+    tree->build_err = -1;
+  }
+}
+
+// Set the velocity of body j to the mean of its points, which are those of
+// the sorted keys from *s on that belong to it, and advance *s past them
+void bh_velocity_body(struct bh_tree *tree, struct bh_points const *v,
+                      uint32_t j, size_t *s)
+{
+  struct bh_morton const *m = &tree->morton;
+  struct bh_bodies *b = &tree->bodies;
+  struct bh_vec3 moment = {0.0, 0.0, 0.0};
+
+  for (; *s < m->sort.count && m->leaf[*s] == j; *s += 1) {
+    size_t i = m->sort.vals[*s];
+    struct bh_vec3 p = bh_points_get(v, i);
+    double mass = v->mass[i * v->stride];
+
+    moment.x += mass * p.x;
+    moment.y += mass * p.y;
+    moment.z += mass * p.z;
+  }
+  b->vx[j] = moment.x / b->mass[j];
+  b->vy[j] = moment.y / b->mass[j];
+  b->vz[j] = moment.z / b->mass[j];
+}
+
+// Compute the velocity of node i from its bodies or its children
+void bh_velocity_node(struct bh_tree *tree, uint32_t i)
+{
+  struct bh_cnode const *nodes = tree->nodes, *c = &nodes[i];
+  struct bh_bodies const *b = &tree->bodies;
+  struct bh_vec3 moment = {0.0, 0.0, 0.0};
+
+  if (c->num_children == 0) {
+    for (uint32_t j = c->first_body; j != c->first_body + c->num_bodies;
+         ++j) {
+      moment.x += b->mass[j] * b->vx[j];
+      moment.y += b->mass[j] * b->vy[j];
+      moment.z += b->mass[j] * b->vz[j];
+    }
+  }
+  else {
+    for (uint32_t child = i + 1; child != c->next;
+         child = nodes[child].next) {
+      moment.x += nodes[child].mass * tree->vel[child].x;
+      moment.y += nodes[child].mass * tree->vel[child].y;
+      moment.z += nodes[child].mass * tree->vel[child].z;
+    }
+  }
+  tree->vel[i] = (struct bh_vec3){moment.x / c->mass, moment.y / c->mass,
+                                  moment.z / c->mass};
+}
+
+// Compute the velocities of the bodies and nodes of one subtree
+void bh_velocity_subtree_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_flatten *f = &tree->flatten;
+
+  if (tree->build_err || arg->task >= f->num_subtrees) { return; }
+
+  size_t offset = f->subtree_offset[arg->task];
+  size_t end = offset + f->subtree_count[arg->task];
+  size_t s = bh_subtree_first_key(tree, arg->task);
+
+  for (size_t i = offset; i != end; ++i) {
+    struct bh_cnode const *c = &tree->nodes[i];
+    if (c->num_children != 0) { continue; }
+    for (uint32_t j = c->first_body; j != c->first_body + c->num_bodies;
+         ++j) {
+      bh_velocity_body(tree, &arg->points, j, &s);
+    }
+  }
+  for (size_t i = end; i-- > offset;) {
+    bh_velocity_node(tree, i);
+  }
+}
+
+// Compute the velocities of the nodes above the subtrees
+void bh_velocity_top_task(void *argp)
+{
+  struct bh_build_arg *arg = argp;
+  struct bh_tree *tree = arg->tree;
+  struct bh_flatten *f = &tree->flatten;
+
+  if (tree->build_err) { return; }
+
+  for (size_t k = f->num_top; k-- > 0;) {
+    bh_velocity_node(tree, f->top[k]);
+  }
+}
+
+enum ct_err bh_tree_push_velocities(struct bh_tree *tree,
+                                    struct threadpool *tp,
+                                    struct bh_points velocities)
+{
+  int err;
+  struct bh_build_arg arg = {
+      .tree = tree, .points = velocities, .task = 0, .num_tasks = 1};
+
+  if ((err = bh_build_push(tp, bh_velocity_prepare_task, &arg))) {
+    return err;
+  }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  for (arg.task = 0; arg.task < BH_BUILD_CELLS; ++arg.task) {
+    err = bh_build_push(tp, bh_velocity_subtree_task, &arg);
+    if (err) { return err; }
+  }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  return bh_build_push(tp, bh_velocity_top_task, &arg);
+}
+
+int bh_tree_needs_rebuild(struct bh_tree const *tree)
+{
+  return tree->build_err || tree->num_nodes == 0 ||
+         tree->morton.sort.count == 0 ||
+         tree->num_escaped > BH_REFIT_ESCAPED * tree->bodies.count;
+}
+
+// Add the acceleration due to a point mass q at p to *result
+static inline void bh_add_acc(struct bh_vec3 const *p, struct bh_vec3 q,
+                              double mass, struct bh_vec3 *result)
+{
+  double distsq = (q.x - p->x) * (q.x - p->x) + (q.y - p->y) * (q.y - p->y) +
+                  (q.z - p->z) * (q.z - p->z);
+  double dist3 = sqrt(distsq);
+  if (dist3 < MINDIST) dist3 = MINDIST;
+  dist3 = dist3 * dist3 * dist3;
+  result->x += (q.x - p->x) * mass / dist3;
+  result->y += (q.y - p->y) * mass / dist3;
+  result->z += (q.z - p->z) * mass / dist3;
+}
+
+// Add the acceleration due to the quadrupole Q of a node at p to *result.
+// With d the offset of the node's centre of mass, it is
+//   -Q d / |d|^5 + 5/2 (d . Q d) d / |d|^7.
+static inline void bh_add_quad(struct bh_vec3 const *p,
+                               struct bh_cnode const *node, double const *Q,
+                               struct bh_vec3 *result)
+{
+  double dx = node->cm.x - p->x, dy = node->cm.y - p->y,
+         dz = node->cm.z - p->z;
+  double distsq = dx * dx + dy * dy + dz * dz;
+  double inv = 1.0 / fmax(sqrt(distsq), MINDIST), inv2 = inv * inv;
+  double inv5 = inv2 * inv2 * inv;
+  double qx = Q[0] * dx + Q[3] * dy + Q[4] * dz;
+  double qy = Q[3] * dx + Q[1] * dy + Q[5] * dz;
+  double qz = Q[4] * dx + Q[5] * dy + Q[2] * dz;
+  double s = 2.5 * (dx * qx + dy * qy + dz * qz) * inv2;
+
+  result->x += (s * dx - qx) * inv5;
+  result->y += (s * dy - qy) * inv5;
+  result->z += (s * dz - qz) * inv5;
+}
+
+// Whether node may stand in for its bodies for points at squared distance
+// distsq from its centre of mass, whose accelerations are at least
+// sqrt(accsq). See struct bh_opening.
+static inline int bh_accept(struct bh_tree const *tree,
+                            struct bh_cnode const *node, double distsq,
+                            double accsq)
+{
+  struct bh_opening const *o = &tree->opening;
+  double thetasq = o->theta * o->theta;
+
+  if (o->criterion == BH_OPEN_ACCEL && accsq > 0.0) {
+    double error = node->mass * node->size * node->size;
+    double bound = o->tolerance * sqrt(accsq) * distsq * distsq;
+    if (tree->quad != NULL) {
+      error *= node->size;
+      bound *= sqrt(distsq);
+    }
+    return node->extent * node->extent < distsq && error < bound;
+  }
+  if (o->criterion == BH_OPEN_BMAX) {
+    return node->extent * node->extent < thetasq * distsq;
+  }
+  return node->size * node->size < thetasq * distsq;
+}
+
+// Whether the solvers can walk the tree: it has been flattened since the last
+// bh_tree_insert(), or it holds no bodies
+int bh_tree_walkable(struct bh_tree const *tree)
+{
+  return tree->nodes != NULL || tree->root == NULL ||
+         tree->root->type == EMPTY;
+}
+
+void bh_tree_solve_acc(struct bh_tree *tree, struct bh_vec3 const *p,
+                       struct bh_vec3 *result)
+{
+  struct bh_cnode const *nodes = tree->nodes;
+  struct bh_bodies const *b = &tree->bodies;
+  double accsq = 0.0;
+  size_t i = 0;
+
+  assert(bh_tree_walkable(tree));
+
+  if (tree->opening.criterion == BH_OPEN_ACCEL) {
+    accsq = result->x * result->x + result->y * result->y +
+            result->z * result->z;
+  }
+
+  result->x = result->y = result->z = 0.0;
+
+  while (i < tree->num_nodes) {
+    struct bh_cnode const *node = &nodes[i];
+    double distsq = (node->cm.x - p->x) * (node->cm.x - p->x) +
+                    (node->cm.y - p->y) * (node->cm.y - p->y) +
+                    (node->cm.z - p->z) * (node->cm.z - p->z);
+    if (node->num_bodies == 1 || bh_accept(tree, node, distsq, accsq)) {
+      bh_add_acc(p, node->cm, node->mass, result);
+      if (node->num_bodies > 1 && tree->quad != NULL) {
+        bh_add_quad(p, node, tree->quad + 6 * (size_t)i, result);
+      }
+      i = node->next;
+    }
+    else if (node->num_children == 0) {
+      for (uint32_t j = node->first_body;
+           j != node->first_body + node->num_bodies; ++j) {
+        bh_add_acc(p, (struct bh_vec3){b->x[j], b->y[j], b->z[j]}, b->mass[j],
+                   result);
+      }
+      i = node->next;
+    }
+    else {
+      i += 1;
+    }
+  }
+}
+
+// Interaction lists of a group, and the group's points and accelerations.
+// Point masses include the monopoles of accepted nodes, whose quadrupoles
+// are listed separately. Both lists are in columns, for vectorized loops.
+// In single precision, point masses and points are listed in the float
+// columns instead, relative to origin. For jerks, the velocities of point
+// masses and points are listed too.
+struct bh_group {
+  double x[BH_LIST_SIZE], y[BH_LIST_SIZE], z[BH_LIST_SIZE],
+      mass[BH_LIST_SIZE];
+  double vx[BH_LIST_SIZE], vy[BH_LIST_SIZE], vz[BH_LIST_SIZE];
+  float fx[BH_LIST_SIZE], fy[BH_LIST_SIZE], fz[BH_LIST_SIZE],
+      fmass[BH_LIST_SIZE];
+  size_t count;
+  double qx[BH_QUAD_LIST_SIZE], qy[BH_QUAD_LIST_SIZE], qz[BH_QUAD_LIST_SIZE];
+  double quad[6][BH_QUAD_LIST_SIZE];
+  size_t num_quad;
+  double px[BH_GROUP_SIZE], py[BH_GROUP_SIZE], pz[BH_GROUP_SIZE];
+  double ax[BH_GROUP_SIZE], ay[BH_GROUP_SIZE], az[BH_GROUP_SIZE];
+  float fpx[BH_GROUP_SIZE], fpy[BH_GROUP_SIZE], fpz[BH_GROUP_SIZE];
+  double pvx[BH_GROUP_SIZE], pvy[BH_GROUP_SIZE], pvz[BH_GROUP_SIZE];
+  double jx[BH_GROUP_SIZE], jy[BH_GROUP_SIZE], jz[BH_GROUP_SIZE];
+  size_t num_points;
+  struct bh_vec3 origin; // Of the float columns
+  int single; // Non-zero if point masses are listed in the float columns
+  int jerk;   // Non-zero if jerks are computed too
+  double accsq; // Least squared estimate of a point's acceleration
+  size_t num_interactions; // Entries listed since the walk began
+};
+
+// Add the interaction lists to the accelerations of the group, and empty
+// them
+void bh_group_flush(struct bh_tree *tree, struct bh_group *g)
+{
+  struct direct_bodies points = {
+      .x = g->px, .y = g->py, .z = g->pz, .count = g->num_points};
+  struct direct_bodies list = {
+      .x = g->x, .y = g->y, .z = g->z, .mass = g->mass, .count = g->count};
+  struct direct_quads quads = {
+      .x = g->qx,
+      .y = g->qy,
+      .z = g->qz,
+      .q = {g->quad[0], g->quad[1], g->quad[2], g->quad[3], g->quad[4],
+            g->quad[5]},
+      .count = g->num_quad};
+
+  if (g->jerk) {
+    points.vx = g->pvx;
+    points.vy = g->pvy;
+    points.vz = g->pvz;
+    list.vx = g->vx;
+    list.vy = g->vy;
+    list.vz = g->vz;
+    direct_jerk_add(&points, 0, g->num_points, &list, g->ax, g->ay, g->az,
+                    g->jx, g->jy, g->jz, MINDIST);
+  }
+  else if (g->single) {
+    struct direct_bodies_f fpoints = {
+        .x = g->fpx, .y = g->fpy, .z = g->fpz, .count = g->num_points};
+    struct direct_bodies_f flist = {.x = g->fx,
+                                    .y = g->fy,
+                                    .z = g->fz,
+                                    .mass = g->fmass,
+                                    .count = g->count};
+    direct_accel_add_f(&fpoints, 0, g->num_points, &flist, g->ax, g->ay,
+                       g->az, (float)MINDIST);
+  }
+  else {
+    direct_accel_add(&points, 0, g->num_points, &list, g->ax, g->ay, g->az,
+                     MINDIST);
+  }
+  direct_quad_add(&points, 0, g->num_points, &quads, g->ax, g->ay, g->az,
+                  MINDIST);
+  g->count = g->num_quad = 0;
+}
+
+// Add the quadrupole of accepted node i to the group's list
+static inline void bh_group_push_quad(struct bh_tree *tree, struct bh_group *g,
+                                      uint32_t i)
+{
+  double const *Q = tree->quad + 6 * (size_t)i;
+
+  if (g->num_quad == BH_QUAD_LIST_SIZE) { bh_group_flush(tree, g); }
+  g->num_interactions += 1;
+  g->qx[g->num_quad] = tree->nodes[i].cm.x;
+  g->qy[g->num_quad] = tree->nodes[i].cm.y;
+  g->qz[g->num_quad] = tree->nodes[i].cm.z;
+  for (int k = 0; k < 6; ++k) {
+    g->quad[k][g->num_quad] = Q[k];
+  }
+  g->num_quad += 1;
+}
+
+static inline void bh_group_push(struct bh_tree *tree, struct bh_group *g,
+                                 double x, double y, double z, double mass)
+{
+  if (g->count == BH_LIST_SIZE) { bh_group_flush(tree, g); }
+  g->num_interactions += 1;
+  if (g->single) {
+    g->fx[g->count] = (float)(x - g->origin.x);
+    g->fy[g->count] = (float)(y - g->origin.y);
+    g->fz[g->count] = (float)(z - g->origin.z);
+    g->fmass[g->count] = (float)mass;
+  }
+  else {
+    g->x[g->count] = x;
+    g->y[g->count] = y;
+    g->z[g->count] = z;
+    g->mass[g->count] = mass;
+  }
+  g->count += 1;
+}
+
+// Set the velocity of the point mass last listed in g
+static inline void bh_group_push_vel(struct bh_group *g, double vx, double vy,
+                                     double vz)
+{
+  g->vx[g->count - 1] = vx;
+  g->vy[g->count - 1] = vy;
+  g->vz[g->count - 1] = vz;
+}
+
+// Walk the tree for the points of g, whose bounding box is [lo, hi]
+void bh_group_walk(struct bh_tree *tree, struct bh_group *g, struct bh_vec3 lo,
+                   struct bh_vec3 hi)
+{
+  struct bh_cnode const *nodes = tree->nodes;
+  struct bh_bodies const *b = &tree->bodies;
+  size_t i = 0;
+
+  while (i < tree->num_nodes) {
+    struct bh_cnode const *node = &nodes[i];
+    // Distance from cm to the nearest point of the box
+    double dx = fmax(0.0, fmax(lo.x - node->cm.x, node->cm.x - hi.x));
+    double dy = fmax(0.0, fmax(lo.y - node->cm.y, node->cm.y - hi.y));
+    double dz = fmax(0.0, fmax(lo.z - node->cm.z, node->cm.z - hi.z));
+    double distsq = dx * dx + dy * dy + dz * dz;
+    if (node->num_bodies == 1 || bh_accept(tree, node, distsq, g->accsq)) {
+      bh_group_push(tree, g, node->cm.x, node->cm.y, node->cm.z, node->mass);
+      if (g->jerk) {
+        bh_group_push_vel(g, tree->vel[i].x, tree->vel[i].y, tree->vel[i].z);
+      }
+      if (node->num_bodies > 1 && tree->quad != NULL) {
+        bh_group_push_quad(tree, g, i);
+      }
+      i = node->next;
+    }
+    else if (node->num_children == 0) {
+      for (uint32_t j = node->first_body;
+           j != node->first_body + node->num_bodies; ++j) {
+        bh_group_push(tree, g, b->x[j], b->y[j], b->z[j], b->mass[j]);
+        if (g->jerk) { bh_group_push_vel(g, b->vx[j], b->vy[j], b->vz[j]); }
+      }
+      i = node->next;
+    }
+    else {
+      i += 1;
+    }
+  }
+}
+
+// Start a group of count points, whose positions are then set with
+// bh_group_set(), and their velocities too if jerk is non-zero. For
+// BH_OPEN_ACCEL, the caller lowers g->accsq to the least estimate of theirs.
+static inline void bh_group_start(struct bh_tree const *tree,
+                                  struct bh_group *g, size_t count, int jerk)
+{
+  g->count = g->num_quad = g->num_interactions = 0;
+  g->num_points = (count < BH_GROUP_SIZE) ? count : BH_GROUP_SIZE;
+  g->accsq = (tree->opening.criterion == BH_OPEN_ACCEL) ? INFINITY : 0.0;
+  g->jerk = jerk;
+  g->single = tree->opening.single_precision && !jerk;
+}
+
+static inline void bh_group_set(struct bh_group *g, size_t k, struct bh_vec3 p)
+{
+  g->px[k] = p.x;
+  g->py[k] = p.y;
+  g->pz[k] = p.z;
+  g->ax[k] = g->ay[k] = g->az[k] = 0.0;
+  g->jx[k] = g->jy[k] = g->jz[k] = 0.0;
+}
+
+// Compute the accelerations of the points of g into g->ax, g->ay, g->az
+void bh_group_solve(struct bh_tree *tree, struct bh_group *g)
+{
+  struct bh_vec3 lo = {g->px[0], g->py[0], g->pz[0]}, hi = lo;
+
+  for (size_t k = 1; k < g->num_points; ++k) {
+    lo = (struct bh_vec3){fmin(lo.x, g->px[k]), fmin(lo.y, g->py[k]),
+                          fmin(lo.z, g->pz[k])};
+    hi = (struct bh_vec3){fmax(hi.x, g->px[k]), fmax(hi.y, g->py[k]),
+                          fmax(hi.z, g->pz[k])};
+  }
+  if (g->single) {
+    g->origin = (struct bh_vec3){0.5 * (lo.x + hi.x), 0.5 * (lo.y + hi.y),
+                                 0.5 * (lo.z + hi.z)};
+    for (size_t k = 0; k < g->num_points; ++k) {
+      g->fpx[k] = (float)(g->px[k] - g->origin.x);
+      g->fpy[k] = (float)(g->py[k] - g->origin.y);
+      g->fpz[k] = (float)(g->pz[k] - g->origin.z);
+    }
+  }
+  bh_group_walk(tree, g, lo, hi);
+  bh_group_flush(tree, g);
+}
+
+void bh_tree_solve_packet(struct bh_tree *tree, struct bh_vec3 const *p,
+                          size_t count, struct bh_vec3 *result)
+{
+  struct bh_group g;
+
+  assert(bh_tree_walkable(tree));
+
+  for (size_t first = 0; first < count; first += BH_GROUP_SIZE) {
+    struct bh_vec3 *r = result + first;
+
+    bh_group_start(tree, &g, count - first, 0);
+    for (size_t k = 0; k < g.num_points; ++k) {
+      if (g.accsq != 0.0) {
+        g.accsq =
+            fmin(g.accsq, r[k].x * r[k].x + r[k].y * r[k].y + r[k].z * r[k].z);
+      }
+      bh_group_set(&g, k, p[first + k]);
+    }
+
+    bh_group_solve(tree, &g);
+
+    for (size_t k = 0; k < g.num_points; ++k) {
+      r[k] = (struct bh_vec3){g.ax[k], g.ay[k], g.az[k]};
+    }
+  }
+}
+
+// Solve for the points index[0..count), and for their jerks too unless
+// velocities is NULL
+void bh_solve_group(struct bh_tree *tree, struct bh_points const *points,
+                    struct bh_points const *velocities, size_t const *index,
+                    size_t count, double *ax, double *ay, double *az,
+                    double *jx, double *jy, double *jz, double *cost)
+{
+  struct bh_group g;
+
+  assert(bh_tree_walkable(tree));
+
+  for (size_t first = 0; first < count; first += BH_GROUP_SIZE) {
+    bh_group_start(tree, &g, count - first, velocities != NULL);
+    for (size_t k = 0; k < g.num_points; ++k) {
+      size_t i = index[first + k];
+      if (g.accsq != 0.0) {
+        g.accsq =
+            fmin(g.accsq, ax[i] * ax[i] + ay[i] * ay[i] + az[i] * az[i]);
+      }
+      bh_group_set(&g, k, bh_points_get(points, i));
+      if (g.jerk) {
+        struct bh_vec3 v = bh_points_get(velocities, i);
+        g.pvx[k] = v.x;
+        g.pvy[k] = v.y;
+        g.pvz[k] = v.z;
+      }
+    }
+
+    bh_group_solve(tree, &g);
+
+    for (size_t k = 0; k < g.num_points; ++k) {
+      ax[index[first + k]] = g.ax[k];
+      ay[index[first + k]] = g.ay[k];
+      az[index[first + k]] = g.az[k];
+      if (g.jerk) {
+        jx[index[first + k]] = g.jx[k];
+        jy[index[first + k]] = g.jy[k];
+        jz[index[first + k]] = g.jz[k];
+      }
+      if (cost != NULL) { cost[index[first + k]] = g.num_interactions; }
+    }
+  }
+}
+
+void bh_tree_solve_group(struct bh_tree *tree, struct bh_points const *points,
+                         size_t const *index, size_t count, double *ax,
+                         double *ay, double *az, double *cost)
+{
+  bh_solve_group(tree, points, NULL, index, count, ax, ay, az, NULL, NULL,
+                 NULL, cost);
+}
+
+void bh_tree_solve_group_jerk(struct bh_tree *tree,
+                              struct bh_points const *points,
+                              struct bh_points const *velocities,
+                              size_t const *index, size_t count, double *ax,
+                              double *ay, double *az, double *jx, double *jy,
+                              double *jz, double *cost)
+{
+  bh_solve_group(tree, points, velocities, index, count, ax, ay, az, jx, jy,
+                 jz, cost);
+}
+
+// As bh_solve_group(), for positions [begin, end) of the Morton order
+void bh_solve_morton(struct bh_tree *tree, struct bh_points const *points,
+                     struct bh_points const *velocities, size_t begin,
+                     size_t end, double *ax, double *ay, double *az,
+                     double *jx, double *jy, double *jz, double *cost)
+{
+  struct bh_morton *m = &tree->morton;
+  size_t last;
+
+  for (size_t first = begin; first < end; first = last) {
+    last = end;
+    if (end - first > BH_GROUP_SIZE) {
+      // Cut in the second half of the largest group, so groups stay large
+      last = first + BH_GROUP_SIZE;
+      for (size_t k = last - 1; k > first + BH_GROUP_SIZE / 2; --k) {
+        if (m->lcp[k] < m->lcp[last]) { last = k; }
+      }
+    }
+    bh_solve_group(tree, points, velocities, m->sort.vals + first,
+                   last - first, ax, ay, az, jx, jy, jz, cost);
+  }
+}
+
+void bh_tree_solve_morton(struct bh_tree *tree, struct bh_points const *points,
+                          size_t begin, size_t end, double *ax, double *ay,
+                          double *az, double *cost)
+{
+  bh_solve_morton(tree, points, NULL, begin, end, ax, ay, az, NULL, NULL,
+                  NULL, cost);
+}
+
+void bh_tree_solve_morton_jerk(struct bh_tree *tree,
+                               struct bh_points const *points,
+                               struct bh_points const *velocities,
+                               size_t begin, size_t end, double *ax,
+                               double *ay, double *az, double *jx, double *jy,
+                               double *jz, double *cost)
+{
+  bh_solve_morton(tree, points, velocities, begin, end, ax, ay, az, jx, jy,
+                  jz, cost);
+}
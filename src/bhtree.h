@@ -3,11 +3,40 @@
 
 #include <stddef.h>
 
+#include "arena.h"
+#include "direct.h"
+#include "error.h"
 #include "pool.h"
+#include "radix.h"
+#include "threadpool.h"
 
-#include <stddef.h>
+#include <stdint.h>
+
+// Defaults of struct bh_opening
+#define BH_THETA 0.5
+#define BH_TOLERANCE 0.001
+
+// Number of octree levels above the subtrees built in parallel by
+// bh_tree_push_build(). Bodies are binned into 8^BH_BUILD_DEPTH cells.
+#define BH_BUILD_DEPTH 3
+#define BH_BUILD_CELLS (1u << (3 * BH_BUILD_DEPTH))
+
+// Bits per axis of the Morton keys used by bh_tree_push_build_morton(). Keys
+// address octree levels 0 to BH_MORTON_BITS, and bodies closer together than
+// that resolves share a leaf.
+#define BH_MORTON_BITS 21
+#define BH_MORTON_LEVELS (BH_MORTON_BITS + 1)
 
-#define THETA_SQUARED 0.25
+// Subtrees of the flattened tree holding up to this many bodies collapse into
+// a single leaf, whose bodies are summed directly when it is opened.
+#define BH_LEAF_SIZE 8
+
+// Most points that walk the tree together in bh_tree_solve_group()
+#define BH_GROUP_SIZE 32
+
+// Fraction of bodies that may have left the leaf cell they were built in
+// before bh_tree_needs_rebuild() asks for a rebuild instead of a refit
+#define BH_REFIT_ESCAPED 0.05
 
 enum bh_node_type { LEAF = 0, INTERNAL, EMPTY };
 
@@ -22,6 +51,37 @@ struct bh_vec3 {
   double x, y, z;
 };
 
+// Criterion for accepting a node, that is letting its moments stand in for
+// its bodies, at distance d from a point with acceleration a:
+//   BH_OPEN_THETA  size < theta d, the classic Barnes-Hut criterion
+//   BH_OPEN_BMAX   extent < theta d, which adapts to how bodies fill the node
+//   BH_OPEN_ACCEL  the leading error term of the node's expansion,
+//                  mass size^2 / d^4 (size^3 / d^5 with quadrupoles), is below
+//                  tolerance |a|. The point must lie outside the node's extent.
+// BH_OPEN_ACCEL needs an estimate of a, such as that of the previous step.
+// Points without one (a = 0) fall back to BH_OPEN_THETA.
+enum bh_criterion { BH_OPEN_THETA = 0, BH_OPEN_BMAX, BH_OPEN_ACCEL };
+
+// How the solvers open nodes. May be changed between solves, except that
+// quadrupole takes effect from the next build or refit.
+//
+// With single_precision, the group solvers evaluate point masses (bodies and
+// monopoles) in single precision, relative to the centre of each group's
+// bounding box. Positions and the tree stay in double precision, and
+// quadrupoles are evaluated in double. The error this adds is well below
+// that of the opening angle, for twice the lanes per vector.
+struct bh_opening {
+  enum bh_criterion criterion;
+  double theta;     // Opening angle of BH_OPEN_THETA and BH_OPEN_BMAX
+  double tolerance; // Relative acceleration error of BH_OPEN_ACCEL
+  int quadrupole;   // Non-zero to add the quadrupoles of accepted nodes
+  int single_precision; // Non-zero for mixed precision group solves
+};
+
+// Node of the tree as built. Builders only lay out its topology: cm and mass
+// are those of the body (or coincident bodies) of a leaf, and are not set
+// for internal nodes. Moments of internal nodes are computed once per build,
+// in the flattened tree.
 struct bh_node {
   enum bh_node_type type;
   struct bh_vec3 cm;
@@ -29,10 +89,104 @@ struct bh_node {
   struct bh_node *children[8];
 };
 
+// Node of the flattened tree that forces are evaluated on. Nodes are in
+// depth-first order, so the first child of a node immediately follows it, and
+// its next sibling (or its parent's) is found by skipping its whole subtree.
+// Children are visited in Morton order, so the bodies of a tree built by
+// bh_tree_push_build_morton() are in key order, and sorted key i belongs to
+// body tree->morton.leaf[i].
+// A force walk then streams forward through the array, without recursion or
+// child pointers. The bodies below a node are a range of tree->bodies.
+struct bh_cnode {
+  struct bh_vec3 cm;     // Mass-weighted centre of mass
+  double mass;
+  double size;           // Edge length of the node's cube
+  double extent;         // Bound on the distance of any body from cm
+  uint32_t next;         // Index of the first node after this subtree
+  uint32_t num_children; // 0 for a leaf
+  uint32_t first_body;
+  uint32_t num_bodies;
+};
+
+// Bodies of the flattened tree in depth-first order, one column per quantity.
+// Each leaf of the tree as built is a body, so coincident points count once.
+struct bh_bodies {
+  double *x, *y, *z, *mass;
+  double *vx, *vy, *vz; // See bh_tree_push_velocities(), or NULL
+  size_t count;
+};
+
+// Set of points to build a tree from. Coordinates and masses of point i are
+// x[i * stride], y[i * stride], etc.
+struct bh_points {
+  const double *x, *y, *z, *mass;
+  size_t stride;
+  size_t count;
+};
+
+// State of a parallel build, see bh_tree_push_build()
+struct bh_build {
+  unsigned *cell;  // Cell index of each point
+  size_t *order;   // Point indices, sorted (stably) by cell
+  size_t *hist;    // Per-task cell histograms, then scatter offsets
+  size_t cell_start[BH_BUILD_CELLS + 1]; // Range of order[] in each cell
+  struct bh_node *cell_root[BH_BUILD_CELLS];
+};
+
+// Per-task range of sorted keys in a Morton build. Node indices are local to
+// the range until offset is known, and SIZE_MAX where there is no node.
+struct bh_morton_chunk {
+  size_t num_nodes;                // Nodes starting at keys of the range
+  size_t offset;                   // Index of the first of those nodes
+  size_t num_leaves;               // Leaves starting at keys of the range
+  size_t first_leaf;               // Index of the first of those leaves
+  size_t open[BH_MORTON_LEVELS];   // Last node started at each level
+  size_t carry[BH_MORTON_LEVELS];  // Same, over all preceding ranges
+};
+
+// State of a Morton build, see bh_tree_push_build_morton()
+struct bh_morton {
+  struct radix_sort sort;  // Morton keys, sorted along with point indices
+  signed char *lcp;        // Levels shared by each key and its predecessor
+  size_t *leaf;            // Body of tree->bodies that each key is part of
+  struct bh_morton_chunk *chunks;
+  struct bh_node *nodes;   // Nodes in depth-first order, root first
+  size_t num_nodes;
+};
+
+// State of flattening, see bh_tree_push_flatten(). Subtrees below depth
+// BH_BUILD_DEPTH are flattened, and their moments computed, in parallel.
+struct bh_flatten {
+  struct bh_node *subtree[BH_BUILD_CELLS];
+  double subtree_size[BH_BUILD_CELLS];  // Edge length of the subtree root
+  size_t subtree_count[BH_BUILD_CELLS]; // Number of nodes in the subtree
+  size_t subtree_offset[BH_BUILD_CELLS];
+  size_t subtree_bodies[BH_BUILD_CELLS]; // Number of bodies in the subtree
+  size_t subtree_first_body[BH_BUILD_CELLS];
+  size_t subtree_escaped[BH_BUILD_CELLS]; // Bodies that left their leaf cell
+  size_t num_subtrees;
+  uint32_t top[(BH_BUILD_CELLS - 1) / 7]; // Nodes above the subtrees
+  size_t num_top;
+};
+
 struct bh_tree {
   struct bh_node *root;
   struct pool node_pool;
   struct bh_vec3 bb_min, bb_max; // Bounding box for tree
+
+  struct arena scratch; // Per-build scratch storage, reset by each build
+  struct bh_build build;
+  struct bh_morton morton;
+  struct bh_flatten flatten;
+
+  struct bh_cnode *nodes; // Flattened tree, in the scratch arena
+  size_t num_nodes;
+  struct bh_bodies bodies; // Bodies of the flattened tree, likewise
+  double *quad; // Quadrupoles of the nodes (xx, yy, zz, xy, xz, yz), or NULL
+  struct bh_vec3 *vel; // Velocities of the nodes' centres of mass, or NULL
+  struct bh_opening opening; // See bh_tree_init() for the defaults
+  size_t num_escaped; // Bodies outside their leaf cell, as of the last refit
+  int build_err; // Non-zero if the last parallel build or refit failed
 };
 
 int bh_tree_clear(struct bh_tree *tree);
@@ -40,12 +194,149 @@ int bh_tree_clear(struct bh_tree *tree);
 int bh_tree_set_bb(struct bh_tree *tree, struct bh_vec3 bb_min,
                    struct bh_vec3 bb_max);
 
+// Initialize an empty tree, which opens nodes by BH_OPEN_THETA with BH_THETA,
+// without quadrupoles, in double precision
 int bh_tree_init(struct bh_tree *tree, size_t num_nodes);
 
 int bh_tree_insert(struct bh_tree *tree, struct bh_vec3 p, double mass);
 
+// Push tasks onto tp that clear the tree and rebuild it from points. Both
+// builders end by flattening the tree, see bh_tree_push_flatten().
+//
+// Bodies are binned into BH_BUILD_CELLS cells in num_tasks parallel ranges,
+// the subtree of each cell is built by its own task, and the top levels are
+// then linked up serially. The result is identical to inserting every point
+// in order with bh_tree_insert().
+//
+// The tasks are separated by barriers, and the caller must push a barrier
+// before using the tree. The bounding box must be set by the time the tasks
+// run, and tree->build_err reports failure once they have completed.
+enum ct_err bh_tree_push_build(struct bh_tree *tree, struct threadpool *tp,
+                               struct bh_points points, size_t num_tasks);
+
+// Push tasks onto tp that clear the tree and rebuild it from points, as a
+// linear octree.
+//
+// Each point gets a 63-bit Morton key, and the keys are radix sorted. Every
+// octree node is then a run of keys sharing a prefix, and the nodes are laid
+// out depth-first in a single array by a parallel scan over the sorted keys.
+// The tree matches that of bh_tree_push_build(), except that it is at most
+// BH_MORTON_BITS levels deep and that, at that depth, bodies sharing a key are
+// merged into one leaf.
+//
+// Usage is as for bh_tree_push_build(). The nodes live in the tree's scratch
+// arena, and are valid until the next build.
+enum ct_err bh_tree_push_build_morton(struct bh_tree *tree,
+                                      struct threadpool *tp,
+                                      struct bh_points points,
+                                      size_t num_tasks);
+
+// Push tasks onto tp that flatten the tree into tree->nodes and
+// tree->bodies, which the solvers below walk, and compute the moments of its
+// nodes bottom-up. Below depth BH_BUILD_DEPTH, subtrees of up to BH_LEAF_SIZE
+// bodies become leaves. The builders above do this themselves. After building
+// a tree with bh_tree_insert(), flatten it before solving.
+//
+// The caller must push a barrier before using the result. Failure is
+// reported in tree->build_err.
+enum ct_err bh_tree_push_flatten(struct bh_tree *tree, struct threadpool *tp);
+
+// Push tasks onto tp that move the bodies of the tree to the current
+// positions of points, keeping its topology, and recompute the moments of its
+// nodes bottom-up. The tree must have been built by
+// bh_tree_push_build_morton() from the same points, which may have moved but
+// not been reordered or resized.
+//
+// A body that has left the cell of its leaf stays in the leaf, whose extent
+// grows to cover it. Such bodies are counted in tree->num_escaped, and the
+// more there are, the looser the tree. Use bh_tree_needs_rebuild() to choose
+// between a refit and a full build.
+//
+// Usage is as for bh_tree_push_build(), except that the bounding box must be
+// left as it was for the build.
+enum ct_err bh_tree_push_refit(struct bh_tree *tree, struct threadpool *tp,
+                               struct bh_points points);
+
+// Push tasks onto tp that compute the velocities of the centres of mass of
+// the bodies and nodes of the tree, for the jerk solvers. Velocities are
+// given as the coordinates of the points, with their masses, which must be
+// those the tree was last built or refit from by bh_tree_push_build_morton()
+// or bh_tree_push_refit().
+//
+// Usage is as for bh_tree_push_refit(), after the build or refit and a
+// barrier.
+enum ct_err bh_tree_push_velocities(struct bh_tree *tree,
+                                    struct threadpool *tp,
+                                    struct bh_points velocities);
+
+// Whether the tree must be rebuilt before it can be refit: there is no
+// successful Morton build to refit, or more than BH_REFIT_ESCAPED of its
+// bodies have left their leaf cell.
+int bh_tree_needs_rebuild(struct bh_tree const *tree);
+
+// Compute the acceleration of point p into *result. For BH_OPEN_ACCEL,
+// *result holds an estimate of it on entry.
+//
+// This and the solvers below walk the flattened tree. A tree built with
+// bh_tree_insert() must be flattened first, which they assert.
 void bh_tree_solve_acc(struct bh_tree *tree, struct bh_vec3 const *p,
                        struct bh_vec3 *result);
 
+// As bh_tree_solve_acc(), for the points p[0..count) as a packet, into
+// result[0..count): see bh_tree_solve_group(). For BH_OPEN_ACCEL, result[k]
+// holds an estimate of the acceleration of p[k] on entry, and is otherwise
+// only written. Packets of points that are close together amortize the walk,
+// and evaluate each node for all their points in SIMD lanes.
+//
+// Any count is accepted, and taken BH_GROUP_SIZE points at a time. Packets
+// are larger than the 4 to 16 rays of ray tracing since the lanes evaluate
+// lists of interactions rather than single nodes: walking 100000 uniform
+// points in packets of 32 took about 0.9 the time of packets of 16 and 0.65
+// that of packets of 8, and packets of 64 were no faster.
+void bh_tree_solve_packet(struct bh_tree *tree, struct bh_vec3 const *p,
+                          size_t count, struct bh_vec3 *result);
+
+// Compute the accelerations of the points index[0..count) into ax[i], ay[i],
+// az[i] for each of their indices i (overwritten). For BH_OPEN_ACCEL, these
+// hold estimates of them on entry. Unless cost is NULL, cost[i] is set to the
+// number of interactions evaluated for the point, a measure of its share of
+// the work.
+//
+// Points are taken in groups of up to BH_GROUP_SIZE, which should be close
+// together. Each group walks the tree once, opening nodes as a point anywhere
+// in the group's bounding box would. The accepted nodes and the bodies of
+// opened leaves make up interaction lists shared by the group. Point masses
+// are evaluated for all its points with direct_accel_add(), and nodes with
+// quadrupoles by a loop of their own.
+void bh_tree_solve_group(struct bh_tree *tree, struct bh_points const *points,
+                         size_t const *index, size_t count, double *ax,
+                         double *ay, double *az, double *cost);
+
+// As bh_tree_solve_group(), for the points at positions [begin, end) of the
+// Morton order of the last bh_tree_push_build_morton(). Groups end where
+// consecutive keys share the fewest levels, so that they follow octree cells.
+void bh_tree_solve_morton(struct bh_tree *tree, struct bh_points const *points,
+                          size_t begin, size_t end, double *ax, double *ay,
+                          double *az, double *cost);
+
+// As bh_tree_solve_group() and bh_tree_solve_morton(), also computing the
+// jerks of the points into jx[i], jy[i], jz[i], from their velocities and
+// those of bh_tree_push_velocities(). Velocities are given as for the latter.
+// Accepted nodes contribute the jerk of their monopole alone, and point
+// masses are evaluated in double precision.
+void bh_tree_solve_group_jerk(struct bh_tree *tree,
+                              struct bh_points const *points,
+                              struct bh_points const *velocities,
+                              size_t const *index, size_t count, double *ax,
+                              double *ay, double *az, double *jx, double *jy,
+                              double *jz, double *cost);
+
+void bh_tree_solve_morton_jerk(struct bh_tree *tree,
+                               struct bh_points const *points,
+                               struct bh_points const *velocities,
+                               size_t begin, size_t end, double *ax,
+                               double *ay, double *az, double *jx, double *jy,
+                               double *jz, double *cost);
+
 #endif // __BHTREE_H__
 
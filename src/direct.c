@@ -0,0 +1,1146 @@
+#include "direct.h"
+#include "error.h"
+#include "threadpool.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DIRECT_X86 1
+#include <immintrin.h>
+#endif
+
+// Kernels add the contributions of sources src [jbegin, jend) to the
+// accelerations of targets tgt [begin, end).
+typedef void (*direct_kernel)(struct direct_bodies const *tgt, size_t begin,
+                              size_t end, struct direct_bodies const *src,
+                              size_t jbegin, size_t jend, double *ax,
+                              double *ay, double *az, double min_dist);
+
+// Symmetric kernels sum the pairs between bodies [begin, end) and [jbegin,
+// jend) of b, or within [begin, end) if the ranges are the same.
+typedef void (*direct_sym_kernel)(struct direct_bodies const *b, size_t begin,
+                                  size_t end, size_t jbegin, size_t jend,
+                                  double *ax, double *ay, double *az,
+                                  double min_dist);
+
+// Quadrupole kernels add the contributions of quadrupoles src [jbegin, jend)
+// to the accelerations of targets tgt [begin, end).
+typedef void (*direct_quad_kernel)(struct direct_bodies const *tgt,
+                                   size_t begin, size_t end,
+                                   struct direct_quads const *src,
+                                   size_t jbegin, size_t jend, double *ax,
+                                   double *ay, double *az, double min_dist);
+
+// Single precision kernels, likewise
+typedef void (*direct_kernel_f)(struct direct_bodies_f const *tgt,
+                                size_t begin, size_t end,
+                                struct direct_bodies_f const *src,
+                                size_t jbegin, size_t jend, double *ax,
+                                double *ay, double *az, float min_dist);
+
+// Jerk kernels add the contributions of sources src [jbegin, jend) to the
+// accelerations and jerks of targets tgt [begin, end).
+typedef void (*direct_jerk_kernel)(struct direct_bodies const *tgt,
+                                   size_t begin, size_t end,
+                                   struct direct_bodies const *src,
+                                   size_t jbegin, size_t jend, double *ax,
+                                   double *ay, double *az, double *jx,
+                                   double *jy, double *jz, double min_dist);
+
+// Add the contribution of sources [jbegin, jend) on target i to *ax, *ay, *az
+static inline void direct_sum_scalar(struct direct_bodies const *tgt,
+                                     size_t i, struct direct_bodies const *src,
+                                     size_t jbegin, size_t jend, double *ax,
+                                     double *ay, double *az, double min_dist)
+{
+  double axi = 0.0, ayi = 0.0, azi = 0.0;
+
+  for (size_t j = jbegin; j < jend; ++j) {
+    double dx = src->x[j] - tgt->x[i];
+    double dy = src->y[j] - tgt->y[i];
+    double dz = src->z[j] - tgt->z[i];
+
+    double r = sqrt(fmax(dx * dx + dy * dy + dz * dz, min_dist * min_dist));
+    double s = src->mass[j] / (r * r * r);
+
+    axi += s * dx;
+    ayi += s * dy;
+    azi += s * dz;
+  }
+
+  *ax += axi;
+  *ay += ayi;
+  *az += azi;
+}
+
+void direct_kernel_scalar(struct direct_bodies const *tgt, size_t begin,
+                          size_t end, struct direct_bodies const *src,
+                          size_t jbegin, size_t jend, double *ax, double *ay,
+                          double *az, double min_dist)
+{
+  for (size_t i = begin; i < end; ++i) {
+    direct_sum_scalar(tgt, i, src, jbegin, jend, &ax[i], &ay[i], &az[i],
+                      min_dist);
+  }
+}
+
+// Add the contribution of sources [jbegin, jend) on target i to its
+// acceleration and jerk
+static inline void direct_jerk_scalar(struct direct_bodies const *tgt,
+                                      size_t i,
+                                      struct direct_bodies const *src,
+                                      size_t jbegin, size_t jend, double *ax,
+                                      double *ay, double *az, double *jx,
+                                      double *jy, double *jz, double min_dist)
+{
+  double axi = 0.0, ayi = 0.0, azi = 0.0, jxi = 0.0, jyi = 0.0, jzi = 0.0;
+
+  for (size_t j = jbegin; j < jend; ++j) {
+    double dx = src->x[j] - tgt->x[i];
+    double dy = src->y[j] - tgt->y[i];
+    double dz = src->z[j] - tgt->z[i];
+    double dvx = src->vx[j] - tgt->vx[i];
+    double dvy = src->vy[j] - tgt->vy[i];
+    double dvz = src->vz[j] - tgt->vz[i];
+
+    double inv2 =
+        1.0 / fmax(dx * dx + dy * dy + dz * dz, min_dist * min_dist);
+    double s = src->mass[j] * inv2 * sqrt(inv2);
+    double rv = 3.0 * (dx * dvx + dy * dvy + dz * dvz) * inv2;
+
+    axi += s * dx;
+    ayi += s * dy;
+    azi += s * dz;
+    jxi += s * (dvx - rv * dx);
+    jyi += s * (dvy - rv * dy);
+    jzi += s * (dvz - rv * dz);
+  }
+
+  *ax += axi;
+  *ay += ayi;
+  *az += azi;
+  *jx += jxi;
+  *jy += jyi;
+  *jz += jzi;
+}
+
+void direct_jerk_kernel_scalar(struct direct_bodies const *tgt, size_t begin,
+                               size_t end, struct direct_bodies const *src,
+                               size_t jbegin, size_t jend, double *ax,
+                               double *ay, double *az, double *jx, double *jy,
+                               double *jz, double min_dist)
+{
+  for (size_t i = begin; i < end; ++i) {
+    direct_jerk_scalar(tgt, i, src, jbegin, jend, &ax[i], &ay[i], &az[i],
+                       &jx[i], &jy[i], &jz[i], min_dist);
+  }
+}
+
+static inline void direct_sum_scalar_f(struct direct_bodies_f const *tgt,
+                                       size_t i,
+                                       struct direct_bodies_f const *src,
+                                       size_t jbegin, size_t jend, double *ax,
+                                       double *ay, double *az, float min_dist)
+{
+  float axi = 0.0f, ayi = 0.0f, azi = 0.0f;
+
+  for (size_t j = jbegin; j < jend; ++j) {
+    float dx = src->x[j] - tgt->x[i];
+    float dy = src->y[j] - tgt->y[i];
+    float dz = src->z[j] - tgt->z[i];
+
+    float r = sqrtf(fmaxf(dx * dx + dy * dy + dz * dz, min_dist * min_dist));
+    float s = src->mass[j] / (r * r * r);
+
+    axi += s * dx;
+    ayi += s * dy;
+    azi += s * dz;
+  }
+
+  *ax += axi;
+  *ay += ayi;
+  *az += azi;
+}
+
+void direct_kernel_scalar_f(struct direct_bodies_f const *tgt, size_t begin,
+                            size_t end, struct direct_bodies_f const *src,
+                            size_t jbegin, size_t jend, double *ax,
+                            double *ay, double *az, float min_dist)
+{
+  for (size_t i = begin; i < end; ++i) {
+    direct_sum_scalar_f(tgt, i, src, jbegin, jend, &ax[i], &ay[i], &az[i],
+                        min_dist);
+  }
+}
+
+// Add the contributions of body i and bodies [jbegin, jend) on each other
+static inline void direct_sym_sum_scalar(struct direct_bodies const *b,
+                                         size_t i, size_t jbegin, size_t jend,
+                                         double *ax, double *ay, double *az,
+                                         double min_dist)
+{
+  double axi = 0.0, ayi = 0.0, azi = 0.0;
+
+  for (size_t j = jbegin; j < jend; ++j) {
+    double dx = b->x[j] - b->x[i];
+    double dy = b->y[j] - b->y[i];
+    double dz = b->z[j] - b->z[i];
+
+    double r = sqrt(fmax(dx * dx + dy * dy + dz * dz, min_dist * min_dist));
+    double inv3 = 1.0 / (r * r * r);
+    double si = b->mass[j] * inv3, sj = b->mass[i] * inv3;
+
+    axi += si * dx;
+    ayi += si * dy;
+    azi += si * dz;
+    ax[j] -= sj * dx;
+    ay[j] -= sj * dy;
+    az[j] -= sj * dz;
+  }
+
+  ax[i] += axi;
+  ay[i] += ayi;
+  az[i] += azi;
+}
+
+// Symmetric kernels visit pairs (i, j) of bodies i in [begin, end) and j in
+// [jbegin, jend) once, and update both. If the ranges are the same, only pairs
+// with j > i are visited.
+void direct_sym_kernel_scalar(struct direct_bodies const *b, size_t begin,
+                              size_t end, size_t jbegin, size_t jend,
+                              double *ax, double *ay, double *az,
+                              double min_dist)
+{
+  for (size_t i = begin; i < end; ++i) {
+    size_t jfirst = (begin == jbegin) ? i + 1 : jbegin;
+    direct_sym_sum_scalar(b, i, jfirst, jend, ax, ay, az, min_dist);
+  }
+}
+
+// Add the contribution of quadrupoles [jbegin, jend) on target i to *ax,
+// *ay, *az. With d the offset of a quadrupole Q, it is
+//   -Q d / |d|^5 + 5/2 (d . Q d) d / |d|^7.
+static inline void direct_quad_scalar(struct direct_bodies const *tgt,
+                                      size_t i,
+                                      struct direct_quads const *src,
+                                      size_t jbegin, size_t jend, double *ax,
+                                      double *ay, double *az, double min_dist)
+{
+  double const *const *q = src->q;
+  double axi = 0.0, ayi = 0.0, azi = 0.0;
+
+  for (size_t j = jbegin; j < jend; ++j) {
+    double dx = src->x[j] - tgt->x[i];
+    double dy = src->y[j] - tgt->y[i];
+    double dz = src->z[j] - tgt->z[i];
+
+    double inv2 =
+        1.0 / fmax(dx * dx + dy * dy + dz * dz, min_dist * min_dist);
+    double inv5 = inv2 * inv2 * sqrt(inv2);
+    double qx = q[0][j] * dx + q[3][j] * dy + q[4][j] * dz;
+    double qy = q[3][j] * dx + q[1][j] * dy + q[5][j] * dz;
+    double qz = q[4][j] * dx + q[5][j] * dy + q[2][j] * dz;
+    double s = 2.5 * (dx * qx + dy * qy + dz * qz) * inv2;
+
+    axi += (s * dx - qx) * inv5;
+    ayi += (s * dy - qy) * inv5;
+    azi += (s * dz - qz) * inv5;
+  }
+
+  *ax += axi;
+  *ay += ayi;
+  *az += azi;
+}
+
+void direct_quad_kernel_scalar(struct direct_bodies const *tgt, size_t begin,
+                               size_t end, struct direct_quads const *src,
+                               size_t jbegin, size_t jend, double *ax,
+                               double *ay, double *az, double min_dist)
+{
+  for (size_t i = begin; i < end; ++i) {
+    direct_quad_scalar(tgt, i, src, jbegin, jend, &ax[i], &ay[i], &az[i],
+                       min_dist);
+  }
+}
+
+#ifdef DIRECT_X86
+
+__attribute__((target("sse2"))) void
+direct_kernel_sse2(struct direct_bodies const *tgt, size_t begin, size_t end,
+                   struct direct_bodies const *src, size_t jbegin,
+                   size_t jend, double *ax, double *ay, double *az,
+                   double min_dist)
+{
+  size_t jvec = jbegin + ((jend - jbegin) & ~(size_t)1);
+  __m128d md2 = _mm_set1_pd(min_dist * min_dist);
+  __m128d three_halves = _mm_set1_pd(1.5), half = _mm_set1_pd(0.5);
+
+  for (size_t i = begin; i < end; ++i) {
+    __m128d xi = _mm_set1_pd(tgt->x[i]), yi = _mm_set1_pd(tgt->y[i]),
+            zi = _mm_set1_pd(tgt->z[i]);
+    __m128d axi = _mm_setzero_pd(), ayi = _mm_setzero_pd(),
+            azi = _mm_setzero_pd();
+
+    for (size_t j = jbegin; j < jvec; j += 2) {
+      __m128d dx = _mm_sub_pd(_mm_loadu_pd(&src->x[j]), xi);
+      __m128d dy = _mm_sub_pd(_mm_loadu_pd(&src->y[j]), yi);
+      __m128d dz = _mm_sub_pd(_mm_loadu_pd(&src->z[j]), zi);
+      __m128d r2 = _mm_add_pd(
+          _mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)),
+          _mm_mul_pd(dz, dz));
+      r2 = _mm_max_pd(r2, md2);
+
+      // 12-bit single precision estimate, refined to double precision
+      __m128d h = _mm_mul_pd(half, r2);
+      __m128d y = _mm_cvtps_pd(_mm_rsqrt_ps(_mm_cvtpd_ps(r2)));
+      for (int k = 0; k < 3; ++k) {
+        y = _mm_mul_pd(
+            y, _mm_sub_pd(three_halves, _mm_mul_pd(h, _mm_mul_pd(y, y))));
+      }
+
+      __m128d s = _mm_mul_pd(_mm_loadu_pd(&src->mass[j]),
+                             _mm_mul_pd(_mm_mul_pd(y, y), y));
+      axi = _mm_add_pd(axi, _mm_mul_pd(s, dx));
+      ayi = _mm_add_pd(ayi, _mm_mul_pd(s, dy));
+      azi = _mm_add_pd(azi, _mm_mul_pd(s, dz));
+    }
+
+    ax[i] += _mm_cvtsd_f64(_mm_add_sd(axi, _mm_unpackhi_pd(axi, axi)));
+    ay[i] += _mm_cvtsd_f64(_mm_add_sd(ayi, _mm_unpackhi_pd(ayi, ayi)));
+    az[i] += _mm_cvtsd_f64(_mm_add_sd(azi, _mm_unpackhi_pd(azi, azi)));
+
+    direct_sum_scalar(tgt, i, src, jvec, jend, &ax[i], &ay[i], &az[i],
+                      min_dist);
+  }
+}
+
+__attribute__((target("avx2,fma"))) static inline double
+direct_hsum_avx2(__m256d v)
+{
+  __m128d s =
+      _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+__attribute__((target("avx2,fma"))) void
+direct_kernel_avx2(struct direct_bodies const *tgt, size_t begin, size_t end,
+                   struct direct_bodies const *src, size_t jbegin,
+                   size_t jend, double *ax, double *ay, double *az,
+                   double min_dist)
+{
+  size_t jvec = jbegin + ((jend - jbegin) & ~(size_t)3);
+  __m256d md2 = _mm256_set1_pd(min_dist * min_dist);
+  __m256d three_halves = _mm256_set1_pd(1.5), half = _mm256_set1_pd(0.5);
+
+  for (size_t i = begin; i < end; ++i) {
+    __m256d xi = _mm256_set1_pd(tgt->x[i]), yi = _mm256_set1_pd(tgt->y[i]),
+            zi = _mm256_set1_pd(tgt->z[i]);
+    __m256d axi = _mm256_setzero_pd(), ayi = _mm256_setzero_pd(),
+            azi = _mm256_setzero_pd();
+
+    for (size_t j = jbegin; j < jvec; j += 4) {
+      __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(&src->x[j]), xi);
+      __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(&src->y[j]), yi);
+      __m256d dz = _mm256_sub_pd(_mm256_loadu_pd(&src->z[j]), zi);
+      __m256d r2 = _mm256_fmadd_pd(
+          dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+      r2 = _mm256_max_pd(r2, md2);
+
+      // 12-bit single precision estimate, refined to double precision
+      __m256d h = _mm256_mul_pd(half, r2);
+      __m256d y = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(r2)));
+      for (int k = 0; k < 3; ++k) {
+        y = _mm256_mul_pd(
+            y, _mm256_fnmadd_pd(h, _mm256_mul_pd(y, y), three_halves));
+      }
+
+      __m256d s = _mm256_mul_pd(_mm256_loadu_pd(&src->mass[j]),
+                                _mm256_mul_pd(_mm256_mul_pd(y, y), y));
+      axi = _mm256_fmadd_pd(s, dx, axi);
+      ayi = _mm256_fmadd_pd(s, dy, ayi);
+      azi = _mm256_fmadd_pd(s, dz, azi);
+    }
+
+    ax[i] += direct_hsum_avx2(axi);
+    ay[i] += direct_hsum_avx2(ayi);
+    az[i] += direct_hsum_avx2(azi);
+
+    direct_sum_scalar(tgt, i, src, jvec, jend, &ax[i], &ay[i], &az[i],
+                      min_dist);
+  }
+}
+
+__attribute__((target("avx2,fma"))) static inline float
+direct_hsum_avx2_f(__m256 v)
+{
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehdup_ps(s)));
+}
+
+__attribute__((target("avx2,fma"))) void
+direct_kernel_avx2_f(struct direct_bodies_f const *tgt, size_t begin,
+                     size_t end, struct direct_bodies_f const *src,
+                     size_t jbegin, size_t jend, double *ax, double *ay,
+                     double *az, float min_dist)
+{
+  size_t jvec = jbegin + ((jend - jbegin) & ~(size_t)7);
+  __m256 md2 = _mm256_set1_ps(min_dist * min_dist);
+  __m256 three_halves = _mm256_set1_ps(1.5f), half = _mm256_set1_ps(0.5f);
+
+  for (size_t i = begin; i < end; ++i) {
+    __m256 xi = _mm256_set1_ps(tgt->x[i]), yi = _mm256_set1_ps(tgt->y[i]),
+           zi = _mm256_set1_ps(tgt->z[i]);
+    __m256 axi = _mm256_setzero_ps(), ayi = _mm256_setzero_ps(),
+           azi = _mm256_setzero_ps();
+
+    for (size_t j = jbegin; j < jvec; j += 8) {
+      __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&src->x[j]), xi);
+      __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&src->y[j]), yi);
+      __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(&src->z[j]), zi);
+      __m256 r2 = _mm256_fmadd_ps(
+          dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+      r2 = _mm256_max_ps(r2, md2);
+
+      // 12-bit estimate, refined to single precision
+      __m256 y = _mm256_rsqrt_ps(r2);
+      y = _mm256_mul_ps(
+          y, _mm256_fnmadd_ps(_mm256_mul_ps(half, r2), _mm256_mul_ps(y, y),
+                              three_halves));
+
+      __m256 s = _mm256_mul_ps(_mm256_loadu_ps(&src->mass[j]),
+                               _mm256_mul_ps(_mm256_mul_ps(y, y), y));
+      axi = _mm256_fmadd_ps(s, dx, axi);
+      ayi = _mm256_fmadd_ps(s, dy, ayi);
+      azi = _mm256_fmadd_ps(s, dz, azi);
+    }
+
+    ax[i] += direct_hsum_avx2_f(axi);
+    ay[i] += direct_hsum_avx2_f(ayi);
+    az[i] += direct_hsum_avx2_f(azi);
+
+    direct_sum_scalar_f(tgt, i, src, jvec, jend, &ax[i], &ay[i], &az[i],
+                        min_dist);
+  }
+}
+
+__attribute__((target("avx512f"))) void
+direct_kernel_avx512_f(struct direct_bodies_f const *tgt, size_t begin,
+                       size_t end, struct direct_bodies_f const *src,
+                       size_t jbegin, size_t jend, double *ax, double *ay,
+                       double *az, float min_dist)
+{
+  size_t jvec = jbegin + ((jend - jbegin) & ~(size_t)15);
+  __m512 md2 = _mm512_set1_ps(min_dist * min_dist);
+  __m512 three_halves = _mm512_set1_ps(1.5f), half = _mm512_set1_ps(0.5f);
+
+  for (size_t i = begin; i < end; ++i) {
+    __m512 xi = _mm512_set1_ps(tgt->x[i]), yi = _mm512_set1_ps(tgt->y[i]),
+           zi = _mm512_set1_ps(tgt->z[i]);
+    __m512 axi = _mm512_setzero_ps(), ayi = _mm512_setzero_ps(),
+           azi = _mm512_setzero_ps();
+
+    for (size_t j = jbegin; j < jvec; j += 16) {
+      __m512 dx = _mm512_sub_ps(_mm512_loadu_ps(&src->x[j]), xi);
+      __m512 dy = _mm512_sub_ps(_mm512_loadu_ps(&src->y[j]), yi);
+      __m512 dz = _mm512_sub_ps(_mm512_loadu_ps(&src->z[j]), zi);
+      __m512 r2 = _mm512_fmadd_ps(
+          dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+      r2 = _mm512_max_ps(r2, md2);
+
+      // 14-bit estimate, refined to single precision
+      __m512 y = _mm512_rsqrt14_ps(r2);
+      y = _mm512_mul_ps(
+          y, _mm512_fnmadd_ps(_mm512_mul_ps(half, r2), _mm512_mul_ps(y, y),
+                              three_halves));
+
+      __m512 s = _mm512_mul_ps(_mm512_loadu_ps(&src->mass[j]),
+                               _mm512_mul_ps(_mm512_mul_ps(y, y), y));
+      axi = _mm512_fmadd_ps(s, dx, axi);
+      ayi = _mm512_fmadd_ps(s, dy, ayi);
+      azi = _mm512_fmadd_ps(s, dz, azi);
+    }
+
+    ax[i] += _mm512_reduce_add_ps(axi);
+    ay[i] += _mm512_reduce_add_ps(ayi);
+    az[i] += _mm512_reduce_add_ps(azi);
+
+    direct_sum_scalar_f(tgt, i, src, jvec, jend, &ax[i], &ay[i], &az[i],
+                        min_dist);
+  }
+}
+
+__attribute__((target("avx512f"))) void
+direct_kernel_avx512(struct direct_bodies const *tgt, size_t begin,
+                     size_t end, struct direct_bodies const *src,
+                     size_t jbegin, size_t jend, double *ax, double *ay,
+                     double *az, double min_dist)
+{
+  size_t jvec = jbegin + ((jend - jbegin) & ~(size_t)7);
+  __m512d md2 = _mm512_set1_pd(min_dist * min_dist);
+  __m512d three_halves = _mm512_set1_pd(1.5), half = _mm512_set1_pd(0.5);
+
+  for (size_t i = begin; i < end; ++i) {
+    __m512d xi = _mm512_set1_pd(tgt->x[i]), yi = _mm512_set1_pd(tgt->y[i]),
+            zi = _mm512_set1_pd(tgt->z[i]);
+    __m512d axi = _mm512_setzero_pd(), ayi = _mm512_setzero_pd(),
+            azi = _mm512_setzero_pd();
+
+    for (size_t j = jbegin; j < jvec; j += 8) {
+      __m512d dx = _mm512_sub_pd(_mm512_loadu_pd(&src->x[j]), xi);
+      __m512d dy = _mm512_sub_pd(_mm512_loadu_pd(&src->y[j]), yi);
+      __m512d dz = _mm512_sub_pd(_mm512_loadu_pd(&src->z[j]), zi);
+      __m512d r2 = _mm512_fmadd_pd(
+          dz, dz, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)));
+      r2 = _mm512_max_pd(r2, md2);
+
+      // 14-bit double precision estimate, refined to double precision
+      __m512d h = _mm512_mul_pd(half, r2);
+      __m512d y = _mm512_rsqrt14_pd(r2);
+      for (int k = 0; k < 2; ++k) {
+        y = _mm512_mul_pd(
+            y, _mm512_fnmadd_pd(h, _mm512_mul_pd(y, y), three_halves));
+      }
+
+      __m512d s = _mm512_mul_pd(_mm512_loadu_pd(&src->mass[j]),
+                                _mm512_mul_pd(_mm512_mul_pd(y, y), y));
+      axi = _mm512_fmadd_pd(s, dx, axi);
+      ayi = _mm512_fmadd_pd(s, dy, ayi);
+      azi = _mm512_fmadd_pd(s, dz, azi);
+    }
+
+    ax[i] += _mm512_reduce_add_pd(axi);
+    ay[i] += _mm512_reduce_add_pd(ayi);
+    az[i] += _mm512_reduce_add_pd(azi);
+
+    direct_sum_scalar(tgt, i, src, jvec, jend, &ax[i], &ay[i], &az[i],
+                      min_dist);
+  }
+}
+
+__attribute__((target("avx2,fma"))) void
+direct_sym_kernel_avx2(struct direct_bodies const *b, size_t begin, size_t end,
+                       size_t jbegin, size_t jend, double *ax, double *ay,
+                       double *az, double min_dist)
+{
+  __m256d md2 = _mm256_set1_pd(min_dist * min_dist);
+  __m256d three_halves = _mm256_set1_pd(1.5), half = _mm256_set1_pd(0.5);
+
+  for (size_t i = begin; i < end; ++i) {
+    size_t jfirst = (begin == jbegin) ? i + 1 : jbegin;
+    size_t jvec = (jfirst < jend) ? jfirst + ((jend - jfirst) & ~(size_t)3)
+                                  : jfirst;
+    __m256d xi = _mm256_set1_pd(b->x[i]), yi = _mm256_set1_pd(b->y[i]),
+            zi = _mm256_set1_pd(b->z[i]), mi = _mm256_set1_pd(b->mass[i]);
+    __m256d axi = _mm256_setzero_pd(), ayi = _mm256_setzero_pd(),
+            azi = _mm256_setzero_pd();
+
+    for (size_t j = jfirst; j < jvec; j += 4) {
+      __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(&b->x[j]), xi);
+      __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(&b->y[j]), yi);
+      __m256d dz = _mm256_sub_pd(_mm256_loadu_pd(&b->z[j]), zi);
+      __m256d r2 = _mm256_fmadd_pd(
+          dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+      r2 = _mm256_max_pd(r2, md2);
+
+      __m256d h = _mm256_mul_pd(half, r2);
+      __m256d y = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(r2)));
+      for (int k = 0; k < 3; ++k) {
+        y = _mm256_mul_pd(
+            y, _mm256_fnmadd_pd(h, _mm256_mul_pd(y, y), three_halves));
+      }
+
+      __m256d inv3 = _mm256_mul_pd(_mm256_mul_pd(y, y), y);
+      __m256d si = _mm256_mul_pd(_mm256_loadu_pd(&b->mass[j]), inv3);
+      __m256d sj = _mm256_mul_pd(mi, inv3);
+      axi = _mm256_fmadd_pd(si, dx, axi);
+      ayi = _mm256_fmadd_pd(si, dy, ayi);
+      azi = _mm256_fmadd_pd(si, dz, azi);
+      __m256d axj = _mm256_loadu_pd(&ax[j]);
+      _mm256_storeu_pd(&ax[j], _mm256_fnmadd_pd(sj, dx, axj));
+      __m256d ayj = _mm256_loadu_pd(&ay[j]);
+      _mm256_storeu_pd(&ay[j], _mm256_fnmadd_pd(sj, dy, ayj));
+      __m256d azj = _mm256_loadu_pd(&az[j]);
+      _mm256_storeu_pd(&az[j], _mm256_fnmadd_pd(sj, dz, azj));
+    }
+
+    ax[i] += direct_hsum_avx2(axi);
+    ay[i] += direct_hsum_avx2(ayi);
+    az[i] += direct_hsum_avx2(azi);
+
+    direct_sym_sum_scalar(b, i, jvec, jend, ax, ay, az, min_dist);
+  }
+}
+
+__attribute__((target("avx512f"))) void
+direct_sym_kernel_avx512(struct direct_bodies const *b, size_t begin,
+                         size_t end, size_t jbegin, size_t jend, double *ax,
+                         double *ay, double *az, double min_dist)
+{
+  __m512d md2 = _mm512_set1_pd(min_dist * min_dist);
+  __m512d three_halves = _mm512_set1_pd(1.5), half = _mm512_set1_pd(0.5);
+
+  for (size_t i = begin; i < end; ++i) {
+    size_t jfirst = (begin == jbegin) ? i + 1 : jbegin;
+    size_t jvec = (jfirst < jend) ? jfirst + ((jend - jfirst) & ~(size_t)7)
+                                  : jfirst;
+    __m512d xi = _mm512_set1_pd(b->x[i]), yi = _mm512_set1_pd(b->y[i]),
+            zi = _mm512_set1_pd(b->z[i]), mi = _mm512_set1_pd(b->mass[i]);
+    __m512d axi = _mm512_setzero_pd(), ayi = _mm512_setzero_pd(),
+            azi = _mm512_setzero_pd();
+
+    for (size_t j = jfirst; j < jvec; j += 8) {
+      __m512d dx = _mm512_sub_pd(_mm512_loadu_pd(&b->x[j]), xi);
+      __m512d dy = _mm512_sub_pd(_mm512_loadu_pd(&b->y[j]), yi);
+      __m512d dz = _mm512_sub_pd(_mm512_loadu_pd(&b->z[j]), zi);
+      __m512d r2 = _mm512_fmadd_pd(
+          dz, dz, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)));
+      r2 = _mm512_max_pd(r2, md2);
+
+      __m512d h = _mm512_mul_pd(half, r2);
+      __m512d y = _mm512_rsqrt14_pd(r2);
+      for (int k = 0; k < 2; ++k) {
+        y = _mm512_mul_pd(
+            y, _mm512_fnmadd_pd(h, _mm512_mul_pd(y, y), three_halves));
+      }
+
+      __m512d inv3 = _mm512_mul_pd(_mm512_mul_pd(y, y), y);
+      __m512d si = _mm512_mul_pd(_mm512_loadu_pd(&b->mass[j]), inv3);
+      __m512d sj = _mm512_mul_pd(mi, inv3);
+      axi = _mm512_fmadd_pd(si, dx, axi);
+      ayi = _mm512_fmadd_pd(si, dy, ayi);
+      azi = _mm512_fmadd_pd(si, dz, azi);
+      __m512d axj = _mm512_loadu_pd(&ax[j]);
+      _mm512_storeu_pd(&ax[j], _mm512_fnmadd_pd(sj, dx, axj));
+      __m512d ayj = _mm512_loadu_pd(&ay[j]);
+      _mm512_storeu_pd(&ay[j], _mm512_fnmadd_pd(sj, dy, ayj));
+      __m512d azj = _mm512_loadu_pd(&az[j]);
+      _mm512_storeu_pd(&az[j], _mm512_fnmadd_pd(sj, dz, azj));
+    }
+
+    ax[i] += _mm512_reduce_add_pd(axi);
+    ay[i] += _mm512_reduce_add_pd(ayi);
+    az[i] += _mm512_reduce_add_pd(azi);
+
+    direct_sym_sum_scalar(b, i, jvec, jend, ax, ay, az, min_dist);
+  }
+}
+
+__attribute__((target("avx2,fma"))) void
+direct_quad_kernel_avx2(struct direct_bodies const *tgt, size_t begin,
+                        size_t end, struct direct_quads const *src,
+                        size_t jbegin, size_t jend, double *ax, double *ay,
+                        double *az, double min_dist)
+{
+  double const *const *q = src->q;
+  size_t jvec = jbegin + ((jend - jbegin) & ~(size_t)3);
+  __m256d md2 = _mm256_set1_pd(min_dist * min_dist);
+  __m256d three_halves = _mm256_set1_pd(1.5), half = _mm256_set1_pd(0.5);
+  __m256d five_halves = _mm256_set1_pd(2.5);
+
+  for (size_t i = begin; i < end; ++i) {
+    __m256d xi = _mm256_set1_pd(tgt->x[i]), yi = _mm256_set1_pd(tgt->y[i]),
+            zi = _mm256_set1_pd(tgt->z[i]);
+    __m256d axi = _mm256_setzero_pd(), ayi = _mm256_setzero_pd(),
+            azi = _mm256_setzero_pd();
+
+    for (size_t j = jbegin; j < jvec; j += 4) {
+      __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(&src->x[j]), xi);
+      __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(&src->y[j]), yi);
+      __m256d dz = _mm256_sub_pd(_mm256_loadu_pd(&src->z[j]), zi);
+      __m256d r2 = _mm256_fmadd_pd(
+          dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+      r2 = _mm256_max_pd(r2, md2);
+
+      __m256d h = _mm256_mul_pd(half, r2);
+      __m256d y = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(r2)));
+      for (int k = 0; k < 3; ++k) {
+        y = _mm256_mul_pd(
+            y, _mm256_fnmadd_pd(h, _mm256_mul_pd(y, y), three_halves));
+      }
+
+      __m256d q0 = _mm256_loadu_pd(&q[0][j]), q1 = _mm256_loadu_pd(&q[1][j]),
+              q2 = _mm256_loadu_pd(&q[2][j]), q3 = _mm256_loadu_pd(&q[3][j]),
+              q4 = _mm256_loadu_pd(&q[4][j]), q5 = _mm256_loadu_pd(&q[5][j]);
+      __m256d qx = _mm256_fmadd_pd(
+          q4, dz, _mm256_fmadd_pd(q3, dy, _mm256_mul_pd(q0, dx)));
+      __m256d qy = _mm256_fmadd_pd(
+          q5, dz, _mm256_fmadd_pd(q1, dy, _mm256_mul_pd(q3, dx)));
+      __m256d qz = _mm256_fmadd_pd(
+          q2, dz, _mm256_fmadd_pd(q5, dy, _mm256_mul_pd(q4, dx)));
+
+      __m256d inv2 = _mm256_mul_pd(y, y);
+      __m256d inv5 = _mm256_mul_pd(_mm256_mul_pd(inv2, inv2), y);
+      __m256d dqd = _mm256_fmadd_pd(
+          dz, qz, _mm256_fmadd_pd(dy, qy, _mm256_mul_pd(dx, qx)));
+      __m256d s = _mm256_mul_pd(_mm256_mul_pd(five_halves, dqd), inv2);
+      axi = _mm256_fmadd_pd(_mm256_fmsub_pd(s, dx, qx), inv5, axi);
+      ayi = _mm256_fmadd_pd(_mm256_fmsub_pd(s, dy, qy), inv5, ayi);
+      azi = _mm256_fmadd_pd(_mm256_fmsub_pd(s, dz, qz), inv5, azi);
+    }
+
+    ax[i] += direct_hsum_avx2(axi);
+    ay[i] += direct_hsum_avx2(ayi);
+    az[i] += direct_hsum_avx2(azi);
+
+    direct_quad_scalar(tgt, i, src, jvec, jend, &ax[i], &ay[i], &az[i],
+                       min_dist);
+  }
+}
+
+__attribute__((target("avx2,fma"))) void
+direct_jerk_kernel_avx2(struct direct_bodies const *tgt, size_t begin,
+                        size_t end, struct direct_bodies const *src,
+                        size_t jbegin, size_t jend, double *ax, double *ay,
+                        double *az, double *jx, double *jy, double *jz,
+                        double min_dist)
+{
+  size_t jvec = jbegin + ((jend - jbegin) & ~(size_t)3);
+  __m256d md2 = _mm256_set1_pd(min_dist * min_dist);
+  __m256d three_halves = _mm256_set1_pd(1.5), half = _mm256_set1_pd(0.5);
+  __m256d three = _mm256_set1_pd(3.0);
+
+  for (size_t i = begin; i < end; ++i) {
+    __m256d xi = _mm256_set1_pd(tgt->x[i]), yi = _mm256_set1_pd(tgt->y[i]),
+            zi = _mm256_set1_pd(tgt->z[i]);
+    __m256d vxi = _mm256_set1_pd(tgt->vx[i]),
+            vyi = _mm256_set1_pd(tgt->vy[i]),
+            vzi = _mm256_set1_pd(tgt->vz[i]);
+    __m256d axi = _mm256_setzero_pd(), ayi = _mm256_setzero_pd(),
+            azi = _mm256_setzero_pd();
+    __m256d jxi = _mm256_setzero_pd(), jyi = _mm256_setzero_pd(),
+            jzi = _mm256_setzero_pd();
+
+    for (size_t j = jbegin; j < jvec; j += 4) {
+      __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(&src->x[j]), xi);
+      __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(&src->y[j]), yi);
+      __m256d dz = _mm256_sub_pd(_mm256_loadu_pd(&src->z[j]), zi);
+      __m256d dvx = _mm256_sub_pd(_mm256_loadu_pd(&src->vx[j]), vxi);
+      __m256d dvy = _mm256_sub_pd(_mm256_loadu_pd(&src->vy[j]), vyi);
+      __m256d dvz = _mm256_sub_pd(_mm256_loadu_pd(&src->vz[j]), vzi);
+      __m256d r2 = _mm256_fmadd_pd(
+          dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+      r2 = _mm256_max_pd(r2, md2);
+
+      __m256d h = _mm256_mul_pd(half, r2);
+      __m256d y = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(r2)));
+      for (int k = 0; k < 3; ++k) {
+        y = _mm256_mul_pd(
+            y, _mm256_fnmadd_pd(h, _mm256_mul_pd(y, y), three_halves));
+      }
+
+      __m256d inv2 = _mm256_mul_pd(y, y);
+      __m256d s =
+          _mm256_mul_pd(_mm256_loadu_pd(&src->mass[j]), _mm256_mul_pd(inv2, y));
+      __m256d xv = _mm256_fmadd_pd(
+          dz, dvz, _mm256_fmadd_pd(dy, dvy, _mm256_mul_pd(dx, dvx)));
+      __m256d rv = _mm256_mul_pd(_mm256_mul_pd(three, xv), inv2);
+      axi = _mm256_fmadd_pd(s, dx, axi);
+      ayi = _mm256_fmadd_pd(s, dy, ayi);
+      azi = _mm256_fmadd_pd(s, dz, azi);
+      jxi = _mm256_fmadd_pd(s, _mm256_fnmadd_pd(rv, dx, dvx), jxi);
+      jyi = _mm256_fmadd_pd(s, _mm256_fnmadd_pd(rv, dy, dvy), jyi);
+      jzi = _mm256_fmadd_pd(s, _mm256_fnmadd_pd(rv, dz, dvz), jzi);
+    }
+
+    ax[i] += direct_hsum_avx2(axi);
+    ay[i] += direct_hsum_avx2(ayi);
+    az[i] += direct_hsum_avx2(azi);
+    jx[i] += direct_hsum_avx2(jxi);
+    jy[i] += direct_hsum_avx2(jyi);
+    jz[i] += direct_hsum_avx2(jzi);
+
+    direct_jerk_scalar(tgt, i, src, jvec, jend, &ax[i], &ay[i], &az[i],
+                       &jx[i], &jy[i], &jz[i], min_dist);
+  }
+}
+
+__attribute__((target("avx512f"))) void
+direct_jerk_kernel_avx512(struct direct_bodies const *tgt, size_t begin,
+                          size_t end, struct direct_bodies const *src,
+                          size_t jbegin, size_t jend, double *ax, double *ay,
+                          double *az, double *jx, double *jy, double *jz,
+                          double min_dist)
+{
+  size_t jvec = jbegin + ((jend - jbegin) & ~(size_t)7);
+  __m512d md2 = _mm512_set1_pd(min_dist * min_dist);
+  __m512d three_halves = _mm512_set1_pd(1.5), half = _mm512_set1_pd(0.5);
+  __m512d three = _mm512_set1_pd(3.0);
+
+  for (size_t i = begin; i < end; ++i) {
+    __m512d xi = _mm512_set1_pd(tgt->x[i]), yi = _mm512_set1_pd(tgt->y[i]),
+            zi = _mm512_set1_pd(tgt->z[i]);
+    __m512d vxi = _mm512_set1_pd(tgt->vx[i]),
+            vyi = _mm512_set1_pd(tgt->vy[i]),
+            vzi = _mm512_set1_pd(tgt->vz[i]);
+    __m512d axi = _mm512_setzero_pd(), ayi = _mm512_setzero_pd(),
+            azi = _mm512_setzero_pd();
+    __m512d jxi = _mm512_setzero_pd(), jyi = _mm512_setzero_pd(),
+            jzi = _mm512_setzero_pd();
+
+    for (size_t j = jbegin; j < jvec; j += 8) {
+      __m512d dx = _mm512_sub_pd(_mm512_loadu_pd(&src->x[j]), xi);
+      __m512d dy = _mm512_sub_pd(_mm512_loadu_pd(&src->y[j]), yi);
+      __m512d dz = _mm512_sub_pd(_mm512_loadu_pd(&src->z[j]), zi);
+      __m512d dvx = _mm512_sub_pd(_mm512_loadu_pd(&src->vx[j]), vxi);
+      __m512d dvy = _mm512_sub_pd(_mm512_loadu_pd(&src->vy[j]), vyi);
+      __m512d dvz = _mm512_sub_pd(_mm512_loadu_pd(&src->vz[j]), vzi);
+      __m512d r2 = _mm512_fmadd_pd(
+          dz, dz, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)));
+      r2 = _mm512_max_pd(r2, md2);
+
+      __m512d h = _mm512_mul_pd(half, r2);
+      __m512d y = _mm512_rsqrt14_pd(r2);
+      for (int k = 0; k < 2; ++k) {
+        y = _mm512_mul_pd(
+            y, _mm512_fnmadd_pd(h, _mm512_mul_pd(y, y), three_halves));
+      }
+
+      __m512d inv2 = _mm512_mul_pd(y, y);
+      __m512d s =
+          _mm512_mul_pd(_mm512_loadu_pd(&src->mass[j]), _mm512_mul_pd(inv2, y));
+      __m512d xv = _mm512_fmadd_pd(
+          dz, dvz, _mm512_fmadd_pd(dy, dvy, _mm512_mul_pd(dx, dvx)));
+      __m512d rv = _mm512_mul_pd(_mm512_mul_pd(three, xv), inv2);
+      axi = _mm512_fmadd_pd(s, dx, axi);
+      ayi = _mm512_fmadd_pd(s, dy, ayi);
+      azi = _mm512_fmadd_pd(s, dz, azi);
+      jxi = _mm512_fmadd_pd(s, _mm512_fnmadd_pd(rv, dx, dvx), jxi);
+      jyi = _mm512_fmadd_pd(s, _mm512_fnmadd_pd(rv, dy, dvy), jyi);
+      jzi = _mm512_fmadd_pd(s, _mm512_fnmadd_pd(rv, dz, dvz), jzi);
+    }
+
+    ax[i] += _mm512_reduce_add_pd(axi);
+    ay[i] += _mm512_reduce_add_pd(ayi);
+    az[i] += _mm512_reduce_add_pd(azi);
+    jx[i] += _mm512_reduce_add_pd(jxi);
+    jy[i] += _mm512_reduce_add_pd(jyi);
+    jz[i] += _mm512_reduce_add_pd(jzi);
+
+    direct_jerk_scalar(tgt, i, src, jvec, jend, &ax[i], &ay[i], &az[i],
+                       &jx[i], &jy[i], &jz[i], min_dist);
+  }
+}
+
+__attribute__((target("avx512f"))) void
+direct_quad_kernel_avx512(struct direct_bodies const *tgt, size_t begin,
+                          size_t end, struct direct_quads const *src,
+                          size_t jbegin, size_t jend, double *ax, double *ay,
+                          double *az, double min_dist)
+{
+  double const *const *q = src->q;
+  size_t jvec = jbegin + ((jend - jbegin) & ~(size_t)7);
+  __m512d md2 = _mm512_set1_pd(min_dist * min_dist);
+  __m512d three_halves = _mm512_set1_pd(1.5), half = _mm512_set1_pd(0.5);
+  __m512d five_halves = _mm512_set1_pd(2.5);
+
+  for (size_t i = begin; i < end; ++i) {
+    __m512d xi = _mm512_set1_pd(tgt->x[i]), yi = _mm512_set1_pd(tgt->y[i]),
+            zi = _mm512_set1_pd(tgt->z[i]);
+    __m512d axi = _mm512_setzero_pd(), ayi = _mm512_setzero_pd(),
+            azi = _mm512_setzero_pd();
+
+    for (size_t j = jbegin; j < jvec; j += 8) {
+      __m512d dx = _mm512_sub_pd(_mm512_loadu_pd(&src->x[j]), xi);
+      __m512d dy = _mm512_sub_pd(_mm512_loadu_pd(&src->y[j]), yi);
+      __m512d dz = _mm512_sub_pd(_mm512_loadu_pd(&src->z[j]), zi);
+      __m512d r2 = _mm512_fmadd_pd(
+          dz, dz, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)));
+      r2 = _mm512_max_pd(r2, md2);
+
+      __m512d h = _mm512_mul_pd(half, r2);
+      __m512d y = _mm512_rsqrt14_pd(r2);
+      for (int k = 0; k < 2; ++k) {
+        y = _mm512_mul_pd(
+            y, _mm512_fnmadd_pd(h, _mm512_mul_pd(y, y), three_halves));
+      }
+
+      __m512d q0 = _mm512_loadu_pd(&q[0][j]), q1 = _mm512_loadu_pd(&q[1][j]),
+              q2 = _mm512_loadu_pd(&q[2][j]), q3 = _mm512_loadu_pd(&q[3][j]),
+              q4 = _mm512_loadu_pd(&q[4][j]), q5 = _mm512_loadu_pd(&q[5][j]);
+      __m512d qx = _mm512_fmadd_pd(
+          q4, dz, _mm512_fmadd_pd(q3, dy, _mm512_mul_pd(q0, dx)));
+      __m512d qy = _mm512_fmadd_pd(
+          q5, dz, _mm512_fmadd_pd(q1, dy, _mm512_mul_pd(q3, dx)));
+      __m512d qz = _mm512_fmadd_pd(
+          q2, dz, _mm512_fmadd_pd(q5, dy, _mm512_mul_pd(q4, dx)));
+
+      __m512d inv2 = _mm512_mul_pd(y, y);
+      __m512d inv5 = _mm512_mul_pd(_mm512_mul_pd(inv2, inv2), y);
+      __m512d dqd = _mm512_fmadd_pd(
+          dz, qz, _mm512_fmadd_pd(dy, qy, _mm512_mul_pd(dx, qx)));
+      __m512d s = _mm512_mul_pd(_mm512_mul_pd(five_halves, dqd), inv2);
+      axi = _mm512_fmadd_pd(_mm512_fmsub_pd(s, dx, qx), inv5, axi);
+      ayi = _mm512_fmadd_pd(_mm512_fmsub_pd(s, dy, qy), inv5, ayi);
+      azi = _mm512_fmadd_pd(_mm512_fmsub_pd(s, dz, qz), inv5, azi);
+    }
+
+    ax[i] += _mm512_reduce_add_pd(axi);
+    ay[i] += _mm512_reduce_add_pd(ayi);
+    az[i] += _mm512_reduce_add_pd(azi);
+
+    direct_quad_scalar(tgt, i, src, jvec, jend, &ax[i], &ay[i], &az[i],
+                       min_dist);
+  }
+}
+
+#endif // DIRECT_X86
+
+static const direct_kernel direct_kernels[DIRECT_NUM_ISAS] = {
+    direct_kernel_scalar,
+#ifdef DIRECT_X86
+    direct_kernel_sse2, direct_kernel_avx2, direct_kernel_avx512,
+#endif
+};
+
+// SSE2 has no fused multiply-add to update the j side cheaply, and uses the
+// scalar symmetric kernel.
+static const direct_sym_kernel direct_sym_kernels[DIRECT_NUM_ISAS] = {
+    direct_sym_kernel_scalar,
+#ifdef DIRECT_X86
+    direct_sym_kernel_scalar, direct_sym_kernel_avx2, direct_sym_kernel_avx512,
+#endif
+};
+
+// SSE2 has no fused multiply-add either, and uses the scalar quadrupole
+// kernel.
+static const direct_quad_kernel direct_quad_kernels[DIRECT_NUM_ISAS] = {
+    direct_quad_kernel_scalar,
+#ifdef DIRECT_X86
+    direct_quad_kernel_scalar, direct_quad_kernel_avx2,
+    direct_quad_kernel_avx512,
+#endif
+};
+
+// SSE2 uses the scalar jerk kernel too
+static const direct_jerk_kernel direct_jerk_kernels[DIRECT_NUM_ISAS] = {
+    direct_jerk_kernel_scalar,
+#ifdef DIRECT_X86
+    direct_jerk_kernel_scalar, direct_jerk_kernel_avx2,
+    direct_jerk_kernel_avx512,
+#endif
+};
+
+// SSE2 likewise uses the scalar single precision kernel
+static const direct_kernel_f direct_kernels_f[DIRECT_NUM_ISAS] = {
+    direct_kernel_scalar_f,
+#ifdef DIRECT_X86
+    direct_kernel_scalar_f, direct_kernel_avx2_f, direct_kernel_avx512_f,
+#endif
+};
+
+static const char *direct_isa_names[DIRECT_NUM_ISAS] = {"scalar", "sse2",
+                                                        "avx2", "avx512"};
+
+static enum direct_isa best_isa = DIRECT_SCALAR;
+static pthread_once_t best_isa_once = PTHREAD_ONCE_INIT;
+
+void direct_detect_isa(void)
+{
+#ifdef DIRECT_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) { best_isa = DIRECT_AVX512; }
+  else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    best_isa = DIRECT_AVX2;
+  }
+  else if (__builtin_cpu_supports("sse2")) {
+    best_isa = DIRECT_SSE2;
+  }
+#endif
+}
+
+enum direct_isa direct_best_isa(void)
+{
+  pthread_once(&best_isa_once, direct_detect_isa);
+  return best_isa;
+}
+
+const char *direct_isa_name(enum direct_isa isa)
+{
+  return direct_isa_names[isa];
+}
+
+// Add the contributions of all sources to targets [begin, end), a tile of
+// sources at a time
+void direct_accel_tiles(direct_kernel kernel, struct direct_bodies const *tgt,
+                        size_t begin, size_t end,
+                        struct direct_bodies const *src, double *ax,
+                        double *ay, double *az, double min_dist)
+{
+  for (size_t jbegin = 0; jbegin < src->count; jbegin += DIRECT_TILE) {
+    size_t jend = (jbegin + DIRECT_TILE < src->count) ? jbegin + DIRECT_TILE
+                                                      : src->count;
+    kernel(tgt, begin, end, src, jbegin, jend, ax, ay, az, min_dist);
+  }
+}
+
+void direct_accel_isa(enum direct_isa isa, struct direct_bodies const *b,
+                      size_t begin, size_t end, double *ax, double *ay,
+                      double *az, double min_dist)
+{
+  for (size_t i = begin; i < end; ++i) {
+    ax[i] = ay[i] = az[i] = 0.0;
+  }
+
+  direct_accel_tiles(direct_kernels[isa], b, begin, end, b, ax, ay, az,
+                     min_dist);
+}
+
+void direct_accel(struct direct_bodies const *b, size_t begin, size_t end,
+                  double *ax, double *ay, double *az, double min_dist)
+{
+  direct_accel_isa(direct_best_isa(), b, begin, end, ax, ay, az, min_dist);
+}
+
+void direct_accel_add(struct direct_bodies const *targets, size_t begin,
+                      size_t end, struct direct_bodies const *sources,
+                      double *ax, double *ay, double *az, double min_dist)
+{
+  direct_accel_tiles(direct_kernels[direct_best_isa()], targets, begin, end,
+                     sources, ax, ay, az, min_dist);
+}
+
+void direct_jerk_add(struct direct_bodies const *targets, size_t begin,
+                     size_t end, struct direct_bodies const *sources,
+                     double *ax, double *ay, double *az, double *jx,
+                     double *jy, double *jz, double min_dist)
+{
+  direct_jerk_kernel kernel = direct_jerk_kernels[direct_best_isa()];
+
+  for (size_t jbegin = 0; jbegin < sources->count; jbegin += DIRECT_TILE) {
+    size_t jend = (jbegin + DIRECT_TILE < sources->count)
+                      ? jbegin + DIRECT_TILE
+                      : sources->count;
+    kernel(targets, begin, end, sources, jbegin, jend, ax, ay, az, jx, jy, jz,
+           min_dist);
+  }
+}
+
+void direct_accel_add_f(struct direct_bodies_f const *targets, size_t begin,
+                        size_t end, struct direct_bodies_f const *sources,
+                        double *ax, double *ay, double *az, float min_dist)
+{
+  direct_kernel_f kernel = direct_kernels_f[direct_best_isa()];
+
+  for (size_t jbegin = 0; jbegin < sources->count; jbegin += DIRECT_TILE) {
+    size_t jend = (jbegin + DIRECT_TILE < sources->count)
+                      ? jbegin + DIRECT_TILE
+                      : sources->count;
+    kernel(targets, begin, end, sources, jbegin, jend, ax, ay, az, min_dist);
+  }
+}
+
+// Argument to a symmetric task: the tile of pairs between bodies [begin, end)
+// and [jbegin, jend), or within [begin, end) if the ranges are the same.
+struct direct_sym_arg {
+  struct direct_bodies b;
+  double *ax, *ay, *az;
+  double min_dist;
+  size_t begin, end, jbegin, jend;
+};
+
+// Sweep a tile of pairs in sub-tiles of DIRECT_TILE sources
+void direct_sym_tile(struct direct_sym_arg *arg)
+{
+  direct_sym_kernel kernel = direct_sym_kernels[direct_best_isa()];
+  int diagonal = (arg->begin == arg->jbegin);
+
+  for (size_t jbegin = arg->jbegin; jbegin < arg->jend;
+       jbegin += DIRECT_TILE) {
+    size_t jend =
+        (jbegin + DIRECT_TILE < arg->jend) ? jbegin + DIRECT_TILE : arg->jend;
+    if (!diagonal) {
+      kernel(&arg->b, arg->begin, arg->end, jbegin, jend, arg->ax, arg->ay,
+             arg->az, arg->min_dist);
+      continue;
+    }
+    // Targets before the sub-tile pair with all of it, targets within it only
+    // with those after them.
+    if (arg->begin < jbegin) {
+      kernel(&arg->b, arg->begin, jbegin, jbegin, jend, arg->ax, arg->ay,
+             arg->az, arg->min_dist);
+    }
+    kernel(&arg->b, jbegin, jend, jbegin, jend, arg->ax, arg->ay, arg->az,
+           arg->min_dist);
+  }
+}
+
+// Clear the accelerations of a block, and sum the pairs within it
+void direct_sym_diagonal_task(void *argp)
+{
+  struct direct_sym_arg *arg = argp;
+
+  for (size_t i = arg->begin; i < arg->end; ++i) {
+    arg->ax[i] = arg->ay[i] = arg->az[i] = 0.0;
+  }
+  direct_sym_tile(arg);
+}
+
+// Sum the pairs between two blocks
+void direct_sym_tile_task(void *argp) { direct_sym_tile(argp); }
+
+enum ct_err direct_push_symmetric(struct threadpool *tp,
+                                  struct direct_bodies const *b, double *ax,
+                                  double *ay, double *az, double min_dist,
+                                  size_t num_blocks)
+{
+  int err;
+  struct direct_sym_arg arg = {
+      .b = *b, .ax = ax, .ay = ay, .az = az, .min_dist = min_dist};
+
+  if (num_blocks > b->count) { num_blocks = b->count; }
+  if (num_blocks == 0) { return CT_SUCCESS; }
+
+  for (size_t k = 0; k < num_blocks; ++k) {
+    arg.begin = arg.jbegin = k * b->count / num_blocks;
+    arg.end = arg.jend = (k + 1) * b->count / num_blocks;
+    err = threadpool_push_task(
+        tp, (struct task){.func = direct_sym_diagonal_task,
+                          .arg = &arg,
+                          .arg_size = sizeof(struct direct_sym_arg)});
+    if (err) { return err; }
+  }
+
+  // Round-robin pairing: with an even number of slots S, slot S - 1 stays
+  // put while the others rotate, and S - 1 rounds of S / 2 disjoint pairs
+  // cover every pair of slots once. An odd block count gets an idle slot.
+  size_t num_slots = num_blocks + num_blocks % 2;
+
+  for (size_t round = 0; round + 1 < num_slots; ++round) {
+    if ((err = threadpool_push_barrier(tp))) { return err; }
+
+    for (size_t k = 0; k < num_slots / 2; ++k) {
+      size_t p = (k == 0) ? num_slots - 1 : (round + k) % (num_slots - 1);
+      size_t q = (round + num_slots - 1 - k) % (num_slots - 1);
+      if (p >= num_blocks || q >= num_blocks) { continue; }
+
+      arg.begin = p * b->count / num_blocks;
+      arg.end = (p + 1) * b->count / num_blocks;
+      arg.jbegin = q * b->count / num_blocks;
+      arg.jend = (q + 1) * b->count / num_blocks;
+      err = threadpool_push_task(
+          tp, (struct task){.func = direct_sym_tile_task,
+                            .arg = &arg,
+                            .arg_size = sizeof(struct direct_sym_arg)});
+      if (err) { return err; }
+    }
+  }
+
+  return CT_SUCCESS;
+}
+
+void direct_quad_add(struct direct_bodies const *targets, size_t begin,
+                     size_t end, struct direct_quads const *sources,
+                     double *ax, double *ay, double *az, double min_dist)
+{
+  direct_quad_kernel kernel = direct_quad_kernels[direct_best_isa()];
+
+  for (size_t jbegin = 0; jbegin < sources->count; jbegin += DIRECT_TILE) {
+    size_t jend = (jbegin + DIRECT_TILE < sources->count)
+                      ? jbegin + DIRECT_TILE
+                      : sources->count;
+    kernel(targets, begin, end, sources, jbegin, jend, ax, ay, az, min_dist);
+  }
+}
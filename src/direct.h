@@ -0,0 +1,113 @@
+#ifndef __DIRECT_H__
+#define __DIRECT_H__
+
+#include <stddef.h>
+
+#include "error.h"
+#include "threadpool.h"
+
+// Direct O(N^2) summation of gravitational accelerations, vectorized for the
+// instruction sets below and dispatched on what the CPU supports at runtime.
+//
+// Pair distances are softened by clamping them to at least min_dist, without
+// branching. As the distance of a body to itself is clamped to a non-zero
+// value, its contribution is exactly zero, and the i == j test is dropped.
+
+// Bodies j are swept in tiles of this many, so that a tile of positions and
+// masses (4 doubles each) stays in L1 while a range of targets i runs over it.
+#define DIRECT_TILE 1024
+
+enum direct_isa {
+  DIRECT_SCALAR = 0,
+  DIRECT_SSE2,   // 2 lanes, rsqrtps + 3 Newton steps
+  DIRECT_AVX2,   // 4 lanes with FMA, rsqrtps + 3 Newton steps
+  DIRECT_AVX512, // 8 lanes, rsqrt14pd + 2 Newton steps
+  DIRECT_NUM_ISAS
+};
+
+struct direct_bodies {
+  const double *x, *y, *z, *mass;
+  const double *vx, *vy, *vz; // Read only by direct_jerk_add()
+  size_t count;
+};
+
+// Widest instruction set supported by both the build and the CPU
+enum direct_isa direct_best_isa(void);
+
+const char *direct_isa_name(enum direct_isa isa);
+
+// Compute accelerations of bodies [begin, end) due to all bodies, into
+// ax[i], ay[i], az[i] (overwritten), using the widest available instruction
+// set.
+void direct_accel(struct direct_bodies const *b, size_t begin, size_t end,
+                  double *ax, double *ay, double *az, double min_dist);
+
+// As direct_accel(), with the given instruction set. isa must be supported.
+void direct_accel_isa(enum direct_isa isa, struct direct_bodies const *b,
+                      size_t begin, size_t end, double *ax, double *ay,
+                      double *az, double min_dist);
+
+// Add the accelerations of targets [begin, end) due to all sources to ax[i],
+// ay[i], az[i], using the widest available instruction set. Only positions
+// are read from targets, and a target coinciding with a source gets no
+// contribution from it.
+void direct_accel_add(struct direct_bodies const *targets, size_t begin,
+                      size_t end, struct direct_bodies const *sources,
+                      double *ax, double *ay, double *az, double min_dist);
+
+// As direct_accel_add(), also adding the jerks (time derivatives of the
+// accelerations) of the targets to jx[i], jy[i], jz[i]. Source j contributes
+// mass_j (v / r^3 - 3 (x . v) x / r^5) with x and v its position and velocity
+// relative to the target, and r = max(|x|, min_dist).
+void direct_jerk_add(struct direct_bodies const *targets, size_t begin,
+                     size_t end, struct direct_bodies const *sources,
+                     double *ax, double *ay, double *az, double *jx,
+                     double *jy, double *jz, double min_dist);
+
+// Bodies in single precision. Coordinates are relative to an origin near the
+// targets, so that the offsets between targets and sources keep their
+// precision however far the origin is from zero.
+struct direct_bodies_f {
+  const float *x, *y, *z, *mass;
+  size_t count;
+};
+
+// As direct_accel_add(), in single precision, which doubles the lanes of each
+// vector. Each target's sum over a tile of sources is added to ax[i], ay[i],
+// az[i] in double precision.
+void direct_accel_add_f(struct direct_bodies_f const *targets, size_t begin,
+                        size_t end, struct direct_bodies_f const *sources,
+                        double *ax, double *ay, double *az, float min_dist);
+
+// Quadrupoles at positions x[j], y[j], z[j], with components q[0..5][j] in
+// the order xx, yy, zz, xy, xz, yz. Component q[k] is a column of count.
+struct direct_quads {
+  const double *x, *y, *z;
+  const double *q[6];
+  size_t count;
+};
+
+// Add the accelerations of targets [begin, end) due to the quadrupoles
+// of sources, without their monopoles, to ax[i], ay[i], az[i]. A quadrupole
+// Q at offset d from a target contributes -Q d / |d|^5 + 5/2 (d . Q d) d /
+// |d|^7, where Q_ij sums m (3 r_i r_j - |r|^2 delta_ij) over the masses.
+void direct_quad_add(struct direct_bodies const *targets, size_t begin,
+                     size_t end, struct direct_quads const *sources,
+                     double *ax, double *ay, double *az, double min_dist);
+
+// Push tasks onto tp that compute the accelerations of all bodies into ax,
+// ay, az (overwritten), visiting each pair once and applying equal and
+// opposite contributions to both bodies.
+//
+// Bodies are split into num_blocks blocks. Tiles of pairs within a block run
+// first, then tiles between blocks in rounds of disjoint pairs of blocks, so
+// that no two tasks of a round write the same bodies. Rounds are separated by
+// barriers, and the caller must push a barrier before using the result. A
+// round has num_blocks / 2 tasks, so num_blocks should be at least twice the
+// number of workers.
+enum ct_err direct_push_symmetric(struct threadpool *tp,
+                                  struct direct_bodies const *b, double *ax,
+                                  double *ay, double *az, double min_dist,
+                                  size_t num_blocks);
+
+#endif // __DIRECT_H__
@@ -11,6 +11,10 @@ const char *ct_err_str(enum ct_err e)
       return "malloc() failed.";
     case CT_EQUEUE_EMPTY:
       return "Queue is empty.";
+    case CT_EQUEUE_FULL:
+      return "Queue is full.";
+    case CT_ETIMEDOUT:
+      return "Operation timed out.";
     case CT_EMUTEX_INIT:
       return "Could not initialize mutex.";
     case CT_ECOND_INIT:
@@ -16,6 +16,8 @@ enum ct_err {
   CT_EMALLOC,
 
   CT_EQUEUE_EMPTY,
+  CT_EQUEUE_FULL,
+  CT_ETIMEDOUT,
 
   CT_EMUTEX_INIT,
   CT_ECOND_INIT,
@@ -0,0 +1,582 @@
+#include "fmm.h"
+#include "arena.h"
+#include "bhtree.h"
+#include "direct.h"
+#include "error.h"
+#include "threadpool.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MINDIST 0.001
+
+// A pair of nodes with at most this many pairs of bodies is summed directly,
+// which is then cheaper than an M2L translation.
+#define FMM_DIRECT_PAIRS 256
+
+// Targets are grouped into nodes of at most this many bodies, which walk
+// the sources together and share their direct sums.
+#define FMM_GROUP_SIZE 64
+
+// Source bodies gathered for a group before they are summed
+#define FMM_LIST_SIZE 1024
+
+// The expansions follow from the Taylor coefficients of 1 / |r|,
+//   T_n(r) = (1 / n!) d^n / dr^n (1 / |r|),
+// for multi-indices n = (nx, ny, nz) of degree |n| = nx + ny + nz. The
+// potential psi(x) = sum_j m_j / |x - y_j| has gradient the acceleration at x.
+//
+// About the centre z of a node, the multipole and local coefficients are
+//   M_n = sum_j m_j (y_j - z)^n,   psi(x) = sum_k L_k (x - z)^k,
+// and a multipole about z_B translates into a local expansion about z_A as
+//   L_k = sum_n (-1)^|n| binom(n + k, n) M_n T_{n+k}(z_A - z_B).
+
+// Multi-indices of degree up to FMM_ORDER, by degree, and the reverse map
+static int fmm_mi[FMM_TERMS][3];
+static int fmm_index[FMM_ORDER + 1][FMM_ORDER + 1][FMM_ORDER + 1];
+
+// Pair of multi-indices big >= small, for translating expansions:
+//   M2M  M'[big] += coef * M[small] * d^diff,
+//   L2L  L'[small] += coef * L[big] * d^diff,
+// where diff = big - small and coef = binom(big, small).
+struct fmm_shift {
+  int big, small, diff;
+  double coef;
+};
+
+// Pair of multi-indices for M2L: L[k] += coef * M[n] * T[sum]. The pairs
+// of each k are consecutive, starting at fmm_m2l_start[k].
+struct fmm_m2l {
+  int n, sum;
+  double coef;
+};
+
+// Terms of the recurrence for T_n, which has up to three of each sum. Absent
+// terms refer to a zero coefficient past the end.
+struct fmm_recurrence {
+  int first[3], second[3];
+  double c1, c2;
+};
+
+static struct fmm_shift fmm_shifts[FMM_TERMS * FMM_TERMS];
+static struct fmm_m2l fmm_m2ls[FMM_TERMS * FMM_TERMS];
+static size_t fmm_m2l_start[FMM_TERMS + 1];
+static struct fmm_recurrence fmm_recurrences[FMM_TERMS];
+static size_t fmm_num_shifts, fmm_num_m2ls;
+static pthread_once_t fmm_tables_once = PTHREAD_ONCE_INIT;
+
+double fmm_binom(int n, int k)
+{
+  double b = 1.0;
+  for (int i = 1; i <= k; ++i) {
+    b = b * (n - k + i) / i;
+  }
+  return b;
+}
+
+void fmm_tables_init(void)
+{
+  size_t t = 0;
+
+  for (int degree = 0; degree <= FMM_ORDER; ++degree) {
+    for (int x = degree; x >= 0; --x) {
+      for (int y = degree - x; y >= 0; --y) {
+        int z = degree - x - y;
+        fmm_mi[t][0] = x;
+        fmm_mi[t][1] = y;
+        fmm_mi[t][2] = z;
+        fmm_index[x][y][z] = t++;
+      }
+    }
+  }
+
+  for (int t = 1; t < FMM_TERMS; ++t) {
+    struct fmm_recurrence *r = &fmm_recurrences[t];
+    int const *n = fmm_mi[t];
+    int degree = n[0] + n[1] + n[2];
+
+    for (int i = 0; i < 3; ++i) {
+      int m[3] = {n[0], n[1], n[2]};
+      r->first[i] = r->second[i] = FMM_TERMS;
+      if (m[i] >= 1) {
+        m[i] -= 1;
+        r->first[i] = fmm_index[m[0]][m[1]][m[2]];
+      }
+      if (m[i] >= 1) {
+        m[i] -= 1;
+        r->second[i] = fmm_index[m[0]][m[1]][m[2]];
+      }
+    }
+    r->c1 = -(2.0 * degree - 1.0) / degree;
+    r->c2 = -(degree - 1.0) / degree;
+  }
+
+  for (int a = 0; a < FMM_TERMS; ++a) {
+    int const *ma = fmm_mi[a];
+    fmm_m2l_start[a] = fmm_num_m2ls;
+    for (int b = 0; b < FMM_TERMS; ++b) {
+      int const *mb = fmm_mi[b];
+      int degree = ma[0] + ma[1] + ma[2] + mb[0] + mb[1] + mb[2];
+
+      if (ma[0] >= mb[0] && ma[1] >= mb[1] && ma[2] >= mb[2]) {
+        fmm_shifts[fmm_num_shifts++] = (struct fmm_shift){
+            .big = a,
+            .small = b,
+            .diff = fmm_index[ma[0] - mb[0]][ma[1] - mb[1]][ma[2] - mb[2]],
+            .coef = fmm_binom(ma[0], mb[0]) * fmm_binom(ma[1], mb[1]) *
+                    fmm_binom(ma[2], mb[2])};
+      }
+
+      // a is the local index k, b the multipole index n
+      if (degree <= FMM_ORDER) {
+        int sign = ((mb[0] + mb[1] + mb[2]) % 2 == 0) ? 1 : -1;
+        fmm_m2ls[fmm_num_m2ls++] = (struct fmm_m2l){
+            .n = b,
+            .sum = fmm_index[ma[0] + mb[0]][ma[1] + mb[1]][ma[2] + mb[2]],
+            .coef = sign * fmm_binom(ma[0] + mb[0], mb[0]) *
+                    fmm_binom(ma[1] + mb[1], mb[1]) *
+                    fmm_binom(ma[2] + mb[2], mb[2])};
+      }
+    }
+  }
+  fmm_m2l_start[FMM_TERMS] = fmm_num_m2ls;
+}
+
+// Monomials d^n of all multi-indices
+void fmm_powers(double dx, double dy, double dz, double *pow)
+{
+  double px[FMM_ORDER + 1], py[FMM_ORDER + 1], pz[FMM_ORDER + 1];
+
+  px[0] = py[0] = pz[0] = 1.0;
+  for (int i = 1; i <= FMM_ORDER; ++i) {
+    px[i] = px[i - 1] * dx;
+    py[i] = py[i - 1] * dy;
+    pz[i] = pz[i - 1] * dz;
+  }
+  for (int t = 0; t < FMM_TERMS; ++t) {
+    pow[t] = px[fmm_mi[t][0]] * py[fmm_mi[t][1]] * pz[fmm_mi[t][2]];
+  }
+}
+
+// Taylor coefficients T_n(r) of 1 / |r|, by the recurrence
+//   |n| r^2 T_n = -(2|n| - 1) sum_i r_i T_{n-e_i} - (|n| - 1) sum_i T_{n-2e_i}
+// T has room for FMM_TERMS + 1 coefficients, the last of which is zero.
+void fmm_taylor(double rx, double ry, double rz, double *T)
+{
+  double inv_rsq = 1.0 / (rx * rx + ry * ry + rz * rz);
+
+  T[0] = sqrt(inv_rsq);
+  T[FMM_TERMS] = 0.0;
+  for (int t = 1; t < FMM_TERMS; ++t) {
+    struct fmm_recurrence const *r = &fmm_recurrences[t];
+    double sum1 = rx * T[r->first[0]] + ry * T[r->first[1]] +
+                  rz * T[r->first[2]];
+    double sum2 = T[r->second[0]] + T[r->second[1]] + T[r->second[2]];
+    T[t] = (r->c1 * sum1 + r->c2 * sum2) * inv_rsq;
+  }
+}
+
+// Compute the multipole of node i from its bodies (P2M), or from its
+// children (M2M)
+void fmm_upward(struct fmm *fmm, uint32_t i)
+{
+  struct bh_tree *tree = fmm->tree;
+  struct bh_cnode const *nodes = tree->nodes, *c = &nodes[i];
+  struct bh_bodies const *b = &tree->bodies;
+  double *M = fmm->multipole + (size_t)i * FMM_TERMS;
+  double pow[FMM_TERMS];
+
+  for (int t = 0; t < FMM_TERMS; ++t) {
+    M[t] = 0.0;
+  }
+
+  if (c->num_children == 0) {
+    for (uint32_t j = c->first_body; j != c->first_body + c->num_bodies;
+         ++j) {
+      fmm_powers(b->x[j] - c->cm.x, b->y[j] - c->cm.y, b->z[j] - c->cm.z,
+                 pow);
+      for (int t = 0; t < FMM_TERMS; ++t) {
+        M[t] += b->mass[j] * pow[t];
+      }
+    }
+    return;
+  }
+
+  for (uint32_t child = i + 1; child != c->next; child = nodes[child].next) {
+    struct bh_cnode const *d = &nodes[child];
+    double const *Mc = fmm->multipole + (size_t)child * FMM_TERMS;
+
+    fmm_powers(d->cm.x - c->cm.x, d->cm.y - c->cm.y, d->cm.z - c->cm.z, pow);
+    for (size_t s = 0; s < fmm_num_shifts; ++s) {
+      struct fmm_shift const *sh = &fmm_shifts[s];
+      M[sh->big] += sh->coef * Mc[sh->small] * pow[sh->diff];
+    }
+  }
+}
+
+// Translate the multipole of node b into the local expansion of node a (M2L)
+void fmm_m2l(struct fmm *fmm, uint32_t a, uint32_t b)
+{
+  struct bh_cnode const *na = &fmm->tree->nodes[a], *nb = &fmm->tree->nodes[b];
+  double const *M = fmm->multipole + (size_t)b * FMM_TERMS;
+  double *L = fmm->local + (size_t)a * FMM_TERMS;
+  double T[FMM_TERMS + 1];
+
+  fmm_taylor(na->cm.x - nb->cm.x, na->cm.y - nb->cm.y, na->cm.z - nb->cm.z, T);
+  for (int k = 0; k < FMM_TERMS; ++k) {
+    double sum = 0.0;
+    for (size_t s = fmm_m2l_start[k]; s != fmm_m2l_start[k + 1]; ++s) {
+      struct fmm_m2l const *p = &fmm_m2ls[s];
+      sum += p->coef * M[p->n] * T[p->sum];
+    }
+    L[k] += sum;
+  }
+}
+
+// Whether nodes a and b are far enough apart for M2L
+int fmm_separated(struct fmm const *fmm, struct bh_cnode const *a,
+                  struct bh_cnode const *b)
+{
+  double dx = a->cm.x - b->cm.x, dy = a->cm.y - b->cm.y,
+         dz = a->cm.z - b->cm.z;
+  double reach = a->extent + b->extent;
+  double distsq = dx * dx + dy * dy + dz * dz;
+
+  return reach * reach < fmm->theta * fmm->theta * distsq;
+}
+
+// Source bodies to sum directly into the bodies of a target node
+struct fmm_list {
+  double x[FMM_LIST_SIZE], y[FMM_LIST_SIZE], z[FMM_LIST_SIZE],
+      mass[FMM_LIST_SIZE];
+  size_t count;
+};
+
+// Sum the list into the accelerations of the bodies of node a (P2P), and
+// empty it. The list is padded with massless sources to a whole number of
+// vectors, which keeps the kernels off their scalar tails.
+void fmm_list_flush(struct fmm *fmm, struct fmm_list *list, uint32_t a)
+{
+  struct bh_cnode const *na = &fmm->tree->nodes[a];
+  struct bh_bodies const *b = &fmm->tree->bodies;
+
+  while (list->count % 8 != 0) {
+    list->x[list->count] = list->y[list->count] = list->z[list->count] = 0.0;
+    list->mass[list->count] = 0.0;
+    list->count += 1;
+  }
+  struct direct_bodies targets = {.x = b->x + na->first_body,
+                                  .y = b->y + na->first_body,
+                                  .z = b->z + na->first_body,
+                                  .count = na->num_bodies};
+  struct direct_bodies sources = {.x = list->x,
+                                  .y = list->y,
+                                  .z = list->z,
+                                  .mass = list->mass,
+                                  .count = list->count};
+
+  direct_accel_add(&targets, 0, na->num_bodies, &sources,
+                   fmm->ax + na->first_body, fmm->ay + na->first_body,
+                   fmm->az + na->first_body, MINDIST);
+  list->count = 0;
+}
+
+// Add the bodies of node b to the list for node a
+void fmm_list_add(struct fmm *fmm, struct fmm_list *list, uint32_t a,
+                  uint32_t b)
+{
+  struct bh_cnode const *nb = &fmm->tree->nodes[b];
+  struct bh_bodies const *bodies = &fmm->tree->bodies;
+
+  for (uint32_t j = nb->first_body; j != nb->first_body + nb->num_bodies;
+       ++j) {
+    if (list->count == FMM_LIST_SIZE) { fmm_list_flush(fmm, list, a); }
+    list->x[list->count] = bodies->x[j];
+    list->y[list->count] = bodies->y[j];
+    list->z[list->count] = bodies->z[j];
+    list->mass[list->count] = bodies->mass[j];
+    list->count += 1;
+  }
+}
+
+// Interactions of sources below node b with the bodies of group a. The
+// subtree of b is walked once, and the bodies to sum directly are gathered,
+// so that they are summed in long vectorized runs.
+void fmm_interact_group(struct fmm *fmm, uint32_t a, uint32_t b)
+{
+  struct bh_cnode const *nodes = fmm->tree->nodes, *na = &nodes[a];
+  struct fmm_list list;
+  uint32_t i = b;
+
+  list.count = 0;
+  do {
+    struct bh_cnode const *node = &nodes[i];
+    if ((size_t)na->num_bodies * node->num_bodies <= FMM_DIRECT_PAIRS ||
+        node->num_children == 0) {
+      fmm_list_add(fmm, &list, a, i);
+      i = node->next;
+    }
+    else if (fmm_separated(fmm, na, node)) {
+      fmm_m2l(fmm, a, i);
+      i = node->next;
+    }
+    else {
+      i += 1;
+    }
+  } while (i != nodes[b].next);
+
+  if (list.count != 0) { fmm_list_flush(fmm, &list, a); }
+}
+
+// Dual-tree traversal of the interactions of sources below node b with
+// targets below node a. The larger node of a pair that is neither
+// separated nor cheap to sum directly is split, until a is a group.
+void fmm_interact(struct fmm *fmm, uint32_t a, uint32_t b)
+{
+  struct bh_cnode const *nodes = fmm->tree->nodes;
+  struct bh_cnode const *na = &nodes[a], *nb = &nodes[b];
+
+  if ((size_t)na->num_bodies * nb->num_bodies > FMM_DIRECT_PAIRS &&
+      fmm_separated(fmm, na, nb)) {
+    fmm_m2l(fmm, a, b);
+  }
+  else if (na->num_children == 0 || na->num_bodies <= FMM_GROUP_SIZE) {
+    fmm_interact_group(fmm, a, b);
+  }
+  else if (nb->num_children == 0 || na->extent >= nb->extent) {
+    for (uint32_t child = a + 1; child != na->next; child = nodes[child].next) {
+      fmm_interact(fmm, child, b);
+    }
+  }
+  else {
+    for (uint32_t child = b + 1; child != nb->next; child = nodes[child].next) {
+      fmm_interact(fmm, a, child);
+    }
+  }
+}
+
+// Pass the local expansion of node i down to its children (L2L), or evaluate
+// it at its bodies (L2P)
+void fmm_downward(struct fmm *fmm, uint32_t i)
+{
+  struct bh_tree *tree = fmm->tree;
+  struct bh_cnode const *nodes = tree->nodes, *c = &nodes[i];
+  struct bh_bodies const *b = &tree->bodies;
+  double const *L = fmm->local + (size_t)i * FMM_TERMS;
+  double pow[FMM_TERMS];
+
+  if (c->num_children != 0) {
+    for (uint32_t child = i + 1; child != c->next;
+         child = nodes[child].next) {
+      struct bh_cnode const *d = &nodes[child];
+      double *Lc = fmm->local + (size_t)child * FMM_TERMS;
+
+      fmm_powers(d->cm.x - c->cm.x, d->cm.y - c->cm.y, d->cm.z - c->cm.z,
+                 pow);
+      for (size_t s = 0; s < fmm_num_shifts; ++s) {
+        struct fmm_shift const *sh = &fmm_shifts[s];
+        Lc[sh->small] += sh->coef * L[sh->big] * pow[sh->diff];
+      }
+    }
+    return;
+  }
+
+  // The gradient of the term L_k d^k along x is L_k kx d^(k - e_x).
+  for (uint32_t j = c->first_body; j != c->first_body + c->num_bodies; ++j) {
+    double acc[3] = {0.0, 0.0, 0.0};
+
+    fmm_powers(b->x[j] - c->cm.x, b->y[j] - c->cm.y, b->z[j] - c->cm.z, pow);
+    for (int t = 1; t < FMM_TERMS; ++t) {
+      int const *k = fmm_mi[t];
+      for (int axis = 0; axis < 3; ++axis) {
+        if (k[axis] == 0) { continue; }
+        int m[3] = {k[0], k[1], k[2]};
+        m[axis] -= 1;
+        acc[axis] += L[t] * k[axis] * pow[fmm_index[m[0]][m[1]][m[2]]];
+      }
+    }
+    fmm->ax[j] += acc[0];
+    fmm->ay[j] += acc[1];
+    fmm->az[j] += acc[2];
+  }
+}
+
+// Argument to an FMM task
+struct fmm_task_arg {
+  struct fmm *fmm;
+  struct bh_tree *tree;
+  double *ax, *ay, *az;
+  size_t task, num_tasks;
+};
+
+// Allocate the expansions and accelerations of the tree as built
+void fmm_prepare_task(void *argp)
+{
+  struct fmm_task_arg *arg = argp;
+  struct fmm *fmm = arg->fmm;
+  struct bh_tree *tree = arg->tree;
+  size_t num_nodes = tree->num_nodes, num_bodies = tree->bodies.count;
+
+  fmm->tree = tree;
+  fmm->err = tree->build_err;
+  if (fmm->err) { return; }
+
+  arena_reset(&fmm->scratch);
+  fmm->multipole = ARENA_NEW(&fmm->scratch, double, num_nodes * FMM_TERMS);
+  fmm->local = ARENA_NEW(&fmm->scratch, double, num_nodes * FMM_TERMS);
+  fmm->ax = ARENA_NEW(&fmm->scratch, double, num_bodies);
+  fmm->ay = ARENA_NEW(&fmm->scratch, double, num_bodies);
+  fmm->az = ARENA_NEW(&fmm->scratch, double, num_bodies);
+
+  if (num_nodes != 0 &&
+      (fmm->multipole == NULL || fmm->local == NULL || fmm->ax == NULL ||
+       fmm->ay == NULL || fmm->az == NULL)) {
+    fmm->err = -1;
+  }
+}
+
+// Compute the multipoles of one subtree of the flattened tree
+void fmm_upward_task(void *argp)
+{
+  struct fmm_task_arg *arg = argp;
+  struct fmm *fmm = arg->fmm;
+  struct bh_flatten const *f = &arg->tree->flatten;
+
+  if (fmm->err || arg->task >= f->num_subtrees) { return; }
+
+  size_t offset = f->subtree_offset[arg->task];
+  for (size_t i = offset + f->subtree_count[arg->task]; i-- > offset;) {
+    fmm_upward(fmm, i);
+  }
+}
+
+// Compute the multipoles of the nodes above the subtrees
+void fmm_upward_top_task(void *argp)
+{
+  struct fmm_task_arg *arg = argp;
+  struct bh_flatten const *f = &arg->tree->flatten;
+
+  if (arg->fmm->err || arg->tree->num_nodes == 0) { return; }
+
+  for (size_t k = f->num_top; k-- > 0;) {
+    fmm_upward(arg->fmm, f->top[k]);
+  }
+}
+
+// Compute the accelerations of the bodies of one subtree. The subtree root
+// interacts with the whole tree, so no expansion comes from above it.
+void fmm_downward_task(void *argp)
+{
+  struct fmm_task_arg *arg = argp;
+  struct fmm *fmm = arg->fmm;
+  struct bh_flatten const *f = &arg->tree->flatten;
+
+  if (fmm->err || arg->task >= f->num_subtrees) { return; }
+
+  size_t offset = f->subtree_offset[arg->task];
+  size_t end = offset + f->subtree_count[arg->task];
+  struct bh_cnode const *root = &arg->tree->nodes[offset];
+
+  for (size_t t = offset * FMM_TERMS; t != end * FMM_TERMS; ++t) {
+    fmm->local[t] = 0.0;
+  }
+  for (uint32_t j = root->first_body;
+       j != root->first_body + root->num_bodies; ++j) {
+    fmm->ax[j] = fmm->ay[j] = fmm->az[j] = 0.0;
+  }
+
+  fmm_interact(fmm, offset, 0);
+
+  for (size_t i = offset; i != end; ++i) {
+    fmm_downward(fmm, i);
+  }
+}
+
+// Copy the accelerations of bodies to our range of points, in key order
+void fmm_scatter_task(void *argp)
+{
+  struct fmm_task_arg *arg = argp;
+  struct fmm *fmm = arg->fmm;
+  struct bh_morton const *m = &arg->tree->morton;
+  size_t count = m->sort.count;
+
+  if (fmm->err) { return; }
+
+  size_t begin = arg->task * count / arg->num_tasks;
+  size_t end = (arg->task + 1) * count / arg->num_tasks;
+  for (size_t s = begin; s != end; ++s) {
+    size_t i = m->sort.vals[s], j = m->leaf[s];
+    arg->ax[i] = fmm->ax[j];
+    arg->ay[i] = fmm->ay[j];
+    arg->az[i] = fmm->az[j];
+  }
+}
+
+// Push a task, with its own copy of arg
+enum ct_err fmm_push(struct threadpool *tp, void (*func)(void *),
+                     struct fmm_task_arg *arg)
+{
+  return threadpool_push_task(
+      tp, (struct task){.func = func,
+                        .arg = arg,
+                        .arg_size = sizeof(struct fmm_task_arg)});
+}
+
+enum ct_err fmm_init(struct fmm *fmm, double theta)
+{
+  int err;
+
+  pthread_once(&fmm_tables_once, fmm_tables_init);
+
+  if ((err = arena_init(&fmm->scratch, 0))) { return err; }
+
+  fmm->theta = theta;
+  fmm->tree = NULL;
+  fmm->multipole = fmm->local = NULL;
+  fmm->ax = fmm->ay = fmm->az = NULL;
+  fmm->err = 0;
+
+  return CT_SUCCESS;
+}
+
+void fmm_destroy(struct fmm *fmm) { arena_destroy(&fmm->scratch); }
+
+enum ct_err fmm_push_solve(struct fmm *fmm, struct bh_tree *tree,
+                           struct threadpool *tp, double *ax, double *ay,
+                           double *az, size_t num_tasks)
+{
+  int err;
+  struct fmm_task_arg arg = {.fmm = fmm,
+                             .tree = tree,
+                             .ax = ax,
+                             .ay = ay,
+                             .az = az,
+                             .task = 0,
+                             .num_tasks = num_tasks};
+
+  if (num_tasks == 0) { arg.num_tasks = 1; }
+
+  if ((err = fmm_push(tp, fmm_prepare_task, &arg))) { return err; }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  for (arg.task = 0; arg.task < BH_BUILD_CELLS; ++arg.task) {
+    if ((err = fmm_push(tp, fmm_upward_task, &arg))) { return err; }
+  }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  if ((err = fmm_push(tp, fmm_upward_top_task, &arg))) { return err; }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  for (arg.task = 0; arg.task < BH_BUILD_CELLS; ++arg.task) {
+    if ((err = fmm_push(tp, fmm_downward_task, &arg))) { return err; }
+  }
+  if ((err = threadpool_push_barrier(tp))) { return err; }
+
+  for (arg.task = 0; arg.task < arg.num_tasks; ++arg.task) {
+    if ((err = fmm_push(tp, fmm_scatter_task, &arg))) { return err; }
+  }
+
+  return CT_SUCCESS;
+}
@@ -0,0 +1,63 @@
+#ifndef __FMM_H__
+#define __FMM_H__
+
+#include <stddef.h>
+
+#include "arena.h"
+#include "bhtree.h"
+#include "error.h"
+#include "threadpool.h"
+
+// Fast multipole method on the flattened octree of a bh_tree.
+//
+// Every node gets a multipole expansion of its bodies about its centre of
+// mass, built bottom-up (P2M, M2M). A dual-tree traversal then pairs target
+// and source nodes: well-separated pairs translate the source multipole into
+// a local expansion of the target (M2L), and otherwise the larger node is
+// split. Once the target is a small group of bodies, it walks the source
+// subtree alone and sums the sources that are not well separated directly
+// (P2P). Local expansions are finally passed down (L2L) and evaluated at the
+// bodies (L2P).
+// The cost is O(N) for a fixed order and opening angle.
+//
+// Expansions are Cartesian Taylor series in x, y, z up to total degree
+// FMM_ORDER, which may be set at compile time.
+
+#ifndef FMM_ORDER
+#define FMM_ORDER 4
+#endif
+
+// Number of coefficients of an expansion
+#define FMM_TERMS ((FMM_ORDER + 1) * (FMM_ORDER + 2) * (FMM_ORDER + 3) / 6)
+
+// Default opening angle. A pair of nodes is well separated if the sum of
+// their extents is below theta times the distance between their centres.
+#define FMM_THETA 0.7
+
+struct fmm {
+  double theta;          // Opening angle of the acceptance criterion
+  struct arena scratch;  // Per-solve storage, reset by each solve
+  struct bh_tree *tree;  // Tree of the solve in progress
+  double *multipole;     // FMM_TERMS coefficients per node
+  double *local;         // Likewise
+  double *ax, *ay, *az;  // Accelerations of tree->bodies
+  int err;               // Non-zero if the last solve failed
+};
+
+enum ct_err fmm_init(struct fmm *fmm, double theta);
+
+void fmm_destroy(struct fmm *fmm);
+
+// Push tasks onto tp that compute the accelerations of the bodies of tree
+// into fmm->ax, fmm->ay, fmm->az, and those of the points of the tree's last
+// bh_tree_push_build_morton() into ax[i], ay[i], az[i] (overwritten). Points
+// merged into one body get the acceleration of the body.
+//
+// The build must be pushed first, followed by a barrier. The tasks are
+// separated by barriers, and the caller must push a barrier before using the
+// result. fmm->err reports failure once they have completed.
+enum ct_err fmm_push_solve(struct fmm *fmm, struct bh_tree *tree,
+                           struct threadpool *tp, double *ax, double *ay,
+                           double *az, size_t num_tasks);
+
+#endif // __FMM_H__
@@ -0,0 +1,157 @@
+#include "hugemem.h"
+#include "error.h"
+#include "threadpool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Argument to a first-touch task is semi-open range [begin, end), repeated
+// count times, stride bytes apart
+struct hugemem_touch_arg {
+  char *begin, *end;
+  size_t stride, count;
+};
+
+size_t hugemem_round_up_(size_t size);
+void hugemem_touch_task_(void *arg);
+
+void *hugemem_alloc(size_t size, unsigned flags)
+{
+  char *p;
+
+  size = hugemem_round_up_(size);
+
+#ifdef MAP_HUGETLB
+  if (flags & HUGEMEM_EXPLICIT) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) { return p; }
+  }
+#endif
+
+  // Over-allocate by one huge page, and trim the excess on either side, to
+  // get a mapping aligned to a huge page boundary.
+  p = mmap(NULL, size + HUGEMEM_PAGE_SIZE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) { return NULL; }
+
+  size_t lead = (HUGEMEM_PAGE_SIZE - (uintptr_t)p % HUGEMEM_PAGE_SIZE) %
+                HUGEMEM_PAGE_SIZE;
+  if (lead != 0) { munmap(p, lead); }
+  munmap(p + lead + size, HUGEMEM_PAGE_SIZE - lead);
+  p += lead;
+
+#ifdef MADV_HUGEPAGE
+  // Advisory only: without transparent huge page support we still get a
+  // usable (if 4 KiB backed) buffer.
+  madvise(p, size, MADV_HUGEPAGE);
+#endif
+
+  return p;
+}
+
+void hugemem_free(void *p, size_t size)
+{
+  if (p != NULL) { munmap(p, hugemem_round_up_(size)); }
+}
+
+enum ct_err hugemem_first_touch(struct threadpool *tp, void *p, size_t size,
+                                size_t num_tasks)
+{
+  int err;
+  char *begin = p, *end = begin + size;
+
+  if (num_tasks == 0) { num_tasks = 1; }
+
+  size_t step = hugemem_round_up_((size + num_tasks - 1) / num_tasks);
+
+  for (char *cur = begin; cur < end; cur += step) {
+    err = threadpool_push_task(
+        tp, (struct task){.func = hugemem_touch_task_,
+                          .arg =
+                              &(struct hugemem_touch_arg){
+                                  .begin = cur,
+                                  .end = (step < (size_t)(end - cur))
+                                             ? cur + step
+                                             : end,
+                                  .stride = 0,
+                                  .count = 1},
+                          .arg_size = sizeof(struct hugemem_touch_arg)});
+    if (err) { return err; }
+  }
+
+  threadpool_run(tp);
+  threadpool_wait(tp);
+
+  return CT_SUCCESS;
+}
+
+enum ct_err hugemem_first_touch_columns(struct threadpool *tp, void *p,
+                                        size_t column_size, size_t num_columns,
+                                        size_t num_tasks)
+{
+  int err;
+  char *begin = p;
+
+  if (num_tasks == 0) { num_tasks = 1; }
+
+  size_t step = (column_size + num_tasks - 1) / num_tasks;
+
+  for (size_t offset = 0; offset < column_size; offset += step) {
+    err = threadpool_push_task(
+        tp, (struct task){.func = hugemem_touch_task_,
+                          .arg =
+                              &(struct hugemem_touch_arg){
+                                  .begin = begin + offset,
+                                  .end = (step < column_size - offset)
+                                             ? begin + offset + step
+                                             : begin + column_size,
+                                  .stride = column_size,
+                                  .count = num_columns},
+                          .arg_size = sizeof(struct hugemem_touch_arg)});
+    if (err) { return err; }
+  }
+
+  threadpool_run(tp);
+  threadpool_wait(tp);
+
+  return CT_SUCCESS;
+}
+
+/**
+ * \brief Round a size up to a whole number of huge pages.
+ * \private
+ *
+ * \param size Size, in bytes.
+ * \return Rounded size, in bytes.
+ */
+size_t hugemem_round_up_(size_t size)
+{
+  return (size + HUGEMEM_PAGE_SIZE - 1) & ~(HUGEMEM_PAGE_SIZE - 1);
+}
+
+/**
+ * \brief Task to fault in a range of memory by writing to each page.
+ * \private
+ *
+ * \param arg Pointer to struct hugemem_touch_arg, casted to void *
+ */
+void hugemem_touch_task_(void *arg)
+{
+  struct hugemem_touch_arg *range = arg;
+  size_t page_size = sysconf(_SC_PAGESIZE);
+
+  for (size_t k = 0; k < range->count; ++k) {
+    char *begin = range->begin + k * range->stride;
+    char *end = range->end + k * range->stride;
+
+    // Write each page that overlaps the range back to itself, to fault it in
+    // without changing it. Ranges need not start on a page boundary.
+    begin -= (uintptr_t)begin % page_size;
+    for (volatile char *cur = begin; cur < end; cur += page_size) {
+      *cur = *cur;
+    }
+  }
+}
@@ -0,0 +1,96 @@
+/**
+ * \file hugemem.h
+ * \brief Huge-page backed allocation of large buffers, with parallel
+ * first-touch on a threadpool.
+ *
+ * Large arrays allocated with malloc() are backed by 4 KiB pages, costing TLB
+ * misses on every sweep, and their pages are placed on the NUMA node of
+ * whichever thread initializes them. hugemem_alloc() maps buffers aligned to
+ * huge page boundaries and asks the kernel to back them with huge pages.
+ * hugemem_first_touch() then faults the buffer in from the threadpool, so
+ * that pages land near the workers that will process them.
+ * hugemem_first_touch_columns() does the same for a buffer carved into
+ * columns that are each split between tasks.
+ */
+
+#ifndef HUGEMEM_H
+#define HUGEMEM_H
+
+#include <stddef.h>
+
+#include "error.h"
+#include "threadpool.h"
+
+/** Size of a huge page, in bytes. Buffers are aligned and sized to this. */
+#define HUGEMEM_PAGE_SIZE (2ul << 20)
+
+/**
+ * \brief Flag for hugemem_alloc(): request explicit huge pages from the
+ * hugetlbfs pool (MAP_HUGETLB), rather than transparent huge pages. Falls back
+ * to transparent huge pages if the pool is exhausted or unavailable.
+ */
+#define HUGEMEM_EXPLICIT 0x1
+
+/**
+ * \brief Allocate a zero-filled, huge page aligned buffer.
+ *
+ * \param size Size of the buffer, in bytes.
+ * \param flags Bitwise OR of HUGEMEM_* flags, or 0.
+ * \return Pointer to the buffer, or NULL if error.
+ */
+void *hugemem_alloc(size_t size, unsigned flags);
+
+/**
+ * \brief Free a buffer allocated with hugemem_alloc().
+ *
+ * \param p Pointer to the buffer, or NULL.
+ * \param size Size of the buffer, as passed to hugemem_alloc().
+ */
+void hugemem_free(void *p, size_t size);
+
+/**
+ * \brief Fault in the pages of a buffer in parallel on a threadpool.
+ *
+ * The buffer is split into num_tasks equal ranges, rounded to huge page
+ * boundaries, and each range is touched by one task. Split the buffer the
+ * same way as the computation that later processes it, so that each range is
+ * placed on a NUMA node near a worker. The threadpool assigns tasks to
+ * workers dynamically, so this placement is a best effort.
+ *
+ * This function runs the threadpool and blocks until it is drained, so it
+ * must not be called from within a task.
+ *
+ * \param tp The thread pool.
+ * \param p Pointer to the buffer.
+ * \param size Size of the buffer, in bytes.
+ * \param num_tasks Number of ranges to split the buffer into.
+ * \return 0 on success, non-zero on failure.
+ */
+enum ct_err hugemem_first_touch(struct threadpool *tp, void *p, size_t size,
+                                size_t num_tasks);
+
+/**
+ * \brief Fault in the pages of a buffer of columns in parallel on a
+ * threadpool.
+ *
+ * The buffer holds num_columns columns of column_size bytes each, back to
+ * back. Each column is split into num_tasks equal slices, and task k touches
+ * slice k of every column, like a computation whose task k processes range k
+ * of the elements of every column. A page shared by two slices, or backed by
+ * a huge page spanning many, is placed by whichever task touches it first.
+ *
+ * This function runs the threadpool and blocks until it is drained, so it
+ * must not be called from within a task.
+ *
+ * \param tp The thread pool.
+ * \param p Pointer to the buffer.
+ * \param column_size Size of a column, in bytes.
+ * \param num_columns Number of columns.
+ * \param num_tasks Number of slices to split each column into.
+ * \return 0 on success, non-zero on failure.
+ */
+enum ct_err hugemem_first_touch_columns(struct threadpool *tp, void *p,
+                                        size_t column_size, size_t num_columns,
+                                        size_t num_tasks);
+
+#endif // HUGEMEM_H
@@ -4,165 +4,617 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "config.h"
 
 #include "bhtree.h"
+#include "direct.h"
+#include "fmm.h"
+#include "hugemem.h"
 #include "pool.h"
 #include "threadpool.h"
 
 // N-Body Simulation Example
-// Uses naive O(N^2) approach to the N-body problem
+// Uses a Barnes-Hut tree, or the direct O(N^2) sum for small problems.
+// Run as "nbody fmm" to use the fast multipole method on the same tree, and
+// as "nbody hermite" to integrate with the fourth order Hermite scheme.
 
 #define NUMTHREADS 32
 
 #define POOLSIZE 1000
+
+// Number of bodies, which may be set at compile time, for example at most
+// DIRECTBODIES to run the direct sum
+#ifndef NUMBODIES
 #define NUMBODIES 100000
+#endif
+
 #define SIM_DT 0.001
-#define MINDIST 1e-3L
-
-struct body {
-  double mass;
-  double x, y, z;
-  double vx, vy, vz;
-  double ax, ay, az;
-  double axnew, aynew, aznew;
+#define MINDIST 1e-3
+
+// Problems up to this size are solved by direct summation, which is exact
+// and, at this size, cheaper than building and walking a tree.
+#define DIRECTBODIES 2000
+
+// Simulation state, stored as one column per quantity so that each phase
+// only streams the quantities it uses, and can be vectorized.
+struct bodies {
+  double *mass;
+  double *x, *y, *z;
+  double *vx, *vy, *vz;
+  double *ax, *ay, *az;
+  double *cost; // Interactions of each body in the last tree walk
+  double *dt;   // Block timestep of each body
+  double *jx, *jy, *jz; // Jerks, for the Hermite integrator
+  // Hermite integrator: positions, velocities, accelerations and jerks at
+  // the start of each body's timestep
+  double *sx, *sy, *sz, *svx, *svy, *svz, *sax, *say, *saz, *sjx, *sjy, *sjz;
 };
 
-struct body bodies[NUMBODIES];
+#define NUMCOLUMNS 27
+
+// The first this many columns of the fixed order are those that the force
+// passes write: accelerations, the costs of the tree walks, and jerks
+#define NUMFORCECOLUMNS 7
+
+// Pointers to the columns of b, in a fixed order
+void bodies_columns(struct bodies *b, double **columns[NUMCOLUMNS])
+{
+  double **all[NUMCOLUMNS] = {
+      &b->ax,   &b->ay,  &b->az,  &b->cost, &b->jx,  &b->jy,  &b->jz,
+      &b->mass, &b->x,   &b->y,   &b->z,    &b->vx,  &b->vy,  &b->vz,
+      &b->dt,   &b->sx,  &b->sy,  &b->sz,   &b->svx, &b->svy, &b->svz,
+      &b->sax,  &b->say, &b->saz, &b->sjx,  &b->sjy, &b->sjz};
+
+  for (size_t k = 0; k < NUMCOLUMNS; ++k) {
+    columns[k] = all[k];
+  }
+}
+
+// Columns are padded to a whole number of cache lines, so that every column
+// is aligned like the buffer they are carved from.
+#define COLUMNLEN ((NUMBODIES + 7) & ~(size_t)7)
+
+struct bodies bodies;
+
+// Bodies are periodically permuted into the Morton order of the tree, so
+// that bodies close in space are close in memory, and the tree walks of a
+// zone touch few cache lines. Every this many steps; 0 never.
+#define REORDERSTEPS 4
+
+// Columns the bodies are permuted into, which then trade places with them
+struct bodies spare;
+
+// Original index of the body at each position, and the position of each
+// original index, so that bodies stay addressable across permutations
+size_t *body_id, *spare_id, *body_pos;
 
 struct threadpool t_pool;
 
 struct bh_tree tree;
 
+struct fmm fmm;
+
+// Non-zero if forces are computed by the fast multipole method
+int use_fmm;
+
+// Whether the tree walk evaluates point masses in single precision, see
+// struct bh_opening. Its error against double precision is reported on this
+// many bodies, in runs of consecutive Morton order.
+int use_single;
+#define PRECISIONSAMPLE 4096
+#define PRECISIONRUN 64
+
+// Bodies are advanced by kick-drift-kick leapfrog. The closing half kick of a
+// step and the opening half kick of the next are one full kick, fused with
+// the drift into a single pass over the bodies. Velocities are then half a
+// step ahead of positions, except at the start and the end of a run, where
+// the kicks are halves.
+//
+// With use_blocks, each body has a block timestep SIM_DT / 2^k, k up to
+// MAXRUNG, the largest below sqrt(2 ETA MINDIST / |a|). A step of SIM_DT is
+// then taken in num_ticks ticks. Every tick drifts all bodies, which predicts
+// the positions of those in mid-step, and only the bodies whose timesteps end
+// at the next tick have their forces computed and are kicked. Their new
+// timestep is chosen then, and may only grow to one that the tick is a whole
+// multiple of.
+//
+// Rungs save force evaluations, but each tick pays for a tree build or refit
+// and a pass over all bodies, and on the default uniform bodies an optimized
+// run took a quarter longer with them than with single ticks. The FMM and
+// the direct sum without jerks compute the forces of all bodies whenever any
+// are due, so they gain nothing from rungs, and always take a single tick
+// per step.
+int use_blocks;
+#define MAXRUNG 3
+#define ETA 0.025
+
+// Ticks per step, and their length
+size_t num_ticks = 1;
+double tick_dt = SIM_DT;
+
+// Bodies may instead be advanced by the fourth order Hermite scheme, which
+// always takes block timesteps. Every tick predicts the positions and
+// velocities of all bodies by Taylor series from the start of their
+// timesteps. Bodies whose timesteps end at the tick get accelerations and
+// jerks at the predicted state, which the corrector combines with those at
+// the start. Their timesteps are then the largest below HERMITE_ETA |a| / |j|.
+int use_hermite;
+#define HERMITE_ETA 0.02
+
+// A body starting a timestep is kicked by close_kick times its last timestep
+// and open_kick times its new one. Passes drift by drift_dt.
+double close_kick = 0.0, open_kick = 0.5, drift_dt;
+
+// Tick of the pass in progress, and that of the forces being computed
+size_t tick, force_tick;
+
+// Bodies whose timesteps end at force_tick, in index order
+size_t *active;
+size_t num_active;
+
+// Forces computed over the current step
+size_t num_evaluations;
+
 // Argument to an nbody task is semi-open range [begin, end)
 struct nbody_task_arg {
   size_t begin, end;
 };
 
+// Tree walks are split into this many zones per worker. Zones are ranges of
+// the tree's Morton order of roughly equal cost, so walks are balanced, and
+// several per worker leave slack for the cost estimates to be off.
+#define ZONESPERTHREAD 4
+
+// Zone k is positions [zone_start[k], zone_start[k + 1]) of the Morton order
+size_t *zone_start;
+size_t num_zones;
+
 double rand_double(double min, double max)
 {
   return min + (max - min) * ((double)rand() / (double)RAND_MAX);
 }
 
+// Bounding box of the bodies, as one interval that all three coordinates lie
+// in. Each pass that moves the bodies reduces the bounds of its range of
+// positions into it as it writes them, so that building a tree needs no pass
+// of its own. bb_reset() must precede the pass.
+double bb_min, bb_max;
+pthread_mutex_t bb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void bb_reset()
+{
+  bb_min = INFINITY;
+  bb_max = -INFINITY;
+}
+
+// Merge the bounds of a range of positions into the bounding box
+void bb_merge(double min, double max)
+{
+  pthread_mutex_lock(&bb_lock);
+  if (min < bb_min) { bb_min = min; }
+  if (max > bb_max) { bb_max = max; }
+  pthread_mutex_unlock(&bb_lock);
+}
+
+// Merge the coordinates of bodies [begin, end) into the bounds *min, *max.
+// Compilers do not vectorize min and max reductions of doubles without
+// relaxing NaN semantics, so SSE2 is used directly where available.
+void bb_bound(size_t begin, size_t end, double *min, double *max)
+{
+  double const *x = bodies.x, *y = bodies.y, *z = bodies.z;
+  size_t i = begin;
+
+#ifdef __SSE2__
+  __m128d lo = _mm_set1_pd(*min), hi = _mm_set1_pd(*max);
+  for (; i + 2 <= end; i += 2) {
+    __m128d px = _mm_loadu_pd(&x[i]), py = _mm_loadu_pd(&y[i]),
+            pz = _mm_loadu_pd(&z[i]);
+    lo = _mm_min_pd(lo, _mm_min_pd(px, _mm_min_pd(py, pz)));
+    hi = _mm_max_pd(hi, _mm_max_pd(px, _mm_max_pd(py, pz)));
+  }
+  *min = _mm_cvtsd_f64(_mm_min_sd(lo, _mm_unpackhi_pd(lo, lo)));
+  *max = _mm_cvtsd_f64(_mm_max_sd(hi, _mm_unpackhi_pd(hi, hi)));
+#endif
+
+  for (; i < end; ++i) {
+    *min = fmin(*min, fmin(x[i], fmin(y[i], z[i])));
+    *max = fmax(*max, fmax(x[i], fmax(y[i], z[i])));
+  }
+}
+
 void init_bodies()
 {
+  double min = INFINITY, max = -INFINITY;
+
   // srand(time(NULL));
 
   for (size_t i = 0; i < NUMBODIES; ++i) {
-    bodies[i].mass = rand_double(1.0, 10.0);
-    bodies[i].x = rand_double(-100.0, 100.0);
-    bodies[i].y = rand_double(-100.0, 100.0);
-    bodies[i].z = rand_double(-100.0, 100.0);
-    bodies[i].vx = bodies[i].vy = bodies[i].vz = 0.0;
-    bodies[i].ax = bodies[i].ay = bodies[i].az = 0.0;
-    bodies[i].axnew = bodies[i].aynew = bodies[i].aznew = 0.0;
+    bodies.mass[i] = rand_double(1.0, 10.0);
+    bodies.x[i] = rand_double(-100.0, 100.0);
+    bodies.y[i] = rand_double(-100.0, 100.0);
+    bodies.z[i] = rand_double(-100.0, 100.0);
+    bodies.vx[i] = bodies.vy[i] = bodies.vz[i] = 0.0;
+    bodies.ax[i] = bodies.ay[i] = bodies.az[i] = 0.0;
+    bodies.cost[i] = 0.0;
+    bodies.dt[i] = SIM_DT;
+    bodies.jx[i] = bodies.jy[i] = bodies.jz[i] = 0.0;
   }
+  bb_bound(0, NUMBODIES, &min, &max);
+  bb_reset();
+  bb_merge(min, max);
 }
 
+#define NUMACCELTASKS 200
+#define NUMADVTASKS 3
+
 void init()
 {
+  threadpool_init(&t_pool, NUMTHREADS);
+
+  double **columns[2 * NUMCOLUMNS];
+  size_t num_columns = 2 * NUMCOLUMNS;
+  size_t size = num_columns * COLUMNLEN * sizeof(double);
+  double *storage;
+
+  bodies_columns(&bodies, columns);
+  bodies_columns(&spare, columns + NUMCOLUMNS);
+
+  if ((storage = hugemem_alloc(size, 0)) == NULL) {
+    printf("Could not allocate bodies!\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t k = 0; k < num_columns; ++k) {
+    *columns[k] = storage + k * COLUMNLEN;
+  }
+
+  num_zones = threadpool_num_threads(&t_pool) * ZONESPERTHREAD;
+  if ((zone_start = malloc((num_zones + 1) * sizeof(size_t))) == NULL) {
+    printf("Could not allocate zones!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Fault in each column from the workers, in slices like those of the
+  // passes over it, so that its pages land near them. The force passes take
+  // cost zones of the Morton order, which are only known once the tree is
+  // walked; reordering keeps them close to index order, so their columns
+  // are split into as many equal slices, the zones of uniform cost. The
+  // spare columns trade places with the others, and are split alike.
+  for (size_t s = 0; s < 2; ++s) {
+    double *force = storage + s * NUMCOLUMNS * COLUMNLEN;
+    double *other = force + NUMFORCECOLUMNS * COLUMNLEN;
+
+    hugemem_first_touch_columns(&t_pool, force, COLUMNLEN * sizeof(double),
+                                NUMFORCECOLUMNS, num_zones);
+    hugemem_first_touch_columns(&t_pool, other, COLUMNLEN * sizeof(double),
+                                NUMCOLUMNS - NUMFORCECOLUMNS, NUMADVTASKS);
+  }
+
+  body_id = malloc(NUMBODIES * sizeof(size_t));
+  spare_id = malloc(NUMBODIES * sizeof(size_t));
+  body_pos = malloc(NUMBODIES * sizeof(size_t));
+  active = malloc(NUMBODIES * sizeof(size_t));
+  if (body_id == NULL || spare_id == NULL || body_pos == NULL ||
+      active == NULL) {
+    printf("Could not allocate body IDs!\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < NUMBODIES; ++i) {
+    body_id[i] = body_pos[i] = i;
+  }
+
   init_bodies();
+  // An octree over N scattered bodies has roughly N leaves and N/2 internal
+  // nodes. The node pool grows if this estimate falls short.
+  bh_tree_init(&tree, 2 * NUMBODIES);
+  // Quadrupoles allow a wider opening angle at the same accuracy
+  tree.opening.quadrupole = 1;
+  tree.opening.theta = 0.6;
+  tree.opening.single_precision = use_single;
+  if (fmm_init(&fmm, FMM_THETA) != CT_SUCCESS) {
+    printf("Could not initialize FMM!\n");
+    exit(EXIT_FAILURE);
+  }
+}
 
-  threadpool_init(&t_pool, NUMTHREADS);
-  bh_tree_init(&tree, 10 * NUMBODIES);
+void build_tree(void *arg)
+{
+  bh_tree_set_bb(&tree, (struct bh_vec3){bb_min, bb_min, bb_min},
+                 (struct bh_vec3){bb_max, bb_max, bb_max});
+}
+
+// Velocities of the bodies, in the form bh_tree_push_velocities() takes
+struct bh_points nbody_velocities()
+{
+  return (struct bh_points){.x = bodies.vx,
+                            .y = bodies.vy,
+                            .z = bodies.vz,
+                            .mass = bodies.mass,
+                            .stride = 1,
+                            .count = NUMBODIES};
+}
+
+struct bh_points nbody_points()
+{
+  return (struct bh_points){.x = bodies.x,
+                            .y = bodies.y,
+                            .z = bodies.z,
+                            .mass = bodies.mass,
+                            .stride = 1,
+                            .count = NUMBODIES};
+}
+
+// Push tasks computing all accelerations by the symmetric direct sum, which
+// visits each pair of bodies once.
+void nbody_push_accel_direct()
+{
+  struct direct_bodies all = {.x = bodies.x,
+                              .y = bodies.y,
+                              .z = bodies.z,
+                              .mass = bodies.mass,
+                              .count = NUMBODIES};
+
+  direct_push_symmetric(&t_pool, &all, bodies.ax, bodies.ay, bodies.az,
+                        MINDIST, 2 * NUMTHREADS);
 }
 
-void bb_update()
+// Number of ticks in the timestep of body i
+static inline size_t nbody_ticks(size_t i)
 {
-  double min_coord = bodies[0].x, max_coord = bodies[0].x;
+  return (size_t)(bodies.dt[i] / tick_dt + 0.5);
+}
+
+// List the bodies whose timesteps end at force_tick
+void nbody_select_active()
+{
+  num_active = 0;
   for (size_t i = 0; i < NUMBODIES; ++i) {
-    double min_i = fmin(bodies[i].x, fmin(bodies[i].y, bodies[i].z));
-    double max_i = fmax(bodies[i].x, fmax(bodies[i].y, bodies[i].z));
-    if (min_i < min_coord) min_coord = min_i;
-    if (max_i > max_coord) max_coord = max_i;
+    if (force_tick % nbody_ticks(i) == 0) { active[num_active++] = i; }
   }
-  bh_tree_set_bb(&tree, (struct bh_vec3){min_coord, min_coord, min_coord},
-                 (struct bh_vec3){max_coord, max_coord, max_coord});
 }
 
-void build_tree(void *arg)
+// Cut the active bodies into zones of equal cost, as measured by the last
+// walk. Before the first walk no body has a cost, and each counts one
+// instead. If all bodies are active, they are taken in the tree's Morton
+// order, and otherwise in index order, which the periodic reordering keeps
+// close to it.
+void nbody_costzones(void *arg)
 {
+  size_t const *order =
+      (num_active == NUMBODIES) ? tree.morton.sort.vals : active;
+  double const *cost = bodies.cost;
+  double total = 0.0, prefix = 0.0, unit = 0.0;
+  size_t s = 0;
+
+  for (size_t k = 0; k < num_active; ++k) {
+    total += cost[order[k]];
+  }
+  if (total == 0.0) {
+    unit = 1.0;
+    total = num_active;
+  }
 
-  bh_tree_clear(&tree);
-  bb_update();
-  for (size_t i = 0; i < NUMBODIES; ++i) {
-    struct bh_vec3 p = {bodies[i].x, bodies[i].y, bodies[i].z};
-    if (bh_tree_insert(&tree, p, bodies[i].mass) != 0) {
-      printf("ERROR ON INSERT\n");
-      exit(EXIT_FAILURE);
+  zone_start[0] = 0;
+  for (size_t k = 1; k < num_zones; ++k) {
+    while (s < num_active && prefix < total * k / num_zones) {
+      prefix += cost[order[s++]] + unit;
     }
+    zone_start[k] = s;
   }
+  zone_start[num_zones] = num_active;
 }
 
-void nbody_compute_accel(void *arg)
+// Compute the accelerations of the active bodies in a range of zones, so
+// that each task walks the tree for groups of nearby bodies.
+void nbody_compute_accel_bh(void *arg)
+{
+  struct nbody_task_arg *zones = (struct nbody_task_arg *)arg;
+  struct bh_points points = nbody_points(), velocities = nbody_velocities();
+  size_t begin = zone_start[zones->begin], end = zone_start[zones->end];
+
+  if (use_hermite && num_active == NUMBODIES) {
+    bh_tree_solve_morton_jerk(&tree, &points, &velocities, begin, end,
+                              bodies.ax, bodies.ay, bodies.az, bodies.jx,
+                              bodies.jy, bodies.jz, bodies.cost);
+  }
+  else if (use_hermite) {
+    bh_tree_solve_group_jerk(&tree, &points, &velocities, active + begin,
+                             end - begin, bodies.ax, bodies.ay, bodies.az,
+                             bodies.jx, bodies.jy, bodies.jz, bodies.cost);
+  }
+  else if (num_active == NUMBODIES) {
+    bh_tree_solve_morton(&tree, &points, begin, end, bodies.ax, bodies.ay,
+                         bodies.az, bodies.cost);
+  }
+  else {
+    bh_tree_solve_group(&tree, &points, active + begin, end - begin,
+                        bodies.ax, bodies.ay, bodies.az, bodies.cost);
+  }
+}
+
+// Compute the accelerations and jerks of the active bodies of a range by
+// direct summation
+void nbody_compute_jerk_direct(void *arg)
 {
-  double dx, dy, dz, temp;
   struct nbody_task_arg *range = (struct nbody_task_arg *)arg;
+  struct direct_bodies all = {.x = bodies.x,
+                              .y = bodies.y,
+                              .z = bodies.z,
+                              .mass = bodies.mass,
+                              .vx = bodies.vx,
+                              .vy = bodies.vy,
+                              .vz = bodies.vz,
+                              .count = NUMBODIES};
 
   for (size_t i = range->begin; i != range->end; ++i) {
-    for (size_t j = 0; j < NUMBODIES; ++j) {
-      if (i == j) { continue; }
-      dx = bodies[j].x - bodies[i].x;
-      dy = bodies[j].y - bodies[i].y;
-      dz = bodies[j].z - bodies[i].z;
-
-      temp = sqrt(dx * dx + dy * dy + dz * dz);
-      if (temp < MINDIST) { temp = MINDIST; }
-      temp = temp * temp * temp;
-      temp = bodies[j].mass / temp;
-
-      bodies[i].axnew += temp * dx;
-      bodies[i].aynew += temp * dy;
-      bodies[i].aznew += temp * dz;
-    }
+    if (force_tick % nbody_ticks(i) != 0) { continue; }
+    bodies.ax[i] = bodies.ay[i] = bodies.az[i] = 0.0;
+    bodies.jx[i] = bodies.jy[i] = bodies.jz[i] = 0.0;
+    direct_jerk_add(&all, i, i + 1, &all, bodies.ax, bodies.ay, bodies.az,
+                    bodies.jx, bodies.jy, bodies.jz, MINDIST);
   }
 }
 
-void nbody_compute_accel_bh(void *arg)
+// Largest block timestep no longer than limit that starts at tick
+double nbody_timestep(double limit, size_t tick)
+{
+  double dt = SIM_DT;
+  size_t ticks = num_ticks;
+
+  while (ticks > 1 && (tick % ticks != 0 || dt > limit)) {
+    dt *= 0.5;
+    ticks /= 2;
+  }
+  return dt;
+}
+
+// Bodies are moved in blocks of this many, so that passes over a block after
+// the first, such as the bounding box reduction, read it from L1.
+#define MOVEBLOCK 256
+
+// Kick the velocities of the bodies of a range that start a timestep at this
+// tick by their accelerations, then drift the positions of all of them by
+// their velocities, reducing the bounding box of the positions
+void nbody_kick_drift(void *arg)
 {
   struct nbody_task_arg *range = (struct nbody_task_arg *)arg;
-  struct bh_vec3 acc_i;
-  struct bh_vec3 p_i;
-  for (size_t i = range->begin; i != range->end; ++i) {
-    p_i = (struct bh_vec3){bodies[i].x, bodies[i].y, bodies[i].z};
-    bh_tree_solve_acc(&tree, &p_i, &acc_i);
-    bodies[i].axnew = acc_i.x;
-    bodies[i].aynew = acc_i.y;
-    bodies[i].aznew = acc_i.z;
+  double *restrict x = bodies.x, *restrict y = bodies.y, *restrict z = bodies.z;
+  double *restrict vx = bodies.vx, *restrict vy = bodies.vy,
+                   *restrict vz = bodies.vz;
+  double const *restrict ax = bodies.ax, *restrict ay = bodies.ay,
+                         *restrict az = bodies.az;
+  double *restrict dt = bodies.dt;
+  double const drift = drift_dt;
+  double min = INFINITY, max = -INFINITY;
+
+  for (size_t block = range->begin; block < range->end; block += MOVEBLOCK) {
+    size_t end =
+        (block + MOVEBLOCK < range->end) ? block + MOVEBLOCK : range->end;
+
+    for (size_t i = block; i != end; ++i) {
+      if (tick % nbody_ticks(i) != 0) { continue; }
+      double kick = close_kick * dt[i];
+      double amag = sqrt(ax[i] * ax[i] + ay[i] * ay[i] + az[i] * az[i]);
+      dt[i] = nbody_timestep(sqrt(2.0 * ETA * MINDIST / amag), tick);
+      kick += open_kick * dt[i];
+      vx[i] += kick * ax[i];
+      vy[i] += kick * ay[i];
+      vz[i] += kick * az[i];
+    }
+
+    for (size_t i = block; i != end; ++i) {
+      x[i] += drift * vx[i];
+      y[i] += drift * vy[i];
+      z[i] += drift * vz[i];
+    }
+    bb_bound(block, end, &min, &max);
   }
+  bb_merge(min, max);
 }
 
-void nbody_update_pos(void *arg)
+// Start the Hermite timestep of body i at tick from its current state
+static inline void nbody_hermite_start(size_t i, size_t tick)
+{
+  struct bodies *b = &bodies;
+  double amag = sqrt(b->ax[i] * b->ax[i] + b->ay[i] * b->ay[i] +
+                     b->az[i] * b->az[i]);
+  double jmag = sqrt(b->jx[i] * b->jx[i] + b->jy[i] * b->jy[i] +
+                     b->jz[i] * b->jz[i]);
+
+  b->sx[i] = b->x[i];
+  b->sy[i] = b->y[i];
+  b->sz[i] = b->z[i];
+  b->svx[i] = b->vx[i];
+  b->svy[i] = b->vy[i];
+  b->svz[i] = b->vz[i];
+  b->sax[i] = b->ax[i];
+  b->say[i] = b->ay[i];
+  b->saz[i] = b->az[i];
+  b->sjx[i] = b->jx[i];
+  b->sjy[i] = b->jy[i];
+  b->sjz[i] = b->jz[i];
+  b->dt[i] = nbody_timestep(HERMITE_ETA * amag / jmag, tick);
+}
+
+// Start the Hermite timesteps of a range of bodies at tick 0
+void nbody_hermite_init(void *arg)
 {
   struct nbody_task_arg *range = (struct nbody_task_arg *)arg;
 
   for (size_t i = range->begin; i != range->end; ++i) {
-    bodies[i].x += SIM_DT * bodies[i].vx + bodies[i].ax * SIM_DT * SIM_DT / 2.0;
-    bodies[i].y += SIM_DT * bodies[i].vy + bodies[i].ay * SIM_DT * SIM_DT / 2.0;
-    bodies[i].z += SIM_DT * bodies[i].vz + bodies[i].az * SIM_DT * SIM_DT / 2.0;
+    nbody_hermite_start(i, 0);
+  }
+}
+
+// Predict the positions and velocities of a range of bodies at tick + 1,
+// reducing the bounding box of the positions
+void nbody_hermite_predict(void *arg)
+{
+  struct nbody_task_arg *range = (struct nbody_task_arg *)arg;
+  struct bodies *b = &bodies;
+  double min = INFINITY, max = -INFINITY;
+
+  for (size_t block = range->begin; block < range->end; block += MOVEBLOCK) {
+    size_t end =
+        (block + MOVEBLOCK < range->end) ? block + MOVEBLOCK : range->end;
+
+    for (size_t i = block; i != end; ++i) {
+      // Time since the start of the body's timestep, which started at the
+      // last multiple of its ticks before tick + 1
+      double t = (double)(tick % nbody_ticks(i) + 1) * tick_dt;
+      double t2 = t * t / 2.0, t3 = t * t * t / 6.0;
+
+      b->x[i] = b->sx[i] + t * b->svx[i] + t2 * b->sax[i] + t3 * b->sjx[i];
+      b->y[i] = b->sy[i] + t * b->svy[i] + t2 * b->say[i] + t3 * b->sjy[i];
+      b->z[i] = b->sz[i] + t * b->svz[i] + t2 * b->saz[i] + t3 * b->sjz[i];
+      b->vx[i] = b->svx[i] + t * b->sax[i] + t2 * b->sjx[i];
+      b->vy[i] = b->svy[i] + t * b->say[i] + t2 * b->sjy[i];
+      b->vz[i] = b->svz[i] + t * b->saz[i] + t2 * b->sjz[i];
+    }
+    bb_bound(block, end, &min, &max);
   }
+  bb_merge(min, max);
 }
 
-void nbody_update_vel(void *arg)
+// Correct the bodies of a range whose timesteps end at force_tick, from the
+// accelerations and jerks at the start and the end, and start their next
+// timesteps
+void nbody_hermite_correct(void *arg)
 {
   struct nbody_task_arg *range = (struct nbody_task_arg *)arg;
+  struct bodies *b = &bodies;
 
   for (size_t i = range->begin; i != range->end; ++i) {
-    bodies[i].vx += SIM_DT * (bodies[i].ax + bodies[i].axnew) / 2.0;
-    bodies[i].vy += SIM_DT * (bodies[i].ay + bodies[i].aynew) / 2.0;
-    bodies[i].vz += SIM_DT * (bodies[i].az + bodies[i].aznew) / 2.0;
-
-    bodies[i].ax = bodies[i].axnew;
-    bodies[i].ay = bodies[i].aynew;
-    bodies[i].az = bodies[i].aznew;
+    if (force_tick % nbody_ticks(i) != 0) { continue; }
+
+    double t = b->dt[i], t2 = t * t / 12.0;
+    b->vx[i] = b->svx[i] + (b->sax[i] + b->ax[i]) * t / 2.0 +
+               (b->sjx[i] - b->jx[i]) * t2;
+    b->vy[i] = b->svy[i] + (b->say[i] + b->ay[i]) * t / 2.0 +
+               (b->sjy[i] - b->jy[i]) * t2;
+    b->vz[i] = b->svz[i] + (b->saz[i] + b->az[i]) * t / 2.0 +
+               (b->sjz[i] - b->jz[i]) * t2;
+    b->x[i] = b->sx[i] + (b->svx[i] + b->vx[i]) * t / 2.0 +
+              (b->sax[i] - b->ax[i]) * t2;
+    b->y[i] = b->sy[i] + (b->svy[i] + b->vy[i]) * t / 2.0 +
+              (b->say[i] - b->ay[i]) * t2;
+    b->z[i] = b->sz[i] + (b->svz[i] + b->vz[i]) * t / 2.0 +
+              (b->saz[i] - b->az[i]) * t2;
+
+    nbody_hermite_start(i, force_tick % num_ticks);
   }
 }
 
 void generate_tasks_from_func(size_t num_tasks, void (*task_func)(void *))
 {
   size_t bodies_per_task = NUMBODIES / num_tasks;
+  if (bodies_per_task == 0) { bodies_per_task = 1; }
   for (size_t i = 0; i < NUMBODIES; i += bodies_per_task) {
     threadpool_push_task(
         &t_pool, (struct task){.func = task_func,
@@ -176,48 +628,259 @@ void generate_tasks_from_func(size_t num_tasks, void (*task_func)(void *))
   }
 }
 
-#define NUMACCELTASKS 200
-#define NUMADVTASKS 3
+// Gather a range of positions of the tree's Morton order into the spare
+// columns, and record where each body goes
+void nbody_reorder(void *arg)
+{
+  struct nbody_task_arg *range = (struct nbody_task_arg *)arg;
+  size_t const *order = tree.morton.sort.vals;
+  double **from[NUMCOLUMNS], **to[NUMCOLUMNS];
+
+  bodies_columns(&bodies, from);
+  bodies_columns(&spare, to);
+  for (size_t k = 0; k < NUMCOLUMNS; ++k) {
+    double const *restrict src = *from[k];
+    double *restrict dst = *to[k];
+    for (size_t s = range->begin; s != range->end; ++s) {
+      dst[s] = src[order[s]];
+    }
+  }
+  for (size_t s = range->begin; s != range->end; ++s) {
+    spare_id[s] = body_id[order[s]];
+    body_pos[spare_id[s]] = s;
+  }
+}
 
-void run_iteration()
+// Permute the bodies into the Morton order of the last tree. The tree then
+// no longer matches their indices, and must be rebuilt.
+void nbody_push_reorder()
 {
-  printf("Updating positions...\n");
-  generate_tasks_from_func(NUMADVTASKS, nbody_update_pos);
-  threadpool_push_barrier(&t_pool);
+  printf("Reordering bodies...\n");
+  generate_tasks_from_func(NUMADVTASKS, nbody_reorder);
+  threadpool_run(&t_pool);
+  threadpool_wait(&t_pool);
 
-  printf("Building tree...\n");
-  threadpool_push_task(&t_pool, (struct task){.func = build_tree});
+  struct bodies columns = bodies;
+  size_t *id = body_id;
+  bodies = spare;
+  spare = columns;
+  body_id = spare_id;
+  spare_id = id;
+}
+
+// Push tasks computing the accelerations of the bodies whose timesteps end at
+// force_tick, at their current positions, into ax, ay, az. The direct sum and
+// the FMM compute those of all bodies if any are due, which leaves the others
+// to be recomputed when their own timesteps end. The tree is rebuilt if
+// rebuild is non-zero, or if it cannot be refit.
+void nbody_push_accel(int rebuild)
+{
+  nbody_select_active();
+  if (num_active == 0 && !rebuild) { return; }
+  num_evaluations += num_active;
+
+  if (NUMBODIES <= DIRECTBODIES && use_hermite) {
+    printf("Computing forces and jerks ...\n");
+    generate_tasks_from_func(NUMACCELTASKS, nbody_compute_jerk_direct);
+    return;
+  }
+  if (NUMBODIES <= DIRECTBODIES) {
+    printf("Computing forces ...\n");
+    nbody_push_accel_direct();
+    return;
+  }
+
+  // Bodies move little in a step, so the last tree is refit to their new
+  // positions until too many have left their leaf cells.
+  if (rebuild || bh_tree_needs_rebuild(&tree)) {
+    printf("Building tree...\n");
+    // The bounding box is computed alongside the first phase of the build,
+    // which does not depend on it.
+    threadpool_push_task(&t_pool, (struct task){.func = build_tree});
+    bh_tree_push_build_morton(&tree, &t_pool, nbody_points(), NUMTHREADS);
+  }
+  else {
+    printf("Refitting tree...\n");
+    bh_tree_push_refit(&tree, &t_pool, nbody_points());
+  }
   threadpool_push_barrier(&t_pool);
+  if (use_hermite) {
+    bh_tree_push_velocities(&tree, &t_pool, nbody_velocities());
+    threadpool_push_barrier(&t_pool);
+  }
 
   printf("Computing forces ...\n");
-  generate_tasks_from_func(NUMACCELTASKS, nbody_compute_accel_bh);
-  threadpool_push_barrier(&t_pool);
+  if (use_fmm) {
+    fmm_push_solve(&fmm, &tree, &t_pool, bodies.ax, bodies.ay, bodies.az,
+                   NUMTHREADS);
+  }
+  else {
+    threadpool_push_task(&t_pool, (struct task){.func = nbody_costzones});
+    threadpool_push_barrier(&t_pool);
+    for (size_t k = 0; k < num_zones; ++k) {
+      threadpool_push_task(
+          &t_pool,
+          (struct task){.func = nbody_compute_accel_bh,
+                        .arg = &(struct nbody_task_arg){.begin = k,
+                                                        .end = k + 1},
+                        .arg_size = sizeof(struct nbody_task_arg)});
+    }
+  }
+}
 
-  printf("Updating velocities...\n");
-  generate_tasks_from_func(NUMADVTASKS, nbody_update_vel);
-  threadpool_notify(&t_pool);
+// Run the tasks pushed so far, and check the force computation
+void nbody_run()
+{
+  threadpool_run(&t_pool);
   threadpool_wait(&t_pool);
+
+  if (tree.build_err != 0) {
+    printf("ERROR ON INSERT\n");
+    exit(EXIT_FAILURE);
+  }
+  if (use_fmm && fmm.err != 0) {
+    printf("ERROR IN FMM\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Print the rms relative error of the accelerations of a sample of bodies,
+// solved in single precision, against the same solve in double precision
+void nbody_report_precision()
+{
+  size_t stride = NUMBODIES / (PRECISIONSAMPLE / PRECISIONRUN);
+  double *acc = calloc(6 * NUMBODIES, sizeof(double));
+  double *ax[2] = {acc, acc + 3 * NUMBODIES};
+  double sum = 0.0;
+  size_t count = 0;
+
+  if (acc == NULL) {
+    printf("Could not allocate precision sample!\n");
+    exit(EXIT_FAILURE);
+  }
+
+  struct bh_points points = nbody_points();
+  for (size_t s = 0; s + PRECISIONRUN <= NUMBODIES; s += stride) {
+    // Runs are solved whole, so both walks group bodies alike
+    for (int p = 0; p < 2; ++p) {
+      tree.opening.single_precision = (p == 0);
+      bh_tree_solve_morton(&tree, &points, s, s + PRECISIONRUN, ax[p],
+                           ax[p] + NUMBODIES, ax[p] + 2 * NUMBODIES, NULL);
+    }
+    for (size_t k = s; k != s + PRECISIONRUN; ++k) {
+      size_t i = tree.morton.sort.vals[k];
+      double err = 0.0, norm = 0.0;
+      for (size_t c = 0; c < 3; ++c) {
+        double a = ax[1][c * NUMBODIES + i];
+        double d = ax[0][c * NUMBODIES + i] - a;
+        err += d * d;
+        norm += a * a;
+      }
+      sum += err / norm;
+      count += 1;
+    }
+  }
+  tree.opening.single_precision = 1;
+  free(acc);
+
+  printf("Single precision rms relative error: %g\n", sqrt(sum / count));
+}
+
+void run_iteration(int step)
+{
+  num_evaluations = 0;
+  for (tick = 0; tick < num_ticks; ++tick) {
+    bb_reset();
+    // Reordering forces a rebuild, so bodies are also reordered whenever the
+    // tree is to be rebuilt anyway. It needs the Morton order of a build of
+    // all bodies, which a failed build leaves empty.
+    int reorder = (tick == 0 && REORDERSTEPS != 0 &&
+                   NUMBODIES > DIRECTBODIES &&
+                   tree.morton.sort.count == NUMBODIES &&
+                   (step % REORDERSTEPS == 0 || bh_tree_needs_rebuild(&tree)));
+
+    if (use_hermite) {
+      printf("Predicting velocities and positions...\n");
+      generate_tasks_from_func(NUMADVTASKS, nbody_hermite_predict);
+    }
+    else {
+      printf("Updating velocities and positions...\n");
+      generate_tasks_from_func(NUMADVTASKS, nbody_kick_drift);
+    }
+    threadpool_run(&t_pool);
+    threadpool_wait(&t_pool);
+    close_kick = 0.5;
+
+    // Bodies are all at the start of a timestep on tick 0, and columns are
+    // swapped once the permutation has run, before any task that reads them
+    // is pushed.
+    if (reorder) {
+      nbody_push_reorder();
+    }
+
+    force_tick = tick + 1;
+    nbody_push_accel(reorder);
+    if (use_hermite) {
+      threadpool_push_barrier(&t_pool);
+      generate_tasks_from_func(NUMADVTASKS, nbody_hermite_correct);
+    }
+    nbody_run();
+  }
+  printf("Forces computed for %zu bodies in %zu ticks\n", num_evaluations,
+         num_ticks);
 }
 
 int main(int argc, char *argv[])
 {
   printf("nbody-solver version %d.%d\n", NBODY_VERSION_MAJOR,
          NBODY_VERSION_MINOR);
+  use_fmm = (argc > 1 && strcmp(argv[1], "fmm") == 0);
+  use_single = (argc > 1 && strcmp(argv[1], "single") == 0);
+  use_hermite = (argc > 1 && strcmp(argv[1], "hermite") == 0);
+  use_blocks = (argc > 1 && strcmp(argv[1], "blocks") == 0);
+  if (use_hermite || (use_blocks && NUMBODIES > DIRECTBODIES)) {
+    num_ticks = 1 << MAXRUNG;
+    tick_dt = SIM_DT / num_ticks;
+  }
+  drift_dt = tick_dt;
   init();
 
   printf("Creating threadpool ...\n");
 
-  printf("Body 0 (x,y,z) = (%f, %f, %f)\n", bodies[0].x, bodies[0].y,
-         bodies[0].z);
+  printf("Body 0 (x,y,z) = (%f, %f, %f)\n", bodies.x[0], bodies.y[0],
+         bodies.z[0]);
+
+  // The first kick needs the initial accelerations, and Hermite timesteps
+  // start from them
+  nbody_push_accel(1);
+  if (use_hermite) {
+    threadpool_push_barrier(&t_pool);
+    generate_tasks_from_func(NUMADVTASKS, nbody_hermite_init);
+  }
+  nbody_run();
+  if (use_single && NUMBODIES > DIRECTBODIES) { nbody_report_precision(); }
+
   for (int i = 0; i < 10; ++i) {
     printf("Iteration #%d\n", i);
 
-    run_iteration();
+    run_iteration(i);
 
-    printf("Body 0 (x,y,z) = (%f, %f, %f)\n", bodies[0].x, bodies[0].y,
-           bodies[0].z);
+    size_t b = body_pos[0];
+    printf("Body 0 (x,y,z) = (%f, %f, %f)\n", bodies.x[b], bodies.y[b],
+           bodies.z[b]);
   }
 
+  // Close the last step with a half kick, bringing velocities level with
+  // positions. Hermite steps end corrected.
+  if (use_hermite) { return 0; }
+  tick = 0;
+  open_kick = 0.0;
+  bb_reset();
+  drift_dt = 0.0;
+  generate_tasks_from_func(NUMADVTASKS, nbody_kick_drift);
+  threadpool_run(&t_pool);
+  threadpool_wait(&t_pool);
+
   return 0;
 }
 
@@ -1,30 +1,67 @@
 #include "pool.h"
+#include "hugemem.h"
 
 #include <pthread.h>
 #include <stddef.h>
 #include <stdlib.h>
 
+void *pool_cache_acquire_(struct pool *pl);
+int pool_cache_release_(struct pool *pl, void *elem);
+struct pool_cache *pool_cache_get_(struct pool *pl);
+void pool_cache_destroy_(void *cp);
+struct pool_magazine *pool_magazine_new_();
+int pool_grow_locked_(struct pool *pl, size_t count);
+void pool_fill_objects_locked_(struct pool *pl);
+void *pool_lf_acquire_(struct pool *pl);
+void pool_lf_push_(struct pool *pl, void *first, void *last);
+int pool_lf_cas_(struct pool *pl, union pool_lf_head old,
+                 union pool_lf_head new);
+void *pool_chain_slabs_(struct pool *pl, struct pool_slab *slab,
+                        void **last);
+
 int pool_init(struct pool *pl, size_t capacity, size_t elem_size)
 {
-  char *storage;
+  return pool_init_flags(pl, capacity, elem_size, 0);
+}
 
+int pool_init_flags(struct pool *pl, size_t capacity, size_t elem_size,
+                    unsigned flags)
+{
   pthread_mutex_init(&pl->lock, NULL);
 
-  if ((pl->objects = malloc(capacity * sizeof(pl->objects[0]))) == NULL) {
-    return -1;
-  }
-
-  pl->capacity = capacity;
+  pl->capacity = 0;
   pl->ac_count = 0;
   pl->elem_size = elem_size;
+  pl->objects = NULL;
+  pl->slabs = NULL;
+
+  if (flags & POOL_ALIGN_CACHELINE) { pl->align = POOL_CACHELINE_SIZE; }
+  else {
+    pl->align = 2 * sizeof(void *);
+  }
 
-  if ((storage = malloc(elem_size * capacity)) == NULL) { return -1; }
+  // Round stride up to a multiple of the alignment.
+  pl->stride = (elem_size + pl->align - 1) & ~(pl->align - 1);
+  if (pl->stride == 0) { pl->stride = pl->align; }
 
-  pl->storage = storage;
+  pl->flags = flags;
+  pl->caches = NULL;
+  pl->full = pl->empty = NULL;
+  pl->generation = 0;
+  pl->lf_head.s.top = NULL;
+  pl->lf_head.s.tag = 0;
 
-  for (size_t i = 0; i < pl->capacity; ++i) {
-    pl->objects[i] = storage;
-    storage += elem_size;
+  if ((flags & POOL_LOCKFREE) &&
+      (!POOL_HAVE_LOCKFREE || (flags & POOL_THREAD_CACHE))) {
+    return -1;
+  }
+
+  if (capacity > 0 && pool_grow_locked_(pl, capacity) != 0) { return -1; }
+
+  if (flags & POOL_THREAD_CACHE) {
+    if (pthread_key_create(&pl->cache_key, pool_cache_destroy_) != 0) {
+      return -1;
+    }
   }
 
   return 0;
@@ -32,8 +69,40 @@ int pool_init(struct pool *pl, size_t capacity, size_t elem_size)
 
 int pool_destroy(struct pool *pl)
 {
+  struct pool_magazine *m, *m_next;
+  struct pool_cache *c, *c_next;
+
+  if (pl->flags & POOL_THREAD_CACHE) {
+    // Once the key is deleted, exiting threads no longer run
+    // pool_cache_destroy_(), so we free every cache here instead.
+    pthread_key_delete(pl->cache_key);
+
+    for (c = pl->caches; c != NULL; c = c_next) {
+      c_next = c->next;
+      free(c->loaded);
+      free(c->previous);
+      free(c);
+    }
+    for (m = pl->full; m != NULL; m = m_next) {
+      m_next = m->next;
+      free(m);
+    }
+    for (m = pl->empty; m != NULL; m = m_next) {
+      m_next = m->next;
+      free(m);
+    }
+  }
+
+  while (pl->slabs != NULL) {
+    struct pool_slab *slab = pl->slabs;
+    pl->slabs = slab->next;
+    if (pl->flags & POOL_HUGEPAGE) { hugemem_free(slab, slab->bytes); }
+    else {
+      free(slab);
+    }
+  }
+
   free(pl->objects);
-  free(pl->storage);
   return pthread_mutex_destroy(&pl->lock);
 }
 
@@ -41,13 +110,28 @@ void pool_releaseall(struct pool *pl)
 {
   pthread_mutex_lock(&pl->lock);
 
-  char *storage = pl->storage;
-  for (size_t i = 0; i < pl->capacity; ++i) {
-    pl->objects[i] = storage;
-    storage += pl->elem_size;
+  if (pl->flags & POOL_LOCKFREE) {
+    pl->lf_head.s.top = pool_chain_slabs_(pl, pl->slabs, NULL);
+    pl->lf_head.s.tag += 1;
+  }
+  else {
+    pool_fill_objects_locked_(pl);
   }
   pl->ac_count = 0;
 
+  // Every object is back in pl->objects, so the depot magazines are stale.
+  while (pl->full != NULL) {
+    struct pool_magazine *m = pl->full;
+    pl->full = m->next;
+    m->count = 0;
+    m->next = pl->empty;
+    pl->empty = m;
+  }
+
+  // Thread caches are emptied lazily, when they notice the new generation.
+  // They read it without the lock.
+  __atomic_add_fetch(&pl->generation, 1, __ATOMIC_RELEASE);
+
   pthread_mutex_unlock(&pl->lock);
 }
 
@@ -55,9 +139,12 @@ void *pool_acquire(struct pool *pl)
 {
   void *elem = NULL;
 
+  if (pl->flags & POOL_THREAD_CACHE) { return pool_cache_acquire_(pl); }
+  if (pl->flags & POOL_LOCKFREE) { return pool_lf_acquire_(pl); }
+
   pthread_mutex_lock(&pl->lock);
 
-  if (pl->ac_count == pl->capacity) {
+  if (pl->ac_count == pl->capacity && pool_grow_locked_(pl, 0) != 0) {
     // We've run out of objects in our pool.
     goto done; // Error condition, resize failed
   }
@@ -73,6 +160,12 @@ int pool_release(struct pool *pl, void *elem)
 {
   int ret = 0;
 
+  if (pl->flags & POOL_THREAD_CACHE) { return pool_cache_release_(pl, elem); }
+  if (pl->flags & POOL_LOCKFREE) {
+    pool_lf_push_(pl, elem, elem);
+    return 0;
+  }
+
   pthread_mutex_lock(&pl->lock);
 
   if (pl->ac_count == 0) {
@@ -87,3 +180,433 @@ done:
   return ret;
 }
 
+/**
+ * \brief Acquire an object through the calling thread's cache.
+ * \memberof pool
+ * \private
+ *
+ * \param pl Pointer to the pool.
+ * \return Pointer to storage for the object, or NULL if error.
+ */
+void *pool_cache_acquire_(struct pool *pl)
+{
+  struct pool_cache *c;
+  struct pool_magazine *m;
+
+  if ((c = pool_cache_get_(pl)) == NULL) { return NULL; }
+
+  if (c->loaded->count == 0) {
+    if (c->previous->count != 0) {
+      // Previous magazine still has objects, swap it in.
+      m = c->loaded;
+      c->loaded = c->previous;
+      c->previous = m;
+    }
+    else {
+      pthread_mutex_lock(&pl->lock);
+
+      if (pl->full != NULL) {
+        // Trade our empty previous magazine for a full one from the depot.
+        m = pl->full;
+        pl->full = m->next;
+
+        c->previous->next = pl->empty;
+        pl->empty = c->previous;
+
+        c->previous = c->loaded;
+        c->loaded = m;
+      }
+      else {
+        // Depot is dry, refill the loaded magazine from backing storage.
+        if (pl->ac_count == pl->capacity) { pool_grow_locked_(pl, 0); }
+        while (c->loaded->count < POOL_MAGAZINE_SIZE &&
+               pl->ac_count < pl->capacity) {
+          c->loaded->objects[c->loaded->count++] = pl->objects[pl->ac_count++];
+        }
+      }
+
+      pthread_mutex_unlock(&pl->lock);
+
+      // We've run out of objects in our pool.
+      if (c->loaded->count == 0) { return NULL; }
+    }
+  }
+
+  return c->loaded->objects[--c->loaded->count];
+}
+
+/**
+ * \brief Release an object through the calling thread's cache.
+ * \memberof pool
+ * \private
+ *
+ * \param pl Pointer to the pool.
+ * \param elem Object to release.
+ * \return 0 on success, -1 on error.
+ */
+int pool_cache_release_(struct pool *pl, void *elem)
+{
+  struct pool_cache *c;
+  struct pool_magazine *m;
+
+  if ((c = pool_cache_get_(pl)) == NULL) { return -1; }
+
+  if (c->loaded->count == POOL_MAGAZINE_SIZE) {
+    if (c->previous->count != POOL_MAGAZINE_SIZE) {
+      // Previous magazine has room, swap it in.
+      m = c->loaded;
+      c->loaded = c->previous;
+      c->previous = m;
+    }
+    else {
+      pthread_mutex_lock(&pl->lock);
+
+      // Trade our full previous magazine for an empty one from the depot.
+      if ((m = pl->empty) != NULL) { pl->empty = m->next; }
+      else if ((m = pool_magazine_new_()) == NULL) {
+        // Out of memory, hand the object straight back to backing storage,
+        // unless pool_releaseall() already has.
+        int ret = -1;
+        if (pl->ac_count != 0) {
+          pl->objects[--pl->ac_count] = elem;
+          ret = 0;
+        }
+        pthread_mutex_unlock(&pl->lock);
+        return ret;
+      }
+
+      c->previous->next = pl->full;
+      pl->full = c->previous;
+
+      c->previous = c->loaded;
+      c->loaded = m;
+
+      pthread_mutex_unlock(&pl->lock);
+    }
+  }
+
+  c->loaded->objects[c->loaded->count++] = elem;
+
+  return 0;
+}
+
+/**
+ * \brief Get the calling thread's cache for a pool, creating it if necessary.
+ * \memberof pool
+ * \private
+ *
+ * \param pl Pointer to the pool.
+ * \return Pointer to the thread cache, or NULL if error.
+ */
+struct pool_cache *pool_cache_get_(struct pool *pl)
+{
+  struct pool_cache *c = pthread_getspecific(pl->cache_key);
+
+  if (c != NULL) {
+    size_t generation = __atomic_load_n(&pl->generation, __ATOMIC_ACQUIRE);
+    if (c->generation != generation) {
+      // pool_releaseall() was called, our cached objects are stale.
+      c->loaded->count = c->previous->count = 0;
+      c->generation = generation;
+    }
+    return c;
+  }
+
+  if ((c = malloc(sizeof(*c))) == NULL) { return NULL; }
+
+  c->pl = pl;
+  c->loaded = pool_magazine_new_();
+  c->previous = pool_magazine_new_();
+
+  if (c->loaded == NULL || c->previous == NULL ||
+      pthread_setspecific(pl->cache_key, c) != 0) {
+    free(c->loaded);
+    free(c->previous);
+    free(c);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&pl->lock);
+
+  c->generation = pl->generation;
+
+  c->prev = NULL;
+  c->next = pl->caches;
+  if (pl->caches != NULL) { pl->caches->prev = c; }
+  pl->caches = c;
+
+  pthread_mutex_unlock(&pl->lock);
+
+  return c;
+}
+
+/**
+ * \brief Thread exit handler for a pool cache. Returns the cached magazines to
+ * the depot.
+ * \memberof pool
+ * \private
+ *
+ * \param cp Pointer to the thread's pool_cache, casted to void *
+ */
+void pool_cache_destroy_(void *cp)
+{
+  struct pool_cache *c = cp;
+  struct pool *pl = c->pl;
+  struct pool_magazine *mags[2] = {c->loaded, c->previous};
+
+  pthread_mutex_lock(&pl->lock);
+
+  for (size_t i = 0; i < 2; ++i) {
+    if (c->generation != pl->generation) { mags[i]->count = 0; }
+    if (mags[i]->count != 0) {
+      mags[i]->next = pl->full;
+      pl->full = mags[i];
+    }
+    else {
+      mags[i]->next = pl->empty;
+      pl->empty = mags[i];
+    }
+  }
+
+  if (c->prev != NULL) { c->prev->next = c->next; }
+  else {
+    pl->caches = c->next;
+  }
+  if (c->next != NULL) { c->next->prev = c->prev; }
+
+  pthread_mutex_unlock(&pl->lock);
+
+  free(c);
+}
+
+/**
+ * \brief Allocate an empty magazine.
+ * \memberof pool
+ * \private
+ *
+ * \return Pointer to the magazine, or NULL if error.
+ */
+struct pool_magazine *pool_magazine_new_()
+{
+  struct pool_magazine *m = malloc(sizeof(*m));
+
+  if (m != NULL) {
+    m->next = NULL;
+    m->count = 0;
+  }
+
+  return m;
+}
+
+/**
+ * \brief Add a slab of objects to the pool. Assumes pool has been locked by
+ * the caller.
+ * \memberof pool
+ * \private
+ *
+ * The slab holds as many objects as the pool already does (at least
+ * POOL_MIN_GROWTH), unless the pool is POOL_FIXED.
+ *
+ * \param pl Pointer to the pool.
+ * \param count Number of objects in the new slab, or 0 to double the pool.
+ * \return 0 on success, -1 on error.
+ */
+int pool_grow_locked_(struct pool *pl, size_t count)
+{
+  struct pool_slab *slab, **tail;
+  void **objects;
+  void *p;
+
+  if (count == 0) {
+    if (pl->flags & POOL_FIXED) { return -1; }
+    count = (pl->capacity < POOL_MIN_GROWTH) ? POOL_MIN_GROWTH : pl->capacity;
+  }
+
+  // A lock-free pool has no objects array, it threads a free list through
+  // the objects themselves instead.
+  if (!(pl->flags & POOL_LOCKFREE)) {
+    objects =
+        realloc(pl->objects, (pl->capacity + count) * sizeof(objects[0]));
+    if (objects == NULL) { return -1; }
+    pl->objects = objects;
+  }
+
+  // Slab header is padded so that the first object is aligned as well.
+  size_t header = (sizeof(*slab) + pl->align - 1) & ~(pl->align - 1);
+
+  size_t bytes = header + count * pl->stride;
+
+  if (pl->flags & POOL_HUGEPAGE) {
+    // Huge page alignment satisfies any object alignment.
+    if ((p = hugemem_alloc(bytes, 0)) == NULL) { return -1; }
+  }
+  else if (posix_memalign(&p, pl->align, bytes) != 0) {
+    return -1;
+  }
+
+  slab = p;
+  slab->next = NULL;
+  slab->count = count;
+  slab->bytes = bytes;
+  slab->storage = (char *)p + header;
+
+  // Keep slabs in allocation order, so pool_releaseall() hands out objects
+  // in address order starting from the oldest slab.
+  for (tail = &pl->slabs; *tail != NULL; tail = &(*tail)->next) {}
+  *tail = slab;
+
+  if (pl->flags & POOL_LOCKFREE) {
+    void *first, *last;
+
+    // Chain just the new (last) slab, and publish it all at once.
+    first = pool_chain_slabs_(pl, slab, &last);
+
+    pool_lf_push_(pl, first, last);
+  }
+  else {
+    for (size_t i = 0; i < count; ++i) {
+      pl->objects[pl->capacity + i] = slab->storage + i * pl->stride;
+    }
+  }
+  pl->capacity += count;
+
+  return 0;
+}
+
+/**
+ * \brief Point the objects array at every object of every slab. Assumes pool
+ * has been locked by the caller.
+ * \memberof pool
+ * \private
+ *
+ * \param pl Pointer to the pool.
+ */
+void pool_fill_objects_locked_(struct pool *pl)
+{
+  size_t i = 0;
+
+  for (struct pool_slab *slab = pl->slabs; slab != NULL; slab = slab->next) {
+    char *storage = slab->storage;
+    for (size_t j = 0; j < slab->count; ++j) {
+      pl->objects[i++] = storage;
+      storage += pl->stride;
+    }
+  }
+}
+
+/**
+ * \brief Pop an object off the lock-free free stack, growing the pool if the
+ * stack is empty.
+ * \memberof pool
+ * \private
+ *
+ * \param pl Pointer to the pool.
+ * \return Pointer to storage for the object, or NULL if error.
+ */
+void *pool_lf_acquire_(struct pool *pl)
+{
+  union pool_lf_head old, new;
+  int err;
+
+  for (;;) {
+    old.s.tag = __atomic_load_n(&pl->lf_head.s.tag, __ATOMIC_ACQUIRE);
+    old.s.top = __atomic_load_n(&pl->lf_head.s.top, __ATOMIC_ACQUIRE);
+
+    if (old.s.top == NULL) {
+      // Stack is empty. Grow the pool, unless someone beat us to it.
+      pthread_mutex_lock(&pl->lock);
+      err = 0;
+      if (__atomic_load_n(&pl->lf_head.s.top, __ATOMIC_ACQUIRE) == NULL) {
+        err = pool_grow_locked_(pl, 0);
+      }
+      pthread_mutex_unlock(&pl->lock);
+
+      if (err) { return NULL; }
+      continue;
+    }
+
+    // If another thread pops old.s.top first, this may read a stale or
+    // garbage link. Slabs are never freed while the pool is alive, so the read
+    // is safe, and the tag makes the compare-and-swap below fail.
+    new.s.top = *(void **)old.s.top;
+    new.s.tag = old.s.tag + 1;
+
+    if (pool_lf_cas_(pl, old, new)) { return old.s.top; }
+  }
+}
+
+/**
+ * \brief Push a chain of objects onto the lock-free free stack.
+ * \memberof pool
+ * \private
+ *
+ * \param pl Pointer to the pool.
+ * \param first First object of the chain.
+ * \param last Last object of the chain, whose link is overwritten.
+ */
+void pool_lf_push_(struct pool *pl, void *first, void *last)
+{
+  union pool_lf_head old, new;
+
+  do {
+    old.s.tag = __atomic_load_n(&pl->lf_head.s.tag, __ATOMIC_ACQUIRE);
+    old.s.top = __atomic_load_n(&pl->lf_head.s.top, __ATOMIC_ACQUIRE);
+
+    *(void **)last = old.s.top;
+
+    // Only pops need to bump the tag to defeat ABA.
+    new.s.top = first;
+    new.s.tag = old.s.tag;
+  } while (!pool_lf_cas_(pl, old, new));
+}
+
+/**
+ * \brief Atomically replace the lock-free stack head, if it is unchanged.
+ * \memberof pool
+ * \private
+ *
+ * \param pl Pointer to the pool.
+ * \param old Expected value of the head.
+ * \param new Value to store.
+ * \return Non-zero if the head was replaced.
+ */
+int pool_lf_cas_(struct pool *pl, union pool_lf_head old,
+                 union pool_lf_head new)
+{
+#if POOL_HAVE_LOCKFREE
+  return __sync_bool_compare_and_swap(&pl->lf_head.word, old.word, new.word);
+#else
+  return 0;
+#endif
+}
+
+/**
+ * \brief Thread a singly linked free list through every object of a list of
+ * slabs, in address order.
+ * \memberof pool
+ * \private
+ *
+ * \param pl Pointer to the pool.
+ * \param slab First slab of the list.
+ * \param last If not NULL, location at which to store the last object.
+ * \return First object of the chain, or NULL if the slabs hold no objects.
+ */
+void *pool_chain_slabs_(struct pool *pl, struct pool_slab *slab, void **last)
+{
+  void *first = NULL;
+  void **tail = &first;
+
+  for (; slab != NULL; slab = slab->next) {
+    char *storage = slab->storage;
+    for (size_t j = 0; j < slab->count; ++j) {
+      *tail = storage;
+      tail = (void **)storage;
+      storage += pl->stride;
+    }
+  }
+  *tail = NULL;
+
+  if (last != NULL) { *last = (first == NULL) ? NULL : (void *)tail; }
+
+  return first;
+}
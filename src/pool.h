@@ -5,8 +5,9 @@
  * This header declares a struct to represent a simple, generic object pool,
  * along with functions that operate on the pool.
  *
- * \todo Add option to align stored object on cache line boundaries to prevent
- * possible performance degredation due to false sharing.
+ * Pool storage is a chain of slabs. When the pool runs dry, a new slab is
+ * allocated, doubling its capacity, so that a pool may be sized from a
+ * realistic estimate rather than a worst-case bound.
  */
 
 #ifndef POOL_H
@@ -14,9 +15,119 @@
 
 #include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 
-/*
+/** Number of objects held by a single magazine of a thread cache. */
+#define POOL_MAGAZINE_SIZE 32
+
+/**
+ * \brief Flag for pool_init_flags(): serve acquire/release from per-thread
+ * magazine caches, touching shared pool state only when exchanging whole
+ * magazines with the depot.
+ */
+#define POOL_THREAD_CACHE 0x1
+
+/**
+ * \brief Flag for pool_init_flags(): align and pad each object to a cache
+ * line, so that objects used by different threads never share a line.
+ */
+#define POOL_ALIGN_CACHELINE 0x2
+
+/**
+ * \brief Flag for pool_init_flags(): never grow the pool. pool_acquire()
+ * returns NULL once all capacity objects have been acquired.
  */
+#define POOL_FIXED 0x4
+
+/**
+ * \brief Flag for pool_init_flags(): keep free objects on a lock-free
+ * intrusive stack instead of behind the pool mutex.
+ *
+ * Suited to objects that are acquired on one thread and released on another.
+ * The mutex is still taken to grow the pool. Cannot be combined with
+ * POOL_THREAD_CACHE, and requires POOL_HAVE_LOCKFREE.
+ */
+#define POOL_LOCKFREE 0x8
+
+// The lock-free stack pairs its head pointer with a modification tag, and
+// swaps both with a single double-width compare-and-swap to rule out ABA.
+#if UINTPTR_MAX == 0xffffffffu && defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8)
+#define POOL_HAVE_LOCKFREE 1
+typedef uint64_t pool_dword_t;
+#elif UINTPTR_MAX > 0xffffffffu && defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+#define POOL_HAVE_LOCKFREE 1
+typedef unsigned __int128 pool_dword_t;
+#else
+#define POOL_HAVE_LOCKFREE 0
+typedef uintmax_t pool_dword_t;
+#endif
+
+/**
+ * \brief Head of the lock-free free stack: top object plus a tag that is
+ * incremented on every pop.
+ */
+union pool_lf_head {
+  pool_dword_t word;
+  struct {
+    void *top;
+    uintptr_t tag;
+  } s;
+};
+
+/**
+ * \brief Flag for pool_init_flags(): back slabs with huge pages, see
+ * hugemem_alloc(). Worthwhile for pools of many megabytes.
+ */
+#define POOL_HUGEPAGE 0x10
+
+/** Assumed size of a cache line, in bytes. */
+#define POOL_CACHELINE_SIZE 64
+
+/** Minimum number of objects added to a pool when it grows. */
+#define POOL_MIN_GROWTH 16
+
+/**
+ * \brief Contiguous block of pool object storage.
+ *
+ * \class pool_slab
+ */
+struct pool_slab {
+  struct pool_slab *next; /**< Next (newer) slab of the pool. */
+  size_t count;           /**< Number of objects in the slab. */
+  size_t bytes;           /**< Size of the slab allocation, in bytes. */
+  char *storage;          /**< First object in the slab. */
+};
+
+struct pool;
+
+/**
+ * \brief Fixed-size stack of free objects, exchanged between a thread cache
+ * and the pool depot as a unit.
+ *
+ * \class pool_magazine
+ */
+struct pool_magazine {
+  struct pool_magazine *next; /**< Link in depot list. */
+  size_t count;               /**< Number of objects in the magazine. */
+  void *objects[POOL_MAGAZINE_SIZE];
+};
+
+/**
+ * \brief Per-thread cache of free objects for a pool.
+ *
+ * \class pool_cache
+ *
+ * Each thread holds a loaded and a previous magazine. Acquire and release
+ * operate on the loaded magazine, swapping with the previous magazine when it
+ * runs empty or full. Only when both are exhausted is the pool lock taken.
+ */
+struct pool_cache {
+  struct pool *pl;
+  struct pool_cache *next, *prev; /**< Links in list of all pool caches. */
+  size_t generation; /**< Value of pl->generation when last validated. */
+  struct pool_magazine *loaded;
+  struct pool_magazine *previous;
+};
 
 /**
  * \brief Generic object pool that supports concurrent access.
@@ -32,14 +143,32 @@
  *
  */
 struct pool {
-  size_t capacity;  /**< Maximum number of objects that the pool can store. */
-  size_t ac_count;  /**< Number of objects not currently in the pool. */
+  size_t capacity;  /**< Number of objects that the pool currently stores. */
+  size_t ac_count;  /**< Number of objects not currently in the pool. Not
+                       maintained with POOL_LOCKFREE. */
   size_t elem_size; /**< Size of a stored object, in bytes. */
+  size_t stride;    /**< Distance between stored objects, in bytes. */
+  size_t align;     /**< Alignment of stored objects, in bytes. */
   void **objects;   /**< Array of pointers to objects currently in pool. */
 
   pthread_mutex_t lock; /**< Mutex for concurrent access. */
 
-  char *storage; /**< Pointer to underlying object storage. Internal use. */
+  struct pool_slab *slabs; /**< Underlying object storage. Internal use. */
+
+  unsigned flags; /**< Flags passed to pool_init_flags(). */
+
+  /* Thread cache state (POOL_THREAD_CACHE). Internal use. */
+  pthread_key_t cache_key;      /**< Key for calling thread's pool_cache. */
+  struct pool_cache *caches;    /**< All thread caches of this pool. */
+  struct pool_magazine *full;   /**< Depot of non-empty magazines. */
+  struct pool_magazine *empty;  /**< Depot of empty magazines. */
+  size_t generation; /**< Incremented by pool_releaseall(). Accessed
+                        atomically, as thread caches read it unlocked. */
+
+  /** Lock-free free stack (POOL_LOCKFREE). Kept on its own cache line, as
+   * every acquire and release hits it. Internal use. */
+  union pool_lf_head lf_head
+      __attribute__((aligned(POOL_CACHELINE_SIZE)));
 };
 
 /**
@@ -47,12 +176,29 @@ struct pool {
  * \memberof pool
  *
  * \param pl Pointer to pool to initialize.
- * \param capacity Number of objects to store in the pool.
+ * \param capacity Initial number of objects to store in the pool.
  * \param elem_size Size of a stored object, in bytes.
  * \return 0 on success, -1 on error.
  */
 int pool_init(struct pool *pl, size_t capacity, size_t elem_size);
 
+/**
+ * \brief Initialize object pool with optional features.
+ * \memberof pool
+ *
+ * With POOL_THREAD_CACHE, free objects may sit in the magazines of other
+ * threads. The pool can then grow (or with POOL_FIXED, pool_acquire() return
+ * NULL) before every object has been acquired.
+ *
+ * \param pl Pointer to pool to initialize.
+ * \param capacity Initial number of objects to store in the pool.
+ * \param elem_size Size of a stored object, in bytes.
+ * \param flags Bitwise OR of POOL_* flags, or 0.
+ * \return 0 on success, -1 on error.
+ */
+int pool_init_flags(struct pool *pl, size_t capacity, size_t elem_size,
+                    unsigned flags);
+
 /**
  * \brief Destroy object pool referred to by pl, leaving it uninitialized.
  * \memberof pool
@@ -67,12 +213,15 @@ int pool_destroy(struct pool *pl);
  * any outstanding references to pool objects!
  * \memberof pool
  *
+ * Must not be called concurrently with any other operation on the pool. Thread
+ * caches are invalidated, and discard their contents on next use.
+ *
  * \param pl Pointer to the pool.
  */
 void pool_releaseall(struct pool *pl);
 
 /**
- * \brief Acquire an object from the pool.
+ * \brief Acquire an object from the pool, growing the pool if it is empty.
  * \memberof pool
  *
  * \param pl Pointer to the pool.
@@ -84,6 +233,9 @@ void *pool_acquire(struct pool *pl);
  * \brief Release/return an object back into the pool.
  * \memberof pool
  *
+ * With POOL_THREAD_CACHE or POOL_LOCKFREE, releasing more objects than were
+ * acquired is not detected.
+ *
  * \param pl Pointer to the pool.
  * \return 0 on success, -1 on error.
  */
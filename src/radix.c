@@ -0,0 +1,210 @@
+#include "radix.h"
+#include "error.h"
+#include "threadpool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Argument to a radix sort task. Pass reads from the keys / vals arrays if
+// even, and from the scratch arrays if odd. Only key bits set in mask count.
+struct radix_task_arg {
+  struct radix_sort *rs;
+  uint64_t mask;
+  unsigned pass;
+  size_t task, num_tasks;
+};
+
+enum ct_err radix_push_phase_(struct threadpool *tp, void (*func)(void *),
+                              struct radix_task_arg *arg, size_t num_tasks);
+void radix_range_(struct radix_task_arg const *arg, size_t *begin,
+                  size_t *end);
+void radix_count_task_(void *argp);
+void radix_offsets_task_(void *argp);
+void radix_scatter_task_(void *argp);
+void radix_copy_task_(void *argp);
+
+enum ct_err radix_sort_push(struct radix_sort *rs, struct threadpool *tp,
+                            unsigned key_bits, size_t num_tasks)
+{
+  int err;
+  unsigned num_passes = (key_bits + RADIX_BITS - 1) / RADIX_BITS;
+  struct radix_task_arg arg = {
+      .rs = rs,
+      .mask = (key_bits >= 64) ? ~(uint64_t)0 : ((uint64_t)1 << key_bits) - 1,
+      .pass = 0,
+      .task = 0,
+      .num_tasks = num_tasks};
+
+  if (num_tasks == 0) { arg.num_tasks = 1; }
+
+  for (arg.pass = 0; arg.pass < num_passes; ++arg.pass) {
+    if (arg.pass != 0 && (err = threadpool_push_barrier(tp))) { return err; }
+
+    err = radix_push_phase_(tp, radix_count_task_, &arg, arg.num_tasks);
+    if (err) { return err; }
+    if ((err = threadpool_push_barrier(tp))) { return err; }
+
+    err = radix_push_phase_(tp, radix_offsets_task_, &arg, 1);
+    if (err) { return err; }
+    if ((err = threadpool_push_barrier(tp))) { return err; }
+
+    err = radix_push_phase_(tp, radix_scatter_task_, &arg, arg.num_tasks);
+    if (err) { return err; }
+  }
+
+  // After an odd number of passes the result is in the scratch arrays.
+  if (num_passes % 2 == 1) {
+    if ((err = threadpool_push_barrier(tp))) { return err; }
+    err = radix_push_phase_(tp, radix_copy_task_, &arg, arg.num_tasks);
+    if (err) { return err; }
+  }
+
+  return CT_SUCCESS;
+}
+
+/**
+ * \brief Push num_tasks tasks for one phase of a pass.
+ * \memberof radix_sort
+ * \private
+ *
+ * \param tp The thread pool.
+ * \param func Task function.
+ * \param arg Task argument, copied into each task with task set to its index.
+ * \param num_tasks Number of tasks.
+ * \return 0 on success, non-zero on failure.
+ */
+enum ct_err radix_push_phase_(struct threadpool *tp, void (*func)(void *),
+                              struct radix_task_arg *arg, size_t num_tasks)
+{
+  int err;
+
+  for (arg->task = 0; arg->task < num_tasks; ++arg->task) {
+    err = threadpool_push_task(
+        tp, (struct task){.func = func,
+                          .arg = arg,
+                          .arg_size = sizeof(struct radix_task_arg)});
+    if (err) { return err; }
+  }
+
+  return CT_SUCCESS;
+}
+
+/**
+ * \brief Range of keys [begin, end) handled by a counting or scatter task.
+ * \memberof radix_sort
+ * \private
+ */
+void radix_range_(struct radix_task_arg const *arg, size_t *begin, size_t *end)
+{
+  *begin = arg->task * arg->rs->count / arg->num_tasks;
+  *end = (arg->task + 1) * arg->rs->count / arg->num_tasks;
+}
+
+/**
+ * \brief Task to count the digits of a pass over a range of keys.
+ * \memberof radix_sort
+ * \private
+ *
+ * \param argp Pointer to struct radix_task_arg, casted to void *
+ */
+void radix_count_task_(void *argp)
+{
+  struct radix_task_arg *arg = argp;
+  struct radix_sort *rs = arg->rs;
+  uint64_t const *keys = (arg->pass % 2 == 0) ? rs->keys : rs->keys_tmp;
+  unsigned shift = arg->pass * RADIX_BITS;
+  size_t begin, end;
+
+  if (rs->count == 0) { return; }
+
+  size_t *hist = rs->hist + arg->task * RADIX_BUCKETS;
+  for (size_t b = 0; b < RADIX_BUCKETS; ++b) {
+    hist[b] = 0;
+  }
+
+  radix_range_(arg, &begin, &end);
+  for (size_t i = begin; i != end; ++i) {
+    hist[((keys[i] & arg->mask) >> shift) & (RADIX_BUCKETS - 1)] += 1;
+  }
+}
+
+/**
+ * \brief Task to turn the digit counts of all ranges into scatter offsets.
+ * \memberof radix_sort
+ * \private
+ *
+ * Offsets are assigned bucket by bucket, and within a bucket range by range,
+ * so that the scatter is stable.
+ *
+ * \param argp Pointer to struct radix_task_arg, casted to void *
+ */
+void radix_offsets_task_(void *argp)
+{
+  struct radix_task_arg *arg = argp;
+  size_t *hist = arg->rs->hist;
+  size_t offset = 0;
+
+  if (arg->rs->count == 0) { return; }
+
+  for (size_t b = 0; b < RADIX_BUCKETS; ++b) {
+    for (size_t t = 0; t < arg->num_tasks; ++t) {
+      size_t count = hist[t * RADIX_BUCKETS + b];
+      hist[t * RADIX_BUCKETS + b] = offset;
+      offset += count;
+    }
+  }
+}
+
+/**
+ * \brief Task to scatter a range of keys and values by the digit of a pass.
+ * \memberof radix_sort
+ * \private
+ *
+ * \param argp Pointer to struct radix_task_arg, casted to void *
+ */
+void radix_scatter_task_(void *argp)
+{
+  struct radix_task_arg *arg = argp;
+  struct radix_sort *rs = arg->rs;
+  int even = (arg->pass % 2 == 0);
+  uint64_t const *keys = even ? rs->keys : rs->keys_tmp;
+  size_t const *vals = even ? rs->vals : rs->vals_tmp;
+  uint64_t *keys_out = even ? rs->keys_tmp : rs->keys;
+  size_t *vals_out = even ? rs->vals_tmp : rs->vals;
+  unsigned shift = arg->pass * RADIX_BITS;
+  size_t begin, end;
+
+  if (rs->count == 0) { return; }
+
+  size_t *offsets = rs->hist + arg->task * RADIX_BUCKETS;
+
+  radix_range_(arg, &begin, &end);
+  for (size_t i = begin; i != end; ++i) {
+    size_t digit = ((keys[i] & arg->mask) >> shift) & (RADIX_BUCKETS - 1);
+    size_t j = offsets[digit]++;
+    keys_out[j] = keys[i];
+    vals_out[j] = vals[i];
+  }
+}
+
+/**
+ * \brief Task to copy a range of the result back from the scratch arrays.
+ * \memberof radix_sort
+ * \private
+ *
+ * \param argp Pointer to struct radix_task_arg, casted to void *
+ */
+void radix_copy_task_(void *argp)
+{
+  struct radix_task_arg *arg = argp;
+  struct radix_sort *rs = arg->rs;
+  size_t begin, end;
+
+  if (rs->count == 0) { return; }
+
+  radix_range_(arg, &begin, &end);
+  for (size_t i = begin; i != end; ++i) {
+    rs->keys[i] = rs->keys_tmp[i];
+    rs->vals[i] = rs->vals_tmp[i];
+  }
+}
@@ -0,0 +1,61 @@
+/**
+ * \file radix.h
+ * \brief Parallel LSD radix sort of integer keys on a threadpool.
+ *
+ * Keys are sorted one RADIX_BITS wide digit at a time, least significant
+ * first. Each pass counts digits over num_tasks ranges in parallel, turns the
+ * counts into scatter offsets, and scatters the ranges in parallel. Every
+ * pass is stable, and so is the sort as a whole.
+ */
+
+#ifndef RADIX_H
+#define RADIX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "threadpool.h"
+
+/** Number of key bits sorted per pass. */
+#define RADIX_BITS 8
+
+/** Number of buckets per pass. */
+#define RADIX_BUCKETS (1u << RADIX_BITS)
+
+/**
+ * \brief State of a radix sort pushed with radix_sort_push().
+ *
+ * \class radix_sort
+ *
+ * The fields are only read when the tasks run, so they may be filled in by
+ * earlier tasks on the same threadpool. If count is 0 when the tasks run, none
+ * of the arrays are touched.
+ */
+struct radix_sort {
+  uint64_t *keys;     /**< Keys to sort. Holds the sorted keys when done. */
+  size_t *vals;       /**< Values to permute along with the keys. */
+  uint64_t *keys_tmp; /**< Scratch space for count keys. */
+  size_t *vals_tmp;   /**< Scratch space for count values. */
+  size_t count;       /**< Number of keys. */
+  size_t *hist;       /**< Scratch space for num_tasks * RADIX_BUCKETS. */
+};
+
+/**
+ * \brief Push tasks onto a threadpool that sort keys and values by key.
+ * \memberof radix_sort
+ *
+ * Only the low key_bits bits of each key are sorted on. Passes are separated
+ * by barriers, and the caller must push a barrier before using the result.
+ * rs must stay valid until the tasks have completed.
+ *
+ * \param rs The sort state.
+ * \param tp The thread pool.
+ * \param key_bits Number of significant key bits.
+ * \param num_tasks Number of ranges the keys are split into per pass.
+ * \return 0 on success, non-zero on failure.
+ */
+enum ct_err radix_sort_push(struct radix_sort *rs, struct threadpool *tp,
+                            unsigned key_bits, size_t num_tasks);
+
+#endif // RADIX_H
@@ -9,10 +9,17 @@
 #include "queue.h"
 #include "task.h"
 
+#include <errno.h>
 #include <pthread.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <time.h>
 
+enum ct_err threadpool_push_timed_(struct threadpool *tp, struct task t,
+                                   const struct timespec *deadline);
+int threadpool_full_locked_(struct threadpool *tp);
+enum ct_err threadpool_wait_for_space_(struct threadpool *tp,
+                                       const struct timespec *deadline);
 enum ct_err threadpool_push_n_(struct threadpool *tp, struct task t, size_t n);
 enum ct_err threadpool_pop_locked_(struct threadpool *tp, struct task *t);
 void threadpool_cleanup_(void *mutex);
@@ -34,6 +41,9 @@ enum ct_err threadpool_init(struct threadpool *tp, size_t num_threads)
   err = pthread_cond_init(&tp->notify, NULL);
   if (err) { return CT_ECOND_INIT; }
 
+  err = pthread_cond_init(&tp->not_full, NULL);
+  if (err) { return CT_ECOND_INIT; }
+
   if ((tp->threads = malloc(num_threads * sizeof(*tp->threads))) == NULL) {
     return CT_EMALLOC;
   }
@@ -41,6 +51,10 @@ enum ct_err threadpool_init(struct threadpool *tp, size_t num_threads)
 
   tp->state = THREADPOOL_RUNNING;
 
+  tp->capacity = 0;
+  tp->overflow = THREADPOOL_OVERFLOW_BLOCK;
+  tp->num_barrier_tasks = 0;
+
   tp->num_threads = num_threads;
 
   // Spawn threads
@@ -84,6 +98,9 @@ enum ct_err threadpool_destroy(struct threadpool *tp)
   err = pthread_cond_destroy(&tp->notify);
   if (err) { return CT_ECOND_DESTROY; }
 
+  err = pthread_cond_destroy(&tp->not_full);
+  if (err) { return CT_ECOND_DESTROY; }
+
   err = pthread_mutex_destroy(&tp->lock);
   if (err) { return CT_EMUTEX_DESTROY; }
 
@@ -133,23 +150,38 @@ void threadpool_wait(struct threadpool *tp)
 
 enum ct_err threadpool_push_task(struct threadpool *tp, struct task t)
 {
-  int err;
+  return threadpool_push_timed_(tp, t, NULL);
+}
 
-  struct task *t_new = malloc(sizeof(*t_new));
-  if (t_new == NULL) { return CT_EMALLOC; }
+enum ct_err threadpool_try_push_task(struct threadpool *tp, struct task t,
+                                     long timeout_ms)
+{
+  struct timespec deadline;
 
-  *t_new = t;
+  clock_gettime(CLOCK_REALTIME, &deadline);
 
-  err = task_freeze(t_new);
-  if (err) { return err; }
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec += 1;
+    deadline.tv_nsec -= 1000000000L;
+  }
 
+  return threadpool_push_timed_(tp, t, &deadline);
+}
+
+void threadpool_set_capacity(struct threadpool *tp, size_t capacity,
+                             enum threadpool_overflow overflow)
+{
   pthread_mutex_lock(&tp->lock);
 
-  err = queue_push(&tp->taskqueue, t_new);
+  tp->capacity = capacity;
+  tp->overflow = overflow;
 
   pthread_mutex_unlock(&tp->lock);
 
-  return err;
+  // Producers blocked on the old capacity may now fit.
+  pthread_cond_broadcast(&tp->not_full);
 }
 
 size_t threadpool_num_threads(struct threadpool *tp)
@@ -197,6 +229,127 @@ enum ct_err threadpool_push_barrier(struct threadpool *tp)
   return CT_SUCCESS;
 }
 
+/**
+ * \brief Queue up task for execution, honouring the queue capacity.
+ * \memberof threadpool
+ * \private
+ *
+ * If deadline is NULL, a full queue is handled according to the overflow
+ * policy of the threadpool. Otherwise, the caller blocks until there is space
+ * in the queue or the (absolute, CLOCK_REALTIME) deadline passes.
+ *
+ * \param tp The thread pool.
+ * \param t Task to add to queue.
+ * \param deadline Absolute time at which to give up, or NULL.
+ * \return 0 on success, non-zero on failure.
+ */
+enum ct_err threadpool_push_timed_(struct threadpool *tp, struct task t,
+                                   const struct timespec *deadline)
+{
+  int err;
+
+  struct task *t_new = malloc(sizeof(*t_new));
+  if (t_new == NULL) { return CT_EMALLOC; }
+
+  *t_new = t;
+
+  err = task_freeze(t_new);
+  if (err) {
+    free(t_new);
+    return err;
+  }
+
+  pthread_mutex_lock(&tp->lock);
+
+  if (threadpool_full_locked_(tp)) {
+    // Running the task inline would overtake any pending barrier, so then it
+    // waits for space instead.
+    if (deadline != NULL || tp->overflow == THREADPOOL_OVERFLOW_BLOCK ||
+        (tp->overflow == THREADPOOL_OVERFLOW_INLINE &&
+         tp->num_barrier_tasks != 0)) {
+      err = threadpool_wait_for_space_(tp, deadline);
+    }
+    else if (tp->overflow == THREADPOOL_OVERFLOW_FAIL) {
+      err = CT_EQUEUE_FULL;
+    }
+    else {
+      // THREADPOOL_OVERFLOW_INLINE: run the task on the calling thread.
+      pthread_mutex_unlock(&tp->lock);
+      task_execute(t_new);
+      free(t_new);
+      return CT_SUCCESS;
+    }
+  }
+
+  if (!err) { err = queue_push(&tp->taskqueue, t_new); }
+
+  pthread_mutex_unlock(&tp->lock);
+
+  if (err) {
+    task_destroy(t_new);
+    free(t_new);
+  }
+
+  return err;
+}
+
+/**
+ * \brief Check whether the task queue is at capacity. Assumes thread pool has
+ * been locked by the caller.
+ * \memberof threadpool
+ * \private
+ *
+ * \param tp The thread pool.
+ * \return Non-zero if the queue is full, zero otherwise.
+ */
+int threadpool_full_locked_(struct threadpool *tp)
+{
+  return tp->capacity != 0 && queue_count(&tp->taskqueue) >= tp->capacity;
+}
+
+/**
+ * \brief Block until there is space in the task queue. Assumes thread pool
+ * has been locked by the caller.
+ * \memberof threadpool
+ * \private
+ *
+ * If the threadpool is paused, it is started first. Otherwise nothing would
+ * ever drain the queue, and the caller would wait forever.
+ *
+ * \param tp The thread pool.
+ * \param deadline Absolute time at which to give up, or NULL to wait
+ * indefinitely.
+ * \return 0 on success, CT_ETIMEDOUT if the deadline passed.
+ */
+enum ct_err threadpool_wait_for_space_(struct threadpool *tp,
+                                       const struct timespec *deadline)
+{
+  int err = 0;
+  enum ct_err ret;
+
+  if (tp->state != THREADPOOL_RUNNING) {
+    tp->state = THREADPOOL_RUNNING;
+    pthread_cond_broadcast(&tp->notify);
+  }
+
+  // Unlock &tp->lock if we are cancelled while waiting. On a normal exit the
+  // caller still owns the lock, so the handler is popped without running.
+  pthread_cleanup_push(threadpool_cleanup_, &tp->lock);
+
+  while (threadpool_full_locked_(tp) && err != ETIMEDOUT) {
+    if (deadline == NULL) { pthread_cond_wait(&tp->not_full, &tp->lock); }
+    else {
+      err = pthread_cond_timedwait(&tp->not_full, &tp->lock, deadline);
+    }
+  }
+
+  ret = threadpool_full_locked_(tp) ? CT_ETIMEDOUT : CT_SUCCESS;
+
+  pthread_cleanup_pop(0);
+
+  return ret;
+}
+
 /**
  * \brief Queue up N identical tasks for execution.
  * \memberof threadpool
@@ -227,6 +380,8 @@ enum ct_err threadpool_push_n_(struct threadpool *tp, struct task t, size_t n)
 
     err = queue_push(&tp->taskqueue, t_new);
     if (err) { break; }
+
+    if (t.func == threadpool_barrier_task_func_) { tp->num_barrier_tasks += 1; }
   }
 
   pthread_mutex_unlock(&tp->lock);
@@ -254,6 +409,13 @@ enum ct_err threadpool_pop_locked_(struct threadpool *tp, struct task *t)
   err = queue_pop(&tp->taskqueue, (void **)&tsk);
   if (err) { return err; }
 
+  if (tsk->func == threadpool_barrier_task_func_) {
+    tp->num_barrier_tasks -= 1;
+  }
+
+  // A slot has been freed up for any producer blocked on a full queue.
+  if (tp->capacity != 0) { pthread_cond_signal(&tp->not_full); }
+
   // If we are discarding the task, make sure to free any associated resources.
   if (t == NULL) { task_destroy(tsk); }
   else {
@@ -18,6 +18,16 @@ enum threadpool_state {
   THREADPOOL_PAUSED
 };
 
+/**
+ * \brief Behaviour of threadpool_push_task() when the task queue is full.
+ */
+enum threadpool_overflow {
+  THREADPOOL_OVERFLOW_BLOCK, /**< Block the caller until space is available. */
+  THREADPOOL_OVERFLOW_FAIL,  /**< Fail with CT_EQUEUE_FULL. */
+  THREADPOOL_OVERFLOW_INLINE /**< Execute the task on the calling thread,
+                                  unless a barrier is pending. */
+};
+
 /**
  * \brief Threadpool / worker pool.
  *
@@ -40,8 +50,13 @@ struct threadpool {
 
   pthread_mutex_t lock;
   pthread_cond_t notify;
+  pthread_cond_t not_full; /**< Signalled when a task is popped. */
 
   enum threadpool_state state;
+
+  size_t capacity; /**< Maximum number of queued tasks, 0 if unbounded. */
+  enum threadpool_overflow overflow; /**< Policy when queue is full. */
+  size_t num_barrier_tasks; /**< Barrier tasks pending in the queue. */
 };
 
 /**
@@ -103,6 +118,54 @@ void threadpool_wait(struct threadpool *tp);
  */
 enum ct_err threadpool_push_task(struct threadpool *tp, struct task t);
 
+/**
+ * \brief Queue up task for execution, waiting at most timeout_ms milliseconds
+ * for space to become available in the task queue.
+ * \memberof threadpool
+ *
+ * Unlike threadpool_push_task(), this function ignores the overflow policy of
+ * the threadpool. If the queue is still full once the timeout expires, the
+ * task is discarded and CT_ETIMEDOUT is returned.
+ *
+ * \param tp The thread pool.
+ * \param t Task to add to queue.
+ * \param timeout_ms Maximum time to wait for space, in milliseconds.
+ * \return 0 on success, non-zero on failure.
+ */
+enum ct_err threadpool_try_push_task(struct threadpool *tp, struct task t,
+                                     long timeout_ms);
+
+/**
+ * \brief Bound the number of tasks that may be pending in the task queue.
+ * \memberof threadpool
+ *
+ * Once capacity tasks are pending, further calls to threadpool_push_task()
+ * behave according to overflow. A producer that blocks on a full queue starts
+ * the threadpool (as if by threadpool_run()), so that the workers can drain
+ * it.
+ *
+ * THREADPOOL_OVERFLOW_INLINE runs the task at once, ahead of the tasks already
+ * queued. That is only safe while no barrier is pending, as the task would
+ * otherwise overtake it, so with a barrier in the queue the producer blocks as
+ * with THREADPOOL_OVERFLOW_BLOCK instead.
+ *
+ * A task that pushes into a full queue under THREADPOOL_OVERFLOW_BLOCK (or
+ * THREADPOOL_OVERFLOW_INLINE behind a barrier) holds its worker while it
+ * waits. If every worker ends up waiting, or a queued barrier waits for the
+ * blocked worker, the pool deadlocks. Tasks that push further tasks should use
+ * THREADPOOL_OVERFLOW_FAIL or threadpool_try_push_task().
+ *
+ * Barriers pushed with threadpool_push_barrier() are not subject to the
+ * capacity limit, as blocking part-way through a barrier could deadlock the
+ * pool.
+ *
+ * \param tp The thread pool.
+ * \param capacity Maximum number of pending tasks, or 0 for unbounded.
+ * \param overflow Behaviour of threadpool_push_task() when the queue is full.
+ */
+void threadpool_set_capacity(struct threadpool *tp, size_t capacity,
+                             enum threadpool_overflow overflow);
+
 /**
  * \brief Get number of threads currently in the threadpool.
  * \memberof threadpool
@@ -0,0 +1,143 @@
+/**
+ * \file arena_test.c
+ * \brief Test arena allocator.
+ *
+ * Checks alignment of typed and explicitly aligned allocations, that
+ * rollback and reset hand the same storage out again, that oversized
+ * allocations are served, and that per-thread sub-arenas never overlap.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define CHUNK_SIZE 4096
+#define NUM_THREADS 8
+#define NUM_ALLOCS 10000
+
+struct arena a;
+
+struct vec {
+  double x, y, z;
+};
+
+void test_alignment()
+{
+  printf("Testing alignment...\n");
+
+  for (size_t i = 0; i < 1000; ++i) {
+    char *c = ARENA_NEW(&a, char, 1);
+    struct vec *v = ARENA_NEW(&a, struct vec, 3);
+    void *p = arena_alloc(&a, 10, 1u << (i % 8));
+    assert(c != NULL && v != NULL && p != NULL);
+    assert((uintptr_t)v % __alignof__(struct vec) == 0);
+    assert((uintptr_t)p % (1u << (i % 8)) == 0);
+  }
+
+  // Alignment beyond that of a chunk.
+  void *p = arena_alloc(&a, 100, 4096);
+  assert(p != NULL && (uintptr_t)p % 4096 == 0);
+
+  arena_reset(&a);
+}
+
+void test_rollback()
+{
+  printf("Testing mark and rollback...\n");
+
+  char *base = ARENA_NEW(&a, char, 100);
+  struct arena_mark m = arena_mark(&a);
+
+  char *first = ARENA_NEW(&a, char, 100);
+  for (size_t i = 0; i < 100; ++i) {
+    // Spill over into further chunks.
+    assert(ARENA_NEW(&a, char, 1000) != NULL);
+  }
+
+  arena_rollback(&a, m);
+  assert(ARENA_NEW(&a, char, 100) == first);
+
+  arena_reset(&a);
+  assert(ARENA_NEW(&a, char, 100) == base);
+
+  arena_reset(&a);
+}
+
+void test_oversized()
+{
+  printf("Testing oversized allocations...\n");
+
+  char *small = ARENA_NEW(&a, char, 16);
+  char *big = ARENA_NEW(&a, char, 10 * CHUNK_SIZE);
+  assert(small != NULL && big != NULL);
+  memset(big, 0xff, 10 * CHUNK_SIZE);
+  assert(small < big || small >= big + 10 * CHUNK_SIZE);
+
+  arena_reset(&a);
+}
+
+void *worker_func(void *arg)
+{
+  size_t id = (size_t)arg;
+  struct arena *local = arena_local(&a);
+  size_t *p[NUM_ALLOCS];
+
+  assert(local != NULL);
+  assert(arena_local(&a) == local);
+
+  for (size_t i = 0; i < NUM_ALLOCS; ++i) {
+    p[i] = ARENA_NEW(local, size_t, 4);
+    assert(p[i] != NULL);
+    p[i][0] = p[i][3] = id;
+  }
+  for (size_t i = 0; i < NUM_ALLOCS; ++i) {
+    assert(p[i][0] == id && p[i][3] == id);
+  }
+
+  return NULL;
+}
+
+void test_local()
+{
+  pthread_t threads[NUM_THREADS];
+
+  printf("Testing per-thread sub-arenas...\n");
+
+  for (int round = 0; round < 2; ++round) {
+    for (size_t i = 0; i < NUM_THREADS; ++i) {
+      pthread_create(&threads[i], NULL, worker_func, (void *)(i + 1));
+    }
+    for (size_t i = 0; i < NUM_THREADS; ++i) {
+      pthread_join(threads[i], NULL);
+    }
+    arena_reset(&a);
+  }
+
+  // Sub-arenas of exited threads are adopted rather than leaked.
+  size_t num_subs = 0;
+  for (struct arena *sub = a.subs; sub != NULL; sub = sub->next_sub) {
+    num_subs += 1;
+  }
+  assert(num_subs <= NUM_THREADS);
+}
+
+int main(int argc, char *argv[])
+{
+  assert(arena_init(&a, CHUNK_SIZE) == CT_SUCCESS);
+
+  test_alignment();
+  test_rollback();
+  test_oversized();
+  test_local();
+
+  arena_destroy(&a);
+
+  printf("Done!\n");
+
+  return 0;
+}
@@ -0,0 +1,248 @@
+/**
+ * \file bhtree_test.c
+ * \brief Test Barnes-Hut tree builders.
+ *
+ * Builds the same points by serial insertion, by the parallel builder and by
+ * the Morton builder, and checks that the flattened trees match node for node
+ * and body for body. Checks that inserting into a flattened tree leaves it to
+ * be flattened again before solving. Checks that packet solves, which open
+ * nodes for a whole packet, are at least as accurate as solving each point
+ * alone, under every opening criterion.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bhtree.h"
+#include "direct.h"
+#include "threadpool.h"
+
+#define NUM_THREADS 4
+#define NUM_TASKS 16
+#define NUM_POINTS 20000
+#define MIN_DIST 1e-3
+
+// Packets start every this many bodies of the Morton order
+#define PACKET_STRIDE 997
+
+// Bound on the rms error of a solve relative to direct summation
+#define TOLERANCE 5e-2
+
+struct threadpool tp;
+
+double x[NUM_POINTS], y[NUM_POINTS], z[NUM_POINTS], mass[NUM_POINTS];
+
+struct bh_vec3 bb_min = {-100.0, -100.0, -100.0};
+struct bh_vec3 bb_max = {100.0, 100.0, 100.0};
+
+double rand_double(double min, double max)
+{
+  return min + (max - min) * ((double)rand() / (double)RAND_MAX);
+}
+
+// Uniform points, a dense clump that makes the tree deep, and some
+// coincident points
+void init_points()
+{
+  srand(1);
+  for (size_t i = 0; i < NUM_POINTS; ++i) {
+    double r = (i % 4 == 0) ? 0.01 : 100.0;
+    mass[i] = rand_double(1.0, 10.0);
+    x[i] = rand_double(-r, r);
+    y[i] = rand_double(-r, r);
+    z[i] = rand_double(-r, r);
+  }
+  for (size_t i = 1; i < NUM_POINTS; i += 1000) {
+    x[i] = x[i - 1];
+    y[i] = y[i - 1];
+    z[i] = z[i - 1];
+  }
+}
+
+struct bh_points points()
+{
+  return (struct bh_points){
+      .x = x, .y = y, .z = z, .mass = mass, .stride = 1, .count = NUM_POINTS};
+}
+
+void run()
+{
+  threadpool_run(&tp);
+  threadpool_wait(&tp);
+}
+
+void build_insert(struct bh_tree *tree)
+{
+  assert(bh_tree_clear(tree) == 0);
+  assert(bh_tree_set_bb(tree, bb_min, bb_max) == 0);
+  for (size_t i = 0; i < NUM_POINTS; ++i) {
+    assert(bh_tree_insert(tree, (struct bh_vec3){x[i], y[i], z[i]},
+                          mass[i]) == 0);
+  }
+  assert(bh_tree_push_flatten(tree, &tp) == CT_SUCCESS);
+  run();
+  assert(tree->build_err == 0);
+}
+
+void assert_same_tree(struct bh_tree const *a, struct bh_tree const *b)
+{
+  assert(a->num_nodes == b->num_nodes);
+  for (size_t i = 0; i < a->num_nodes; ++i) {
+    struct bh_cnode const *u = &a->nodes[i], *v = &b->nodes[i];
+    assert(u->cm.x == v->cm.x && u->cm.y == v->cm.y && u->cm.z == v->cm.z);
+    assert(u->mass == v->mass);
+    assert(u->size == v->size && u->extent == v->extent);
+    assert(u->next == v->next && u->num_children == v->num_children);
+    assert(u->first_body == v->first_body && u->num_bodies == v->num_bodies);
+  }
+
+  assert(a->bodies.count == b->bodies.count);
+  for (size_t i = 0; i < a->bodies.count; ++i) {
+    assert(a->bodies.x[i] == b->bodies.x[i]);
+    assert(a->bodies.y[i] == b->bodies.y[i]);
+    assert(a->bodies.z[i] == b->bodies.z[i]);
+    assert(a->bodies.mass[i] == b->bodies.mass[i]);
+  }
+}
+
+void test_builders()
+{
+  printf("Testing parallel builders against insertion...\n");
+
+  struct bh_tree serial, parallel, morton;
+
+  assert(bh_tree_init(&serial, 2 * NUM_POINTS) == 0);
+  assert(bh_tree_init(&parallel, 2 * NUM_POINTS) == 0);
+  assert(bh_tree_init(&morton, 2 * NUM_POINTS) == 0);
+
+  build_insert(&serial);
+  // Coincident points are one body.
+  assert(serial.bodies.count < NUM_POINTS);
+
+  assert(bh_tree_set_bb(&parallel, bb_min, bb_max) == 0);
+  assert(bh_tree_push_build(&parallel, &tp, points(), NUM_TASKS) ==
+         CT_SUCCESS);
+  run();
+  assert(parallel.build_err == 0);
+  assert_same_tree(&serial, &parallel);
+
+  assert(bh_tree_set_bb(&morton, bb_min, bb_max) == 0);
+  assert(bh_tree_push_build_morton(&morton, &tp, points(), NUM_TASKS) ==
+         CT_SUCCESS);
+  run();
+  assert(morton.build_err == 0);
+  assert_same_tree(&serial, &morton);
+}
+
+void test_insert_after_flatten()
+{
+  printf("Testing insertion into a flattened tree...\n");
+
+  struct bh_tree tree;
+  struct bh_vec3 p = {1.0, 2.0, 3.0}, before, after;
+
+  assert(bh_tree_init(&tree, 2 * NUM_POINTS + 2) == 0);
+  build_insert(&tree);
+  bh_tree_solve_acc(&tree, &p, &before);
+
+  // A body close to p, which dominates its acceleration
+  assert(bh_tree_insert(&tree, (struct bh_vec3){1.5, 2.0, 3.0}, 100.0) == 0);
+  assert(tree.nodes == NULL && tree.num_nodes == 0);
+  assert(bh_tree_needs_rebuild(&tree));
+
+  assert(bh_tree_push_flatten(&tree, &tp) == CT_SUCCESS);
+  run();
+  assert(tree.build_err == 0);
+  bh_tree_solve_acc(&tree, &p, &after);
+  assert(after.x - before.x > 100.0);
+}
+
+struct bh_vec3 packet[NUM_POINTS];
+struct bh_vec3 packet_acc[NUM_POINTS], single_acc[NUM_POINTS];
+double dx[NUM_POINTS], dy[NUM_POINTS], dz[NUM_POINTS];
+
+// Sum of the squared errors of acc[begin, end) relative to direct summation
+// into *sum, and of the squared accelerations into *norm
+void add_error(struct bh_vec3 const *acc, size_t begin, size_t end,
+               double *sum, double *norm)
+{
+  for (size_t i = begin; i < end; ++i) {
+    double ex = acc[i].x - dx[i], ey = acc[i].y - dy[i], ez = acc[i].z - dz[i];
+    *sum += ex * ex + ey * ey + ez * ez;
+    *norm += dx[i] * dx[i] + dy[i] * dy[i] + dz[i] * dz[i];
+  }
+}
+
+void test_packet()
+{
+  printf("Testing packet solves against single points...\n");
+
+  struct bh_tree tree;
+  enum bh_criterion criteria[] = {BH_OPEN_THETA, BH_OPEN_BMAX, BH_OPEN_ACCEL};
+  // Packets of fewer points than a group, of one group, and of several
+  size_t counts[] = {1, 5, 16, 33, 100};
+
+  assert(bh_tree_init(&tree, 2 * NUM_POINTS) == 0);
+  assert(bh_tree_set_bb(&tree, bb_min, bb_max) == 0);
+  assert(bh_tree_push_build_morton(&tree, &tp, points(), NUM_TASKS) ==
+         CT_SUCCESS);
+  run();
+  assert(tree.build_err == 0);
+
+  // The bodies of the tree are in Morton order, so ranges of them are
+  // packets of nearby points.
+  struct bh_bodies const *b = &tree.bodies;
+  struct direct_bodies all = {
+      .x = b->x, .y = b->y, .z = b->z, .mass = b->mass, .count = b->count};
+  for (size_t i = 0; i < b->count; ++i) {
+    packet[i] = (struct bh_vec3){b->x[i], b->y[i], b->z[i]};
+  }
+
+  for (size_t c = 0; c < sizeof(criteria) / sizeof(*criteria); ++c) {
+    double packet_sum = 0.0, single_sum = 0.0, norm = 0.0, unused = 0.0;
+
+    tree.opening.criterion = criteria[c];
+    for (size_t k = 0; k * PACKET_STRIDE < b->count; ++k) {
+      size_t begin = k * PACKET_STRIDE;
+      size_t end = begin + counts[k % (sizeof(counts) / sizeof(*counts))];
+      if (end > b->count) { end = b->count; }
+
+      direct_accel(&all, begin, end, dx, dy, dz, MIN_DIST);
+      // BH_OPEN_ACCEL reads an estimate of each acceleration from the
+      // result, which the others overwrite.
+      for (size_t i = begin; i < end; ++i) {
+        packet_acc[i] = single_acc[i] = (struct bh_vec3){dx[i], dy[i], dz[i]};
+      }
+
+      bh_tree_solve_packet(&tree, packet + begin, end - begin,
+                           packet_acc + begin);
+      for (size_t i = begin; i < end; ++i) {
+        bh_tree_solve_acc(&tree, &packet[i], &single_acc[i]);
+      }
+
+      add_error(packet_acc, begin, end, &packet_sum, &norm);
+      add_error(single_acc, begin, end, &single_sum, &unused);
+    }
+
+    assert(sqrt(single_sum / norm) < TOLERANCE);
+    assert(packet_sum <= single_sum);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  threadpool_init(&tp, NUM_THREADS);
+  init_points();
+
+  test_builders();
+  test_insert_after_flatten();
+  test_packet();
+
+  printf("Done!\n");
+
+  return 0;
+}
@@ -0,0 +1,144 @@
+/**
+ * \file direct_test.c
+ * \brief Test direct summation kernels.
+ *
+ * Checks every vectorized kernel that the CPU supports, and the symmetric
+ * solver, against the scalar kernel, which is the accuracy reference, over
+ * counts and ranges that leave scalar tails and bodies that coincide.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "direct.h"
+#include "threadpool.h"
+
+#define MAX_BODIES 2500
+#define MIN_DIST 1e-3
+#define NUM_THREADS 4
+
+// Bound on the error of a kernel relative to the scalar one, per body
+#define TOLERANCE 1e-11
+
+double x[MAX_BODIES], y[MAX_BODIES], z[MAX_BODIES], mass[MAX_BODIES];
+double ax[MAX_BODIES], ay[MAX_BODIES], az[MAX_BODIES];
+double rx[MAX_BODIES], ry[MAX_BODIES], rz[MAX_BODIES];
+
+struct threadpool tp;
+
+double rand_double(double min, double max)
+{
+  return min + (max - min) * ((double)rand() / (double)RAND_MAX);
+}
+
+// Random bodies, with every tenth coinciding with the one before it
+void init_bodies()
+{
+  srand(1);
+  for (size_t i = 0; i < MAX_BODIES; ++i) {
+    mass[i] = rand_double(1.0, 10.0);
+    x[i] = rand_double(-100.0, 100.0);
+    y[i] = rand_double(-100.0, 100.0);
+    z[i] = rand_double(-100.0, 100.0);
+    if (i % 10 == 1) {
+      x[i] = x[i - 1];
+      y[i] = y[i - 1];
+      z[i] = z[i - 1];
+    }
+  }
+}
+
+// Largest error of the accelerations of bodies [begin, end) relative to the
+// reference, per body
+double max_error(size_t begin, size_t end)
+{
+  double max = 0.0;
+
+  for (size_t i = begin; i < end; ++i) {
+    double dx = ax[i] - rx[i], dy = ay[i] - ry[i], dz = az[i] - rz[i];
+    double ref = sqrt(rx[i] * rx[i] + ry[i] * ry[i] + rz[i] * rz[i]);
+    double err = sqrt(dx * dx + dy * dy + dz * dz);
+
+    assert(isfinite(err));
+    if (ref == 0.0) {
+      assert(err == 0.0);
+      continue;
+    }
+    if (err / ref > max) { max = err / ref; }
+  }
+
+  return max;
+}
+
+// Compare the kernel of isa with the scalar one
+void test_isa(enum direct_isa isa)
+{
+  printf("Testing %s kernel...\n", direct_isa_name(isa));
+
+  // Odd counts and ranges, so that every kernel runs its scalar tails, and a
+  // count above DIRECT_TILE
+  size_t counts[] = {1, 2, 3, 7, 13, 101, 1001, MAX_BODIES};
+
+  for (size_t c = 0; c < sizeof(counts) / sizeof(*counts); ++c) {
+    struct direct_bodies b = {
+        .x = x, .y = y, .z = z, .mass = mass, .count = counts[c]};
+    size_t begin = counts[c] / 3, end = counts[c] - counts[c] / 5;
+
+    direct_accel_isa(DIRECT_SCALAR, &b, 0, b.count, rx, ry, rz, MIN_DIST);
+
+    direct_accel_isa(isa, &b, 0, b.count, ax, ay, az, MIN_DIST);
+    assert(max_error(0, b.count) < TOLERANCE);
+
+    for (size_t i = 0; i < b.count; ++i) {
+      ax[i] = ay[i] = az[i] = NAN;
+    }
+    direct_accel_isa(isa, &b, begin, end, ax, ay, az, MIN_DIST);
+    assert(max_error(begin, end) < TOLERANCE);
+  }
+}
+
+void test_symmetric()
+{
+  printf("Testing symmetric solver...\n");
+
+  // Odd counts, including fewer bodies than blocks, and block counts that do
+  // not divide them
+  size_t counts[] = {1, 3, 101, MAX_BODIES};
+  size_t blocks[] = {1, 2, 7, 2 * NUM_THREADS};
+
+  for (size_t c = 0; c < sizeof(counts) / sizeof(*counts); ++c) {
+    struct direct_bodies b = {
+        .x = x, .y = y, .z = z, .mass = mass, .count = counts[c]};
+
+    direct_accel_isa(DIRECT_SCALAR, &b, 0, b.count, rx, ry, rz, MIN_DIST);
+
+    for (size_t k = 0; k < sizeof(blocks) / sizeof(*blocks); ++k) {
+      for (size_t i = 0; i < b.count; ++i) {
+        ax[i] = ay[i] = az[i] = NAN;
+      }
+      assert(direct_push_symmetric(&tp, &b, ax, ay, az, MIN_DIST,
+                                   blocks[k]) == CT_SUCCESS);
+      threadpool_run(&tp);
+      threadpool_wait(&tp);
+      assert(max_error(0, b.count) < TOLERANCE);
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  threadpool_init(&tp, NUM_THREADS);
+  init_bodies();
+
+  for (enum direct_isa isa = DIRECT_SCALAR; isa <= direct_best_isa(); ++isa) {
+    test_isa(isa);
+  }
+  test_symmetric();
+
+  printf("Done!\n");
+
+  return 0;
+}
@@ -0,0 +1,137 @@
+/**
+ * \file fmm_test.c
+ * \brief Test fast multipole solver.
+ *
+ * Solves fixed random sets of bodies, uniform and clustered, with the fast
+ * multipole method, and checks the accelerations of a sample of them against
+ * direct summation.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bhtree.h"
+#include "direct.h"
+#include "fmm.h"
+#include "threadpool.h"
+
+#define NUM_THREADS 4
+#define NUM_TASKS 16
+#define NUM_BODIES 20000
+#define MIN_DIST 1e-3
+
+// Every this many bodies are checked against direct summation
+#define SAMPLE_STRIDE 13
+
+// Bound on the rms error of the sampled accelerations, relative to their rms
+// magnitude by direct summation
+#define TOLERANCE 1e-3
+
+struct threadpool tp;
+struct bh_tree tree;
+struct fmm fmm;
+
+double x[NUM_BODIES], y[NUM_BODIES], z[NUM_BODIES], mass[NUM_BODIES];
+double ax[NUM_BODIES], ay[NUM_BODIES], az[NUM_BODIES];
+double dx[NUM_BODIES], dy[NUM_BODIES], dz[NUM_BODIES];
+
+double rand_double(double min, double max)
+{
+  return min + (max - min) * ((double)rand() / (double)RAND_MAX);
+}
+
+// Bodies uniform in a cube, of which a fraction 1 / clump is moved into a
+// Plummer sphere of scale radius 20 at its centre, cut off inside the cube,
+// unless clump is 0
+void init_bodies(size_t clump)
+{
+  srand(1);
+  for (size_t i = 0; i < NUM_BODIES; ++i) {
+    mass[i] = rand_double(1.0, 10.0);
+    x[i] = rand_double(-100.0, 100.0);
+    y[i] = rand_double(-100.0, 100.0);
+    z[i] = rand_double(-100.0, 100.0);
+    if (clump != 0 && i % clump == 0) {
+      double r = 20.0 / sqrt(pow(rand_double(1e-3, 0.9), -2.0 / 3.0) - 1.0);
+      double cos_t = rand_double(-1.0, 1.0), phi = rand_double(0.0, 2 * M_PI);
+      double sin_t = sqrt(1.0 - cos_t * cos_t);
+      x[i] = r * sin_t * cos(phi);
+      y[i] = r * sin_t * sin(phi);
+      z[i] = r * cos_t;
+    }
+  }
+}
+
+// Rms error of the sampled accelerations relative to their rms magnitude by
+// direct summation, so that bodies in weak fields do not dominate
+double rms_error()
+{
+  struct direct_bodies all = {
+      .x = x, .y = y, .z = z, .mass = mass, .count = NUM_BODIES};
+  double sum = 0.0, norm = 0.0;
+
+  for (size_t i = 0; i < NUM_BODIES; i += SAMPLE_STRIDE) {
+    direct_accel(&all, i, i + 1, dx, dy, dz, MIN_DIST);
+    double ex = ax[i] - dx[i], ey = ay[i] - dy[i], ez = az[i] - dz[i];
+    sum += ex * ex + ey * ey + ez * ez;
+    norm += dx[i] * dx[i] + dy[i] * dy[i] + dz[i] * dz[i];
+  }
+
+  return sqrt(sum / norm);
+}
+
+void solve()
+{
+  struct bh_points points = {
+      .x = x, .y = y, .z = z, .mass = mass, .stride = 1, .count = NUM_BODIES};
+
+  assert(bh_tree_set_bb(&tree, (struct bh_vec3){-100.0, -100.0, -100.0},
+                        (struct bh_vec3){100.0, 100.0, 100.0}) == 0);
+  assert(bh_tree_push_build_morton(&tree, &tp, points, NUM_TASKS) ==
+         CT_SUCCESS);
+  assert(threadpool_push_barrier(&tp) == CT_SUCCESS);
+  assert(fmm_push_solve(&fmm, &tree, &tp, ax, ay, az, NUM_TASKS) ==
+         CT_SUCCESS);
+  threadpool_run(&tp);
+  threadpool_wait(&tp);
+
+  assert(tree.build_err == 0);
+  assert(fmm.err == 0);
+}
+
+void test_uniform()
+{
+  printf("Testing uniform bodies...\n");
+
+  init_bodies(0);
+  solve();
+  assert(rms_error() < TOLERANCE);
+}
+
+void test_clustered()
+{
+  printf("Testing clustered bodies...\n");
+
+  init_bodies(10);
+  solve();
+  assert(rms_error() < TOLERANCE);
+}
+
+int main(int argc, char *argv[])
+{
+  threadpool_init(&tp, NUM_THREADS);
+  assert(bh_tree_init(&tree, 2 * NUM_BODIES) == 0);
+  assert(fmm_init(&fmm, FMM_THETA) == CT_SUCCESS);
+
+  test_uniform();
+  test_clustered();
+
+  fmm_destroy(&fmm);
+
+  printf("Done!\n");
+
+  return 0;
+}
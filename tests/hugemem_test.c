@@ -0,0 +1,151 @@
+/**
+ * \file hugemem_test.c
+ * \brief Test huge-page backed allocation and parallel first-touch.
+ *
+ * Checks that buffers are aligned to huge pages and zero-filled, that
+ * hugemem_free() unmaps them, and that both first-touch functions fault in
+ * every page of a buffer without changing its contents.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "hugemem.h"
+#include "threadpool.h"
+
+#define NUM_THREADS 4
+#define NUM_TASKS 7
+#define NUM_COLUMNS 5
+
+// Not a multiple of the page size, so that slices straddle pages
+#define COLUMN_SIZE (300000 * sizeof(double) + 24)
+
+struct threadpool tp;
+
+// Whether every page of [p, p + size) is resident
+int is_resident(char *p, size_t size)
+{
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t num_pages = (size + page_size - 1) / page_size;
+  unsigned char *vec = malloc(num_pages);
+  int resident = 1;
+
+  assert(vec != NULL);
+  assert(mincore(p, size, vec) == 0);
+  for (size_t i = 0; i < num_pages; ++i) {
+    resident = resident && (vec[i] & 1);
+  }
+  free(vec);
+
+  return resident;
+}
+
+void test_alloc()
+{
+  printf("Testing alignment and zero fill...\n");
+
+  size_t sizes[] = {1, 4096, HUGEMEM_PAGE_SIZE, 3 * HUGEMEM_PAGE_SIZE + 5};
+  unsigned flags[] = {0, HUGEMEM_EXPLICIT};
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+    for (size_t j = 0; j < sizeof(flags) / sizeof(*flags); ++j) {
+      char *p = hugemem_alloc(sizes[i], flags[j]);
+      assert(p != NULL);
+      assert((uintptr_t)p % HUGEMEM_PAGE_SIZE == 0);
+      for (size_t k = 0; k < sizes[i]; ++k) {
+        assert(p[k] == 0);
+        p[k] = (char)k;
+      }
+      hugemem_free(p, sizes[i]);
+    }
+  }
+}
+
+void test_free()
+{
+  printf("Testing free...\n");
+
+  size_t size = 2 * HUGEMEM_PAGE_SIZE + 1;
+  char *p = hugemem_alloc(size, 0);
+  unsigned char vec[1];
+
+  assert(p != NULL);
+  p[0] = p[size - 1] = 1;
+  hugemem_free(p, size);
+
+  // The whole rounded-up mapping is gone.
+  assert(mincore(p, 1, vec) == -1 && errno == ENOMEM);
+  assert(mincore(p + 2 * HUGEMEM_PAGE_SIZE, 1, vec) == -1 && errno == ENOMEM);
+
+  hugemem_free(NULL, size);
+}
+
+void test_first_touch()
+{
+  printf("Testing first touch...\n");
+
+  size_t size = 3 * HUGEMEM_PAGE_SIZE + 12345;
+  char *p = hugemem_alloc(size, 0);
+
+  assert(p != NULL);
+  assert(hugemem_first_touch(&tp, p, size, NUM_TASKS) == CT_SUCCESS);
+  assert(is_resident(p, size));
+  for (size_t i = 0; i < size; ++i) {
+    assert(p[i] == 0);
+  }
+
+  // Touching pages again leaves their contents alone.
+  for (size_t i = 0; i < size; ++i) {
+    p[i] = (char)(i * 7);
+  }
+  assert(hugemem_first_touch(&tp, p, size, NUM_TASKS) == CT_SUCCESS);
+  for (size_t i = 0; i < size; ++i) {
+    assert(p[i] == (char)(i * 7));
+  }
+
+  hugemem_free(p, size);
+}
+
+void test_first_touch_columns()
+{
+  printf("Testing first touch of columns...\n");
+
+  size_t size = NUM_COLUMNS * COLUMN_SIZE;
+  char *p = hugemem_alloc(size, 0);
+
+  assert(p != NULL);
+  assert(hugemem_first_touch_columns(&tp, p, COLUMN_SIZE, NUM_COLUMNS,
+                                     NUM_TASKS) == CT_SUCCESS);
+  assert(is_resident(p, size));
+
+  for (size_t i = 0; i < size; ++i) {
+    p[i] = (char)(i * 7);
+  }
+  assert(hugemem_first_touch_columns(&tp, p, COLUMN_SIZE, NUM_COLUMNS,
+                                     NUM_TASKS) == CT_SUCCESS);
+  for (size_t i = 0; i < size; ++i) {
+    assert(p[i] == (char)(i * 7));
+  }
+
+  hugemem_free(p, size);
+}
+
+int main(int argc, char *argv[])
+{
+  threadpool_init(&tp, NUM_THREADS);
+
+  test_alloc();
+  test_free();
+  test_first_touch();
+  test_first_touch_columns();
+
+  printf("Done!\n");
+
+  return 0;
+}
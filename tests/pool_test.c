@@ -0,0 +1,138 @@
+/**
+ * \file pool_test.c
+ * \brief Test concurrent use of object pool.
+ *
+ * Several threads randomly acquire and release objects from a shared pool,
+ * stamping each object they own with their id, and verifying the stamp before
+ * releasing it. An object handed out to two threads at once is detected as a
+ * corrupted stamp. Afterwards, the pool is reset with pool_releaseall(), and
+ * must hand out its full capacity in distinct objects.
+ *
+ * Growable pools start out small, and must grow to accommodate the workers.
+ * Each pool backend (mutex, thread cached, lock-free) is tested.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+#define CAPACITY 4096
+#define SMALL_CAPACITY 64
+#define NUM_THREADS 8
+#define NUM_OPS 200000
+#define MAX_HELD 256
+
+struct elem {
+  size_t owner;
+  size_t serial;
+};
+
+struct pool pl;
+
+void *worker_func(void *arg)
+{
+  size_t id = (size_t)arg;
+  unsigned int seed = id;
+
+  struct elem *held[MAX_HELD];
+  size_t num_held = 0;
+
+  for (size_t i = 0; i < NUM_OPS; ++i) {
+    if (num_held < MAX_HELD && (num_held == 0 || rand_r(&seed) & 1)) {
+      struct elem *e = pool_acquire(&pl);
+      assert(e != NULL);
+      e->owner = id;
+      e->serial = i;
+      held[num_held++] = e;
+    }
+    else {
+      size_t j = rand_r(&seed) % num_held;
+      struct elem *e = held[j];
+      assert(e->owner == id);
+      held[j] = held[--num_held];
+      assert(pool_release(&pl, e) == 0);
+    }
+  }
+
+  while (num_held != 0) {
+    assert(held[num_held - 1]->owner == id);
+    assert(pool_release(&pl, held[--num_held]) == 0);
+  }
+
+  return NULL;
+}
+
+int compare_ptr(const void *a, const void *b)
+{
+  char *pa = *(char *const *)a;
+  char *pb = *(char *const *)b;
+  return (pa > pb) - (pa < pb);
+}
+
+void check_releaseall()
+{
+  size_t capacity = pl.capacity;
+  void **objects = malloc(capacity * sizeof(*objects));
+
+  pool_releaseall(&pl);
+
+  for (size_t i = 0; i < capacity; ++i) {
+    assert((objects[i] = pool_acquire(&pl)) != NULL);
+    assert((size_t)objects[i] % pl.align == 0);
+  }
+  if (pl.flags & POOL_FIXED) { assert(pool_acquire(&pl) == NULL); }
+  else {
+    assert(pool_acquire(&pl) != NULL);
+    assert(pl.capacity > capacity);
+  }
+
+  qsort(objects, capacity, sizeof(objects[0]), compare_ptr);
+  for (size_t i = 1; i < capacity; ++i) {
+    assert((char *)objects[i] - (char *)objects[i - 1] >= pl.stride);
+  }
+
+  free(objects);
+}
+
+void run_test(const char *name, size_t capacity, unsigned flags)
+{
+  pthread_t threads[NUM_THREADS];
+
+  printf("Testing %s pool...\n", name);
+
+  assert(pool_init_flags(&pl, capacity, sizeof(struct elem), flags) == 0);
+
+  for (size_t i = 0; i < NUM_THREADS; ++i) {
+    pthread_create(&threads[i], NULL, worker_func, (void *)(i + 1));
+  }
+  for (size_t i = 0; i < NUM_THREADS; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  check_releaseall();
+
+  assert(pool_destroy(&pl) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+  run_test("fixed mutex", CAPACITY, POOL_FIXED);
+  run_test("fixed thread cached", CAPACITY, POOL_FIXED | POOL_THREAD_CACHE);
+  run_test("growable mutex", SMALL_CAPACITY, 0);
+  run_test("growable thread cached", SMALL_CAPACITY, POOL_THREAD_CACHE);
+  run_test("cache aligned", SMALL_CAPACITY,
+           POOL_ALIGN_CACHELINE | POOL_THREAD_CACHE);
+
+#if POOL_HAVE_LOCKFREE
+  run_test("fixed lock-free", CAPACITY, POOL_FIXED | POOL_LOCKFREE);
+  run_test("growable lock-free", SMALL_CAPACITY, POOL_LOCKFREE);
+#endif
+
+  printf("Done!\n");
+
+  return 0;
+}
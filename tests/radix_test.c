@@ -0,0 +1,83 @@
+/**
+ * \file radix_test.c
+ * \brief Test parallel radix sort.
+ *
+ * Random keys are sorted along with their original indices, for key widths
+ * that take an even and an odd number of passes. The result must be in key
+ * order, a permutation of the input, and stable: equal keys keep their
+ * original order.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "radix.h"
+#include "threadpool.h"
+
+#define NUM_KEYS 1000003
+#define NUM_THREADS 8
+#define NUM_TASKS 13
+
+struct threadpool tp;
+
+uint64_t keys[NUM_KEYS], keys_tmp[NUM_KEYS], orig[NUM_KEYS];
+size_t vals[NUM_KEYS], vals_tmp[NUM_KEYS];
+size_t hist[NUM_TASKS * RADIX_BUCKETS];
+char seen[NUM_KEYS];
+
+void test_sort(unsigned key_bits, size_t count)
+{
+  struct radix_sort rs = {.keys = keys,
+                          .vals = vals,
+                          .keys_tmp = keys_tmp,
+                          .vals_tmp = vals_tmp,
+                          .count = count,
+                          .hist = hist};
+  uint64_t mask = (key_bits == 64) ? ~0ull : (1ull << key_bits) - 1;
+
+  printf("Testing %u bit keys, %zu keys...\n", key_bits, count);
+
+  for (size_t i = 0; i < count; ++i) {
+    // Combine two draws, and include bits above key_bits that must be ignored.
+    uint64_t r = ((uint64_t)rand() << 31) ^ (uint64_t)rand();
+    keys[i] = orig[i] = (r << 33) ^ ((uint64_t)rand() << 2) ^ r;
+    vals[i] = i;
+    seen[i] = 0;
+  }
+
+  assert(radix_sort_push(&rs, &tp, key_bits, NUM_TASKS) == CT_SUCCESS);
+  threadpool_run(&tp);
+  threadpool_wait(&tp);
+
+  for (size_t i = 0; i < count; ++i) {
+    assert(vals[i] < count && !seen[vals[i]]);
+    seen[vals[i]] = 1;
+    assert(keys[i] == orig[vals[i]]);
+    if (i > 0) {
+      assert((keys[i - 1] & mask) <= (keys[i] & mask));
+      if ((keys[i - 1] & mask) == (keys[i] & mask)) {
+        assert(vals[i - 1] < vals[i]);
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  assert(threadpool_init(&tp, NUM_THREADS) == CT_SUCCESS);
+
+  test_sort(63, NUM_KEYS); // 8 passes
+  test_sort(20, NUM_KEYS); // 3 passes, many equal keys
+  test_sort(8, NUM_KEYS);  // 1 pass
+  test_sort(63, 5);        // Fewer keys than tasks
+  test_sort(63, 0);
+
+  threadpool_destroy(&tp);
+
+  printf("Done!\n");
+
+  return 0;
+}
@@ -0,0 +1,194 @@
+/**
+ * \file threadpool_bounded_test.c
+ * \brief Test threadpool task queue capacity and overflow policies.
+ *
+ * Exercises each overflow policy against a paused or busy threadpool,
+ * checks that THREADPOOL_OVERFLOW_INLINE does not overtake a pending barrier,
+ * and then floods a bounded threadpool with tasks, checking that every task runs
+ * and that the queue never grows past its capacity.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "threadpool.h"
+
+#define CAPACITY 8
+#define NUM_FLOOD_TASKS 100000
+
+struct threadpool tp;
+
+pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+size_t num_executed;
+
+pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gate_notify = PTHREAD_COND_INITIALIZER;
+int gate_open;
+
+void count_task(void *arg)
+{
+  pthread_mutex_lock(&count_lock);
+  num_executed += 1;
+  pthread_mutex_unlock(&count_lock);
+}
+
+// Record the thread that executed the task.
+void whoami_task(void *arg) { *(pthread_t *)arg = pthread_self(); }
+
+// Record the number of count_task()s executed before the task.
+void snapshot_task(void *arg)
+{
+  pthread_mutex_lock(&count_lock);
+  *(size_t *)arg = num_executed;
+  pthread_mutex_unlock(&count_lock);
+}
+
+// Block the executing worker until the gate is opened.
+void gate_task(void *arg)
+{
+  pthread_mutex_lock(&gate_lock);
+  while (!gate_open) {
+    pthread_cond_wait(&gate_notify, &gate_lock);
+  }
+  pthread_mutex_unlock(&gate_lock);
+}
+
+void open_gate()
+{
+  pthread_mutex_lock(&gate_lock);
+  gate_open = 1;
+  pthread_mutex_unlock(&gate_lock);
+  pthread_cond_broadcast(&gate_notify);
+}
+
+void fill_queue()
+{
+  threadpool_pause(&tp);
+  for (size_t i = 0; i < CAPACITY; ++i) {
+    assert(threadpool_push_task(&tp, (struct task){.func = count_task}) ==
+           CT_SUCCESS);
+  }
+  assert(threadpool_num_pending(&tp) == CAPACITY);
+}
+
+void drain_queue()
+{
+  threadpool_run(&tp);
+  threadpool_wait(&tp);
+  assert(threadpool_num_pending(&tp) == 0);
+}
+
+void test_fail()
+{
+  printf("Testing THREADPOOL_OVERFLOW_FAIL...\n");
+  threadpool_set_capacity(&tp, CAPACITY, THREADPOOL_OVERFLOW_FAIL);
+
+  fill_queue();
+  assert(threadpool_push_task(&tp, (struct task){.func = count_task}) ==
+         CT_EQUEUE_FULL);
+  drain_queue();
+}
+
+void test_inline()
+{
+  printf("Testing THREADPOOL_OVERFLOW_INLINE...\n");
+  threadpool_set_capacity(&tp, CAPACITY, THREADPOOL_OVERFLOW_INLINE);
+
+  pthread_t executor;
+
+  fill_queue();
+  assert(threadpool_push_task(&tp, (struct task){.func = whoami_task,
+                                                 .arg = &executor}) ==
+         CT_SUCCESS);
+  assert(pthread_equal(executor, pthread_self()));
+  assert(threadpool_num_pending(&tp) == CAPACITY);
+  drain_queue();
+}
+
+void test_inline_barrier()
+{
+  printf("Testing THREADPOOL_OVERFLOW_INLINE behind a barrier...\n");
+  threadpool_set_capacity(&tp, CAPACITY, THREADPOOL_OVERFLOW_INLINE);
+
+  size_t seen = 0;
+
+  pthread_mutex_lock(&count_lock);
+  num_executed = 0;
+  pthread_mutex_unlock(&count_lock);
+
+  // Fill the queue with tasks followed by a barrier. The task pushed next must
+  // wait for space rather than run ahead of them.
+  threadpool_pause(&tp);
+  for (size_t i = 0; i + 1 < CAPACITY; ++i) {
+    assert(threadpool_push_task(&tp, (struct task){.func = count_task}) ==
+           CT_SUCCESS);
+  }
+  assert(threadpool_push_barrier(&tp) == CT_SUCCESS);
+  assert(threadpool_num_pending(&tp) == CAPACITY);
+  assert(threadpool_push_task(&tp, (struct task){.func = snapshot_task,
+                                                 .arg = &seen}) ==
+         CT_SUCCESS);
+  drain_queue();
+
+  assert(seen == CAPACITY - 1);
+}
+
+void test_timeout()
+{
+  printf("Testing threadpool_try_push_task() timeout...\n");
+  threadpool_set_capacity(&tp, CAPACITY, THREADPOOL_OVERFLOW_BLOCK);
+
+  // Occupy the only worker, so that nothing drains the queue.
+  gate_open = 0;
+  threadpool_push_task(&tp, (struct task){.func = gate_task});
+  threadpool_run(&tp);
+  while (threadpool_num_pending(&tp) != 0) {}
+
+  for (size_t i = 0; i < CAPACITY; ++i) {
+    assert(threadpool_push_task(&tp, (struct task){.func = count_task}) ==
+           CT_SUCCESS);
+  }
+  assert(threadpool_try_push_task(&tp, (struct task){.func = count_task},
+                                  50) == CT_ETIMEDOUT);
+  assert(threadpool_num_pending(&tp) == CAPACITY);
+
+  open_gate();
+  threadpool_wait(&tp);
+}
+
+void test_block()
+{
+  printf("Testing THREADPOOL_OVERFLOW_BLOCK...\n");
+  threadpool_set_capacity(&tp, CAPACITY, THREADPOOL_OVERFLOW_BLOCK);
+
+  pthread_mutex_lock(&count_lock);
+  num_executed = 0;
+  pthread_mutex_unlock(&count_lock);
+
+  threadpool_pause(&tp);
+  for (size_t i = 0; i < NUM_FLOOD_TASKS; ++i) {
+    assert(threadpool_push_task(&tp, (struct task){.func = count_task}) ==
+           CT_SUCCESS);
+    assert(threadpool_num_pending(&tp) <= CAPACITY);
+  }
+  drain_queue();
+
+  assert(num_executed == NUM_FLOOD_TASKS);
+}
+
+int main(int argc, char *argv[])
+{
+  threadpool_init(&tp, 1);
+
+  test_fail();
+  test_inline();
+  test_inline_barrier();
+  test_timeout();
+  test_block();
+
+  printf("Done!\n");
+
+  return 0;
+}
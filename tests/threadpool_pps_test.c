@@ -15,6 +15,7 @@
 #include <sys/time.h>
 #include <unistd.h>
 
+#include "hugemem.h"
 #include "threadpool.h"
 #include "tictoc.h"
 
@@ -37,7 +38,8 @@ struct task_arg {
 void init()
 {
   printf("Allocating array...\n");
-  if ((array = malloc(NUM_ELEMS * sizeof(*array))) == NULL) {
+  // Pages are first touched in parallel, by randomize_array_task().
+  if ((array = hugemem_alloc(NUM_ELEMS * sizeof(*array), 0)) == NULL) {
     printf("Could not allocate array!\n");
     exit(1);
   }
@@ -132,7 +134,7 @@ void run_pps()
 
 void doublecheck_prepare()
 {
-  array2 = malloc(NUM_ELEMS * sizeof(*array2));
+  array2 = hugemem_alloc(NUM_ELEMS * sizeof(*array2), 0);
   if (array2 == NULL) {
     printf("Could not allocate doublecheck array!\n");
     exit(1);